@@ -0,0 +1,154 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "active.h"
+
+#include "manticore.h"
+
+#include "system.h"
+#include "futex.h"
+#include "kernel.h"
+
+#include <assert.h>
+
+static void active_schedule(struct active_scheduler * scheduler);
+static void active_deferred(struct deferred_work * work);
+
+void active_scheduler_init(struct active_scheduler * scheduler)
+{
+  scheduler->ready = 0;
+  for (uint32_t i = 0; i < ACTIVE_PRIORITIES; ++i)
+  {
+    scheduler->objects[i] = NULL;
+  }
+  scheduler->current = -1;
+  scheduler->host = NULL;
+  deferred_work_init(&scheduler->deferred, active_deferred);
+}
+
+void active_init(struct active_object * object,
+                 struct active_scheduler * scheduler,
+                 active_dispatch_t dispatch,
+                 uint8_t priority,
+                 uint32_t * events,
+                 uint32_t count)
+{
+  assert(dispatch != NULL);
+  assert(priority < ACTIVE_PRIORITIES);
+  assert(scheduler->objects[priority] == NULL);
+  assert(events != NULL);
+  assert(count > 0 && count <= UINT16_MAX);
+
+  object->dispatch = dispatch;
+  object->scheduler = scheduler;
+  object->priority = priority;
+  object->events = events;
+  object->size = count;
+  object->head = 0;
+  object->count = 0;
+  scheduler->objects[priority] = object;
+}
+
+bool active_post(struct active_object * object, uint32_t event)
+{
+  struct active_scheduler * scheduler = object->scheduler;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (object->count == object->size)
+  {
+    // The queue is full.
+    __set_PRIMASK(primask);
+    return false;
+  }
+  object->events[(object->head + object->count) % object->size] = event;
+  object->count++;
+  scheduler->ready |= 1u << object->priority;
+  __set_PRIMASK(primask);
+
+  if (SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk)
+  {
+    // We're in an ISR. The kernel will wake up the host.
+    kernel_defer(&scheduler->deferred);
+  }
+  else if (running_task == scheduler->host)
+  {
+    // An object posted the event. It's preempted right away
+    // if the event is for an object with a higher priority.
+    if (object->priority > scheduler->current)
+    {
+      active_schedule(scheduler);
+    }
+  }
+  else
+  {
+    wake_address(&scheduler->ready, 1);
+  }
+  return true;
+}
+
+void active_scheduler_run(struct active_scheduler * scheduler)
+{
+  assert(scheduler->host == NULL);
+  scheduler->host = running_task;
+  while (true)
+  {
+    active_schedule(scheduler);
+
+    // Block until an event is posted. The kernel checks that there's still
+    // nothing to dispatch before blocking.
+    wait_on_address(&scheduler->ready, 0, 0);
+  }
+}
+
+void active_schedule(struct active_scheduler * scheduler)
+{
+  // Dispatch the events of the objects with a higher priority than
+  // the one that's being dispatched, highest priority first.
+  int8_t previous = scheduler->current;
+  while (true)
+  {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t ready = scheduler->ready;
+    int8_t priority = -1;
+    while (ready != 0)
+    {
+      ready >>= 1;
+      priority++;
+    }
+    if (priority <= previous)
+    {
+      __set_PRIMASK(primask);
+      break;
+    }
+
+    struct active_object * object = scheduler->objects[priority];
+    uint32_t event = object->events[object->head];
+    object->head = (object->head + 1) % object->size;
+    object->count--;
+    if (object->count == 0)
+    {
+      scheduler->ready &= ~(1u << priority);
+    }
+    __set_PRIMASK(primask);
+
+    // The event runs to completion unless it posts an event to a higher priority object.
+    scheduler->current = priority;
+    object->dispatch(object, event);
+  }
+  scheduler->current = previous;
+}
+
+void active_deferred(struct deferred_work * work)
+{
+  struct active_scheduler * scheduler = container_of(work, struct active_scheduler, deferred);
+  futex_wake(&scheduler->ready, 1);
+}
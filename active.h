@@ -0,0 +1,66 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Active objects are run-to-completion event handlers that share the stack
+ * of a single host task. Each object has a priority and its own queue of
+ * events. Posting an event to an object with a higher priority than the one
+ * being dispatched dispatches it right away with a nested function call, the
+ * way a higher priority ISR preempts a lower priority one. No context is
+ * saved or restored when switching between objects. Events posted from other
+ * tasks and ISRs wake the host task which dispatches them by priority.
+ */
+
+#ifndef ACTIVE_H
+#define ACTIVE_H
+
+#include "kernel.h"
+#include "task.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of active object priorities. There's one object per priority.
+#define ACTIVE_PRIORITIES (32)
+
+struct active_scheduler;
+
+struct active_object
+{
+  void (*dispatch)(struct active_object * object, uint32_t event);
+  struct active_scheduler * scheduler;
+  uint8_t priority;
+
+  // The ring buffer of events waiting to be dispatched.
+  uint32_t * events;
+  uint16_t size;
+  uint16_t head;
+  uint16_t count;
+};
+
+struct active_scheduler
+{
+  // A bit per priority of the objects that have events waiting.
+  // The host task waits on this address when it's 0.
+  volatile uint32_t ready;
+
+  struct active_object * objects[ACTIVE_PRIORITIES];
+
+  // The priority of the object being dispatched or -1 when none are.
+  int8_t current;
+
+  // The task that the objects run on.
+  struct task * host;
+
+  // Wakes the host for the events posted from ISRs.
+  struct deferred_work deferred;
+};
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "barrier.h"
+
+#include "manticore.h"
+
+#include "syscall.h"
+#include "kernel.h"
+
+#include <assert.h>
+
+void barrier_init(struct barrier * barrier, uint32_t count)
+{
+  assert(count > 0);
+  static uint8_t barrier_id_counter = 0;
+  barrier->id = barrier_id_counter++;
+  barrier->count = count;
+  barrier->arrived = 0;
+  barrier->generation = 0;
+  pqueue_init(&barrier->waiting_tasks, pqueue_wait_compare);
+}
+
+bool barrier_wait(struct barrier * barrier)
+{
+  kernel_scheduler_disable();
+  barrier->arrived++;
+  if (barrier->arrived < barrier->count)
+  {
+    // Wait for the others to arrive.
+    running_task->barrier = barrier;
+    SVC_BARRIER_WAIT();
+    return false;
+  }
+
+  // We're the last one. Start a new cycle and release everyone.
+  barrier->arrived = 0;
+  barrier->generation++;
+  if (pqueue_empty(&barrier->waiting_tasks))
+  {
+    // This only happens for a barrier of 1 task.
+    kernel_scheduler_enable();
+  }
+  else
+  {
+    running_task->barrier = barrier;
+    SVC_BARRIER_RELEASE();
+  }
+  return true;
+}
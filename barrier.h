@@ -0,0 +1,37 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * A barrier blocks a set of tasks until all of them have reached it.
+ * The last task to arrive releases all the waiting tasks at once and
+ * the barrier can be used again right away for the next cycle.
+ */
+
+#ifndef BARRIER_H
+#define BARRIER_H
+
+#include "pqueue.h"
+#include "task.h"
+
+#include <stdint.h>
+
+struct barrier
+{
+  uint8_t id; // Unique identifier for this barrier.
+
+  uint32_t count;      // The number of tasks that need to arrive.
+  uint32_t arrived;    // The number of tasks that have arrived in this cycle.
+  uint32_t generation; // Incremented every time the barrier releases its tasks.
+
+  // The priority queue of tasks waiting for the others to arrive.
+  struct pqueue waiting_tasks;
+};
+
+#endif
@@ -15,6 +15,7 @@
 #include "syscall.h"
 #include "system.h"
 #include "kernel.h"
+#include "wait.h"
 
 #include <assert.h>
 
@@ -22,29 +23,49 @@ void channel_init(struct channel * channel)
 {
   static int channel_id = 0;
   channel->id = channel_id++;
-  list_init(&channel->waiting_tasks);
+  pqueue_init(&channel->waiting_tasks, pqueue_wait_compare);
+  pqueue_init(&channel->multi_waiters, pqueue_wait_object_compare);
   channel->receive = NULL;
   channel->reply = NULL;
   channel->server = NULL;
 }
 
 void channel_send(struct channel * channel, void * msg, size_t len, void * reply, size_t * reply_len)
+{
+  channel_timed_send(channel, msg, len, reply, reply_len, 0);
+}
+
+bool channel_timed_send(struct channel * channel, void * msg, size_t len, void * reply, size_t * reply_len, uint32_t milliseconds)
 {
   running_task->channel = channel;
   running_task->channel_msg = msg;
   running_task->channel_len = len;
   running_task->channel_reply = reply;
   running_task->channel_reply_len = reply_len;
+  running_task->sleep = milliseconds;
+  running_task->timed_out = false;
   SVC_CHANNEL_SEND();
+  return !running_task->timed_out;
 }
 
 size_t channel_recv(struct channel * channel, void * msg, size_t len)
+{
+  channel_timed_recv(channel, msg, &len, 0);
+  return len;
+}
+
+bool channel_timed_recv(struct channel * channel, void * msg, size_t * len, uint32_t milliseconds)
 {
   running_task->channel = channel;
   running_task->channel_msg = msg;
-  running_task->channel_len = len;
+  running_task->channel_len = *len;
+  running_task->sleep = milliseconds;
+  running_task->timed_out = false;
   SVC_CHANNEL_RECV();
-  return running_task->channel_len;
+  if (running_task->timed_out)
+    return false;
+  *len = running_task->channel_len;
+  return true;
 }
 
 void channel_reply(struct channel * channel, void * msg, size_t len)
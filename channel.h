@@ -18,15 +18,18 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
-#include "list.h"
+#include "pqueue.h"
 #include "task.h"
 
 struct channel
 {
   int id;
 
-  // The list of tasks that have sent messages.
-  struct list_head waiting_tasks;
+  // The priority queue of tasks that have sent messages.
+  struct pqueue waiting_tasks;
+
+  // The priority queue of tasks waiting for a message with wait_multiple().
+  struct pqueue multi_waiters;
 
   struct task * receive; // The task waiting for a message.
   struct task * reply; // The task waiting for a reply.
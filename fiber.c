@@ -0,0 +1,139 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "fiber.h"
+
+#include "manticore.h"
+
+#include "utils.h"
+
+#include <assert.h>
+
+void fiber_host_init(struct fiber_host * host, struct wait_object * objects, uint32_t count)
+{
+  assert(objects != NULL || count == 0);
+  list_init(&host->fibers);
+  host->objects = objects;
+  host->max_objects = count;
+}
+
+void fiber_start(struct fiber_host * host, struct fiber * fiber, fiber_entry_t entry, void * arg)
+{
+  assert(entry != NULL);
+  fiber->entry = entry;
+  fiber->arg = arg;
+  fiber->resume = 0;
+  fiber->timer = false;
+  fiber->wakeup = 0;
+  fiber->channel = NULL;
+  list_push_back(&host->fibers, &fiber->node);
+}
+
+void fiber_host_run(struct fiber_host * host)
+{
+  while (!list_empty(&host->fibers))
+  {
+    // Run every fiber once.
+    bool progress = false;
+    uint32_t count = 0;
+    uint32_t conditions = 0;
+    bool timed = false;
+    uint32_t timeout = UINT32_MAX;
+    uint32_t now = manticore_time();
+
+    struct list_head * node;
+    list_for_each_safe(node, &host->fibers)
+    {
+      struct fiber * fiber = container_of(node, struct fiber, node);
+
+      // The fiber tells us what it's waiting on each time it runs.
+      fiber->timer = false;
+      fiber->channel = NULL;
+      uint8_t result = fiber->entry(fiber);
+
+      if (result == FIBER_DONE)
+      {
+        list_remove(&fiber->node);
+        progress = true;
+      }
+      else if (result != FIBER_WAITING)
+      {
+        // The fiber ran. It may have changed what the others are waiting on.
+        progress = true;
+      }
+      else
+      {
+        // The fiber is still waiting and nothing happened since it last ran.
+        if (fiber->channel == NULL && !fiber->timer)
+        {
+          // Only other tasks can change its condition.
+          conditions++;
+        }
+        if (fiber->channel != NULL)
+        {
+          assert(count < host->max_objects);
+          wait_object_init(&host->objects[count++], WAIT_OBJECT_CHANNEL, fiber->channel);
+        }
+        if (fiber->timer)
+        {
+          int32_t left = (int32_t)(fiber->wakeup - now);
+          timeout = MIN(timeout, (uint32_t)MAX(left, 1));
+          timed = true;
+        }
+      }
+    }
+
+    if (progress)
+    {
+      // Run the fibers again before blocking.
+      continue;
+    }
+
+    if (conditions > 0)
+    {
+      // There's nothing to block on for these so poll them every millisecond.
+      timeout = 1;
+      timed = true;
+    }
+
+    if (count > 0)
+    {
+      wait_multiple(host->objects, count, timed ? timeout : 0);
+    }
+    else if (timed)
+    {
+      task_delay(timeout);
+    }
+  }
+}
+
+void * fiber_arg(struct fiber * fiber)
+{
+  return fiber->arg;
+}
+
+void fiber_timer_start(struct fiber * fiber, uint32_t milliseconds)
+{
+  fiber->wakeup = manticore_time() + milliseconds;
+}
+
+bool fiber_timer_expired(struct fiber * fiber)
+{
+  fiber->timer = (int32_t)(manticore_time() - fiber->wakeup) < 0;
+  return !fiber->timer;
+}
+
+bool fiber_channel_ready(struct fiber * fiber, struct channel * channel)
+{
+  // A channel is ready when a task has sent a message to it.
+  bool ready = !pqueue_empty(&channel->waiting_tasks);
+  fiber->channel = ready ? NULL : channel;
+  return ready;
+}
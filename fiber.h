@@ -0,0 +1,54 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Fibers are stackless protothreads that are driven by a host task.
+ * A fiber is a function that's called again every time the host runs it.
+ * It returns when it has to wait and remembers the line to resume from.
+ * Local variables aren't kept between runs so a fiber only costs the few
+ * bytes of its struct. The host runs its fibers in turn and only blocks
+ * once none of them can make progress. It then waits on every channel and
+ * timer that its fibers are waiting on with a single wait_multiple().
+ */
+
+#ifndef FIBER_H
+#define FIBER_H
+
+#include "list.h"
+#include "channel.h"
+#include "wait.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct fiber
+{
+  uint8_t (*entry)(struct fiber * fiber);
+  void * arg;
+
+  uint16_t resume;           // The line that the fiber resumes from. 0 starts it from the top.
+  bool timer;                // True while the fiber is waiting for its timer.
+  uint32_t wakeup;           // When the timer expires. See manticore_time().
+  struct channel * channel;  // The channel that the fiber is waiting on or NULL.
+
+  struct list_head node;     // Queued on the host until the fiber is done.
+};
+
+struct fiber_host
+{
+  // The fibers that aren't done.
+  struct list_head fibers;
+
+  // The wait objects used to block on the channels that the fibers are waiting on.
+  struct wait_object * objects;
+  uint32_t max_objects;
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "futex.h"
+
+#include "manticore.h"
+
+#include "system.h"
+#include "syscall.h"
+#include "kernel.h"
+
+#include <assert.h>
+
+static struct pqueue futex_queues[FUTEX_QUEUES];
+
+// The cortex-m0 has no exclusive load/store instructions.
+// Masking interrupts for a couple of instructions is the cheapest way
+// to get an atomic read-modify-write.
+static uint32_t futex_cmpxchg(volatile uint32_t * address, uint32_t expected, uint32_t desired);
+static uint32_t futex_xchg(volatile uint32_t * address, uint32_t desired);
+
+void futex_init(void)
+{
+  for (uint32_t i = 0; i < FUTEX_QUEUES; ++i)
+  {
+    pqueue_init(&futex_queues[i], pqueue_wait_compare);
+  }
+}
+
+struct pqueue * futex_queue(volatile uint32_t * address)
+{
+  // The addresses are word aligned so the 2 lowest bits are useless.
+  return &futex_queues[((uintptr_t)address >> 2) & (FUTEX_QUEUES - 1)];
+}
+
+bool wait_on_address(volatile uint32_t * address, uint32_t expected, uint32_t milliseconds)
+{
+  assert(address != NULL);
+  running_task->futex_address = address;
+  running_task->futex_value = expected;
+  running_task->sleep = milliseconds;
+  SVC_FUTEX_WAIT();
+  return running_task->futex_woken;
+}
+
+uint32_t wake_address(volatile uint32_t * address, uint32_t count)
+{
+  assert(address != NULL);
+  kernel_scheduler_disable();
+  if (pqueue_empty(futex_queue(address)))
+  {
+    // No one is waiting on this address or any other address in its queue.
+    kernel_scheduler_enable();
+    return 0;
+  }
+
+  running_task->futex_address = address;
+  running_task->futex_value = count;
+  SVC_FUTEX_WAKE();
+  return running_task->futex_value;
+}
+
+uint32_t futex_wake(volatile uint32_t * address, uint32_t count)
+{
+  uint32_t woken = 0;
+
+  // The queue is sorted by priority so the highest priority tasks are woken up first.
+  // Other addresses can share the same queue so they're skipped.
+  struct list_head * node;
+  list_for_each_safe(node, &futex_queue(address)->list)
+  {
+    if (woken == count)
+      break;
+    struct task * waiter = task_from_wait_node(node);
+    if (waiter->futex_address == address)
+    {
+      task_stop_waiting(waiter);
+      list_remove(&waiter->sleep_node); // Stop sleeping in case of a timeout.
+      waiter->futex_woken = true;
+      waiter->state = STATE_READY;
+      task_wait_on(waiter, &ready_tasks);
+      woken++;
+    }
+  }
+  return woken;
+}
+
+void futex_mutex_init(struct futex_mutex * mutex)
+{
+  mutex->state = 0;
+}
+
+void futex_mutex_lock(struct futex_mutex * mutex)
+{
+  uint32_t state = futex_cmpxchg(&mutex->state, 0, 1);
+  if (state == 0)
+  {
+    // The mutex was unlocked. We didn't need the kernel.
+    return;
+  }
+
+  // Mark the mutex as contended so that the owner wakes us up when unlocking.
+  // We don't know if other tasks are waiting so it stays contended once we have it.
+  if (state != 2)
+  {
+    state = futex_xchg(&mutex->state, 2);
+  }
+  while (state != 0)
+  {
+    wait_on_address(&mutex->state, 2, 0);
+    state = futex_xchg(&mutex->state, 2);
+  }
+}
+
+bool futex_mutex_trylock(struct futex_mutex * mutex)
+{
+  return futex_cmpxchg(&mutex->state, 0, 1) == 0;
+}
+
+void futex_mutex_unlock(struct futex_mutex * mutex)
+{
+  if (futex_xchg(&mutex->state, 0) == 2)
+  {
+    // Someone may be waiting for the mutex.
+    wake_address(&mutex->state, 1);
+  }
+}
+
+uint32_t futex_cmpxchg(volatile uint32_t * address, uint32_t expected, uint32_t desired)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t value = *address;
+  if (value == expected)
+  {
+    *address = desired;
+  }
+  __set_PRIMASK(primask);
+  return value;
+}
+
+uint32_t futex_xchg(volatile uint32_t * address, uint32_t desired)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t value = *address;
+  *address = desired;
+  __set_PRIMASK(primask);
+  return value;
+}
@@ -0,0 +1,48 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Waiting on an address is the building block for synchronization primitives
+ * that live outside the kernel. A task only enters the kernel when it needs
+ * to block or when there may be another task to wake up. The tasks are queued
+ * by priority in a small hash table of queues indexed by address.
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include "pqueue.h"
+#include "task.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of queues in the hash table. Must be a power of 2.
+#define FUTEX_QUEUES (8)
+
+// A mutex built on top of wait_on_address() and wake_address().
+// There's no priority inheritance but locking and unlocking never
+// enter the kernel when the mutex isn't contended.
+struct futex_mutex
+{
+  // 0 when unlocked, 1 when locked and 2 when locked with possible waiters.
+  volatile uint32_t state;
+};
+
+void futex_init(void);
+
+// Returns the queue of tasks waiting on an address.
+struct pqueue * futex_queue(volatile uint32_t * address);
+
+// Wakes up to <count> tasks waiting on an address and returns how many were woken.
+// Must be called from the kernel.
+uint32_t futex_wake(volatile uint32_t * address, uint32_t count);
+
+#endif
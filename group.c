@@ -0,0 +1,93 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "group.h"
+
+#include "manticore.h"
+
+#include "syscall.h"
+#include "kernel.h"
+
+#include <assert.h>
+
+void group_init(struct task_group * group)
+{
+  group->tasks = NULL;
+  group->count = 0;
+  group->remaining = 0;
+  group->joined = true;
+  group->joiner = NULL;
+  group->results = NULL;
+}
+
+void group_spawn(struct task_group * group,
+                 struct task * tasks,
+                 void * stacks,
+                 uint32_t stack_size,
+                 uint32_t count,
+                 task_entry_t entry,
+                 void ** args,
+                 uint8_t priority)
+{
+  assert(group->joined); // The previous batch must have been joined.
+  assert((stack_size & 7) == 0);
+  assert(count > 0);
+
+  // Start every member before deciding who runs next.
+  if (kernel_running)
+  {
+    kernel_scheduler_disable();
+  }
+  group->tasks = tasks;
+  group->count = count;
+  group->remaining = count;
+  group->joined = false;
+  group->joiner = NULL;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    task_setup(&tasks[i], (uint8_t*)stacks + i * stack_size, stack_size);
+    tasks[i].slab = NULL;
+    task_start(&tasks[i], entry, args != NULL ? args[i] : NULL, stack_size, priority);
+    tasks[i].group = group;
+  }
+  if (kernel_running)
+  {
+    task_reschedule();
+  }
+}
+
+void group_join_all(struct task_group * group, void ** results)
+{
+  running_task->group_joining = group;
+  group->results = results;
+  SVC_GROUP_JOIN();
+}
+
+void group_collect(struct task_group * group)
+{
+  assert(group->remaining == 0);
+  for (uint32_t i = 0; i < group->count; ++i)
+  {
+    struct task * member = &group->tasks[i];
+    assert(member->state == STATE_ZOMBIE);
+    if (group->results != NULL)
+    {
+      group->results[i] = member->wait_result;
+    }
+    task_destroy(member);
+  }
+
+  // The group can be spawned again. Joining it again returns right away.
+  group->tasks = NULL;
+  group->count = 0;
+  group->joined = true;
+  group->joiner = NULL;
+  group->results = NULL;
+}
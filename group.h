@@ -0,0 +1,41 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * A task group starts a batch of tasks with a single scheduling decision
+ * and lets their creator collect all their return values with a single
+ * system call. The members don't wake their creator when they return.
+ * The last member to return hands all the results over at once.
+ */
+
+#ifndef GROUP_H
+#define GROUP_H
+
+#include "task.h"
+
+#include <stdint.h>
+
+struct task_group
+{
+  struct task * tasks;   // The members of the group.
+  uint32_t count;        // The number of members.
+  uint32_t remaining;    // The number of members that haven't returned.
+  bool joined;           // The results of the last batch were collected.
+
+  // The task waiting in group_join_all() and where it wants the results.
+  struct task * joiner;
+  void ** results;
+};
+
+// Gives the results of the members to the joiner, destroys them and empties the group.
+// Must be called from the kernel once every member has returned.
+void group_collect(struct task_group * group);
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "heap.h"
+
+#include "manticore.h"
+
+#include "kernel.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <assert.h>
+
+// The flags stored in the lowest bits of the block size.
+#define BLOCK_FREE      (1 << 0)
+#define BLOCK_PREV_FREE (1 << 1)
+
+// The bytes that come before the memory of an allocated block.
+#define BLOCK_OVERHEAD  (offsetof(struct heap_block, next_free))
+
+// A free block must be able to hold the free list pointers.
+#define BLOCK_MIN_SIZE  (sizeof(struct heap_block) - BLOCK_OVERHEAD)
+#define BLOCK_MAX_SIZE  ((size_t)1 << (HEAP_FL_COUNT + HEAP_FL_SHIFT - 1))
+
+static uint32_t heap_fls(uint32_t word);
+static uint32_t heap_ffs(uint32_t word);
+static void heap_mapping(size_t size, uint32_t * fl, uint32_t * sl);
+static struct heap_block * heap_find_free(struct heap * heap, uint32_t * fl, uint32_t * sl);
+static void heap_insert(struct heap * heap, struct heap_block * block);
+static void heap_remove(struct heap * heap, struct heap_block * block);
+static void heap_remove_from(struct heap * heap, struct heap_block * block, uint32_t fl, uint32_t sl);
+
+static size_t block_size(struct heap_block * block);
+static void block_set_size(struct heap_block * block, size_t size);
+static struct heap_block * block_next(struct heap_block * block);
+
+void heap_init(struct heap * heap, void * buffer, size_t size)
+{
+  assert(buffer != NULL);
+  assert(((uintptr_t)buffer & (HEAP_ALIGN - 1)) == 0);
+
+  heap->fl_bitmap = 0;
+  for (uint32_t i = 0; i < HEAP_FL_COUNT; ++i)
+  {
+    heap->sl_bitmap[i] = 0;
+    for (uint32_t j = 0; j < HEAP_SL_COUNT; ++j)
+    {
+      heap->blocks[i][j] = NULL;
+    }
+  }
+
+  // The whole buffer is one free block followed by an empty allocated block.
+  // The empty block keeps the last real block from being merged past the end.
+  assert(size >= 2 * BLOCK_OVERHEAD + BLOCK_MIN_SIZE);
+  size = (size - 2 * BLOCK_OVERHEAD) & ~(HEAP_ALIGN - 1);
+  assert(size < BLOCK_MAX_SIZE);
+
+  struct heap_block * block = (struct heap_block *)buffer;
+  block->prev_phys = NULL;
+  block->size = size | BLOCK_FREE;
+
+  struct heap_block * sentinel = block_next(block);
+  sentinel->prev_phys = block;
+  sentinel->size = 0 | BLOCK_PREV_FREE;
+
+  heap->size = size + BLOCK_OVERHEAD;
+  heap->used = 0;
+  heap->peak = 0;
+  heap_insert(heap, block);
+}
+
+void * heap_alloc(struct heap * heap, size_t size)
+{
+  if (size == 0 || size >= BLOCK_MAX_SIZE)
+    return NULL;
+  size = MAX(BLOCK_MIN_SIZE, (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1));
+
+  // Round the size up to the next list so that any block in the list is big enough.
+  size_t rounded = size;
+  if (rounded >= HEAP_SMALL_SIZE)
+    rounded += (1 << (heap_fls(rounded) - HEAP_SL_LOG2)) - 1;
+
+  uint32_t fl, sl;
+  heap_mapping(rounded, &fl, &sl);
+  if (fl >= HEAP_FL_COUNT)
+    return NULL;
+
+  kernel_scheduler_disable();
+  struct heap_block * block = heap_find_free(heap, &fl, &sl);
+  if (block == NULL)
+  {
+    kernel_scheduler_enable();
+    return NULL;
+  }
+  heap_remove_from(heap, block, fl, sl);
+
+  // Give back what we don't need if it's big enough to be a block.
+  size_t available = block_size(block);
+  if (available >= size + BLOCK_OVERHEAD + BLOCK_MIN_SIZE)
+  {
+    block_set_size(block, size);
+    struct heap_block * remainder = block_next(block);
+    remainder->prev_phys = block;
+    remainder->size = (available - size - BLOCK_OVERHEAD) | BLOCK_FREE;
+    block_next(remainder)->prev_phys = remainder;
+    heap_insert(heap, remainder);
+  }
+  else
+  {
+    block_next(block)->size &= ~BLOCK_PREV_FREE;
+  }
+  block->size &= ~BLOCK_FREE;
+
+  heap->used += block_size(block) + BLOCK_OVERHEAD;
+  if (heap->used > heap->peak)
+    heap->peak = heap->used;
+  kernel_scheduler_enable();
+  return &block->next_free;
+}
+
+void heap_free(struct heap * heap, void * ptr)
+{
+  if (ptr == NULL)
+    return;
+
+  struct heap_block * block = (struct heap_block *)((uint8_t*)ptr - BLOCK_OVERHEAD);
+  assert(!(block->size & BLOCK_FREE));
+
+  kernel_scheduler_disable();
+  heap->used -= block_size(block) + BLOCK_OVERHEAD;
+  block->size |= BLOCK_FREE;
+
+  // Merge with the previous block if it's free.
+  if (block->size & BLOCK_PREV_FREE)
+  {
+    struct heap_block * prev = block->prev_phys;
+    heap_remove(heap, prev);
+    block_set_size(prev, block_size(prev) + block_size(block) + BLOCK_OVERHEAD);
+    block = prev;
+  }
+
+  // Merge with the next block if it's free.
+  struct heap_block * next = block_next(block);
+  if (next->size & BLOCK_FREE)
+  {
+    heap_remove(heap, next);
+    block_set_size(block, block_size(block) + block_size(next) + BLOCK_OVERHEAD);
+    next = block_next(block);
+  }
+
+  next->prev_phys = block;
+  next->size |= BLOCK_PREV_FREE;
+  heap_insert(heap, block);
+  kernel_scheduler_enable();
+}
+
+size_t heap_used(struct heap * heap)
+{
+  return heap->used;
+}
+
+size_t heap_peak(struct heap * heap)
+{
+  return heap->peak;
+}
+
+uint32_t heap_fragmentation(struct heap * heap)
+{
+  kernel_scheduler_disable();
+  size_t free = heap->size - heap->used;
+  size_t largest = 0;
+  if (heap->fl_bitmap)
+  {
+    // The largest block is in the highest non-empty list.
+    // The blocks in a list aren't sorted so we have to look at all of them.
+    uint32_t fl = heap_fls(heap->fl_bitmap);
+    uint32_t sl = heap_fls(heap->sl_bitmap[fl]);
+    for (struct heap_block * block = heap->blocks[fl][sl]; block != NULL; block = block->next_free)
+    {
+      largest = MAX(largest, block_size(block) + BLOCK_OVERHEAD);
+    }
+  }
+  kernel_scheduler_enable();
+
+  // The percentage of the free memory that isn't in the largest free block.
+  if (free == 0)
+    return 0;
+  return 100 - largest * 100 / free;
+}
+
+uint32_t heap_fls(uint32_t word)
+{
+  // The cortex-m0 has no count leading zeros instruction.
+  // A binary search takes the same time for any word.
+  assert(word != 0);
+  uint32_t bit = 0;
+  if (word & 0xFFFF0000) { word >>= 16; bit += 16; }
+  if (word & 0xFF00) { word >>= 8; bit += 8; }
+  if (word & 0xF0) { word >>= 4; bit += 4; }
+  if (word & 0xC) { word >>= 2; bit += 2; }
+  if (word & 0x2) { bit += 1; }
+  return bit;
+}
+
+uint32_t heap_ffs(uint32_t word)
+{
+  // Isolate the lowest set bit.
+  return heap_fls(word & (~word + 1));
+}
+
+void heap_mapping(size_t size, uint32_t * fl, uint32_t * sl)
+{
+  if (size < HEAP_SMALL_SIZE)
+  {
+    *fl = 0;
+    *sl = size / (HEAP_SMALL_SIZE / HEAP_SL_COUNT);
+  }
+  else
+  {
+    uint32_t bit = heap_fls(size);
+    *sl = (size >> (bit - HEAP_SL_LOG2)) ^ HEAP_SL_COUNT;
+    *fl = bit - (HEAP_FL_SHIFT - 1);
+  }
+}
+
+struct heap_block * heap_find_free(struct heap * heap, uint32_t * fl, uint32_t * sl)
+{
+  // Look for a list in the same first level with blocks at least as big.
+  uint32_t sl_map = heap->sl_bitmap[*fl] & (~0U << *sl);
+  if (!sl_map)
+  {
+    // Look in the next first levels.
+    uint32_t fl_map = heap->fl_bitmap & (~0U << (*fl + 1));
+    if (!fl_map)
+      return NULL;
+    *fl = heap_ffs(fl_map);
+    sl_map = heap->sl_bitmap[*fl];
+  }
+  *sl = heap_ffs(sl_map);
+  return heap->blocks[*fl][*sl];
+}
+
+void heap_insert(struct heap * heap, struct heap_block * block)
+{
+  uint32_t fl, sl;
+  heap_mapping(block_size(block), &fl, &sl);
+  struct heap_block * head = heap->blocks[fl][sl];
+  block->next_free = head;
+  block->prev_free = NULL;
+  if (head != NULL)
+    head->prev_free = block;
+  heap->blocks[fl][sl] = block;
+  heap->fl_bitmap |= 1 << fl;
+  heap->sl_bitmap[fl] |= 1 << sl;
+}
+
+void heap_remove(struct heap * heap, struct heap_block * block)
+{
+  uint32_t fl, sl;
+  heap_mapping(block_size(block), &fl, &sl);
+  heap_remove_from(heap, block, fl, sl);
+}
+
+void heap_remove_from(struct heap * heap, struct heap_block * block, uint32_t fl, uint32_t sl)
+{
+  if (block->next_free != NULL)
+    block->next_free->prev_free = block->prev_free;
+  if (block->prev_free != NULL)
+  {
+    block->prev_free->next_free = block->next_free;
+  }
+  else
+  {
+    // The block was the head of the list.
+    heap->blocks[fl][sl] = block->next_free;
+    if (block->next_free == NULL)
+    {
+      heap->sl_bitmap[fl] &= ~(1 << sl);
+      if (!heap->sl_bitmap[fl])
+        heap->fl_bitmap &= ~(1 << fl);
+    }
+  }
+}
+
+size_t block_size(struct heap_block * block)
+{
+  return block->size & ~(size_t)(BLOCK_FREE | BLOCK_PREV_FREE);
+}
+
+void block_set_size(struct heap_block * block, size_t size)
+{
+  block->size = size | (block->size & (BLOCK_FREE | BLOCK_PREV_FREE));
+}
+
+struct heap_block * block_next(struct heap_block * block)
+{
+  return (struct heap_block *)((uint8_t*)&block->next_free + block_size(block));
+}
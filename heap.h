@@ -0,0 +1,73 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * A two-level segregated fit (TLSF) heap for variable size allocations.
+ * The free blocks are kept in lists indexed by a first level (the power
+ * of 2 of their size) and a second level (a linear split of that power).
+ * A bitmap per level tells which lists have blocks so the list to
+ * allocate from is found with a couple of bit scans instead of a search.
+ * Neighbouring free blocks are merged when a block is freed.
+ * Allocating and freeing are constant time.
+ *
+ * http://www.gii.upv.es/tlsf/
+ */
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The blocks are 4 byte aligned.
+#define HEAP_ALIGN_LOG2 (2)
+#define HEAP_ALIGN      (1 << HEAP_ALIGN_LOG2)
+
+// Each power of 2 is split in 4 second level lists.
+#define HEAP_SL_LOG2    (2)
+#define HEAP_SL_COUNT   (1 << HEAP_SL_LOG2)
+
+// Blocks smaller than this all go in the first level 0 lists.
+#define HEAP_FL_SHIFT   (HEAP_SL_LOG2 + HEAP_ALIGN_LOG2)
+#define HEAP_SMALL_SIZE (1 << HEAP_FL_SHIFT)
+
+// Enough first levels for blocks up to 64KB.
+#define HEAP_FL_COUNT   (13)
+
+struct heap_block
+{
+  // The previous block in memory. Only valid when it's free.
+  struct heap_block * prev_phys;
+
+  // The size of the block excluding the header. The 2 lowest bits are flags.
+  size_t size;
+
+  // The neighbours in the free list. Only valid when the block is free,
+  // otherwise this is where the allocated memory starts.
+  struct heap_block * next_free;
+  struct heap_block * prev_free;
+};
+
+struct heap
+{
+  // Bit i of the first level bitmap is set when the second level bitmap i isn't empty.
+  // Bit j of second level bitmap i is set when the list blocks[i][j] isn't empty.
+  uint32_t fl_bitmap;
+  uint8_t sl_bitmap[HEAP_FL_COUNT];
+  struct heap_block * blocks[HEAP_FL_COUNT][HEAP_SL_COUNT];
+
+  // The bytes available when nothing is allocated and the bytes that are used
+  // now and at most. These include the block headers.
+  size_t size;
+  size_t used;
+  size_t peak;
+};
+
+#endif
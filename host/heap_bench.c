@@ -0,0 +1,206 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * A host benchmark that runs the same random allocation traces through the
+ * TLSF heap and the C library's malloc. It reports the average and worst
+ * case time of an allocation and how much memory each allocator spans
+ * compared to the peak number of bytes that were live at once.
+ *
+ * heap.c only needs kernel_scheduler_disable() and kernel_scheduler_enable()
+ * from the kernel so they're stubbed out and heap.c is built in directly.
+ * Build it from the root of the tree with the host compiler:
+ *
+ *   cc -O2 -std=gnu99 -I. -o heap_bench host/heap_bench.c && ./heap_bench
+ */
+
+// Keep the target headers out. heap.c includes them for the scheduler lock.
+#define MANTICORE_H
+#define KERNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+static uint32_t scheduler_disabled = 0;
+
+void kernel_scheduler_disable(void)
+{
+  scheduler_disabled++;
+}
+
+void kernel_scheduler_enable(void)
+{
+  scheduler_disabled--;
+}
+
+#include "heap.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The size of the region given to the TLSF heap. The traces stay well under it.
+#define HEAP_BENCH_SIZE (48 * 1024)
+
+// The number of blocks that can be live at once and the number of operations per trace.
+#define HEAP_BENCH_SLOTS (128)
+#define HEAP_BENCH_OPS (200000)
+
+// Each trace runs this many times. The host preempts us and takes page faults
+// so the worst case reported is the smallest one of the runs.
+#define HEAP_BENCH_RUNS (5)
+
+struct allocator
+{
+  const char * name;
+  void * (*alloc)(size_t size);
+  void (*free)(void * ptr);
+};
+
+struct result
+{
+  uint64_t total_ns;   // The time spent in all the allocations.
+  uint64_t worst_ns;   // The longest allocation.
+  uint32_t allocs;
+  uint32_t failures;   // The allocations that returned NULL.
+  size_t peak_live;    // The most requested bytes that were live at once.
+  size_t span;         // The bytes from the lowest block to the end of the highest one.
+};
+
+static struct heap heap;
+static uint32_t heap_buffer[HEAP_BENCH_SIZE / sizeof(uint32_t)];
+
+static void * tlsf_alloc(size_t size)
+{
+  return heap_alloc(&heap, size);
+}
+
+static void tlsf_free(void * ptr)
+{
+  heap_free(&heap, ptr);
+}
+
+static const struct allocator allocators[] = {
+  {.name = "tlsf", .alloc = tlsf_alloc, .free = tlsf_free},
+  {.name = "malloc", .alloc = malloc, .free = free},
+};
+
+// The size distributions of the traces.
+static size_t size_small(uint32_t r) { return 1 + r % 64; }
+static size_t size_wide(uint32_t r) { return 1 + r % 1024; }
+static size_t size_skewed(uint32_t r)
+{
+  // Mostly small blocks with the odd large one.
+  return (r % 16 == 0) ? 256 + (r >> 4) % 1024 : 1 + (r >> 4) % 48;
+}
+
+static const struct
+{
+  const char * name;
+  size_t (*size)(uint32_t r);
+} distributions[] = {
+  {"1-64 bytes", size_small},
+  {"1-1024 bytes", size_wide},
+  {"skewed", size_skewed},
+};
+
+static uint32_t bench_random(uint32_t * seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+}
+
+static uint64_t bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct result bench_run(const struct allocator * allocator, size_t (*size)(uint32_t r))
+{
+  // Every allocator gets the same trace. Each operation frees a random
+  // slot if it holds a block and fills it with a new block otherwise.
+  static uint8_t * blocks[HEAP_BENCH_SLOTS];
+  static size_t sizes[HEAP_BENCH_SLOTS];
+  struct result result = {0};
+  uintptr_t low = UINTPTR_MAX;
+  uintptr_t high = 0;
+  size_t live = 0;
+  uint32_t seed = 1;
+
+  memset(blocks, 0, sizeof(blocks));
+  heap_init(&heap, heap_buffer, sizeof(heap_buffer));
+  for (uint32_t op = 0; op < HEAP_BENCH_OPS; ++op)
+  {
+    uint32_t slot = bench_random(&seed) % HEAP_BENCH_SLOTS;
+    if (blocks[slot] != NULL)
+    {
+      allocator->free(blocks[slot]);
+      blocks[slot] = NULL;
+      live -= sizes[slot];
+      continue;
+    }
+
+    sizes[slot] = size(bench_random(&seed));
+    uint64_t start = bench_now();
+    blocks[slot] = allocator->alloc(sizes[slot]);
+    uint64_t elapsed = bench_now() - start;
+    result.total_ns += elapsed;
+    result.worst_ns = elapsed > result.worst_ns ? elapsed : result.worst_ns;
+    result.allocs++;
+    if (blocks[slot] == NULL)
+    {
+      result.failures++;
+      continue;
+    }
+
+    // Touch the block like a real user would.
+    memset(blocks[slot], slot, sizes[slot]);
+    live += sizes[slot];
+    result.peak_live = live > result.peak_live ? live : result.peak_live;
+    low = (uintptr_t)blocks[slot] < low ? (uintptr_t)blocks[slot] : low;
+    high = (uintptr_t)blocks[slot] + sizes[slot] > high ? (uintptr_t)blocks[slot] + sizes[slot] : high;
+  }
+
+  for (uint32_t slot = 0; slot < HEAP_BENCH_SLOTS; ++slot)
+  {
+    if (blocks[slot] != NULL)
+      allocator->free(blocks[slot]);
+  }
+  result.span = high - low;
+  return result;
+}
+
+int main(void)
+{
+  printf("%-14s %-8s %10s %10s %8s %10s %10s %8s\n",
+         "distribution", "alloc", "avg ns", "worst ns", "fails", "peak live", "span", "span/live");
+  for (size_t d = 0; d < sizeof(distributions) / sizeof(distributions[0]); ++d)
+  {
+    for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a)
+    {
+      // The first run also faults in the memory. It isn't counted.
+      bench_run(&allocators[a], distributions[d].size);
+      struct result r = bench_run(&allocators[a], distributions[d].size);
+      for (uint32_t run = 1; run < HEAP_BENCH_RUNS; ++run)
+      {
+        struct result next = bench_run(&allocators[a], distributions[d].size);
+        r.worst_ns = next.worst_ns < r.worst_ns ? next.worst_ns : r.worst_ns;
+      }
+      printf("%-14s %-8s %10.1f %10llu %8u %10zu %10zu %8.2f\n",
+             distributions[d].name, allocators[a].name,
+             (double)r.total_ns / r.allocs, (unsigned long long)r.worst_ns, r.failures,
+             r.peak_live, r.span, (double)r.span / r.peak_live);
+    }
+  }
+  return scheduler_disabled == 0 ? 0 : 1;
+}
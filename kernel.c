@@ -18,6 +18,15 @@
 #include "utils.h"
 #include "clock.h"
 #include "mutex.h"
+#include "channel.h"
+#include "wait.h"
+#include "barrier.h"
+#include "rcu.h"
+#include "futex.h"
+#include "mempool.h"
+#include "group.h"
+#include "workqueue.h"
+#include "partition.h"
 #include "list.h"
 
 #include <stdint.h>
@@ -41,9 +50,41 @@ struct task * running_task = NULL;
 bool kernel_running = false;
 
 struct pqueue ready_tasks;
+struct pqueue preempted_tasks;
 static struct list_head sleeping_tasks;
+struct list_head budgeted_tasks;
 
-static struct task * get_next_task(struct list_head * list);
+// The work deferred by ISRs. Interrupts are masked while it's updated.
+static struct list_head deferred_works;
+
+// True while a task has the scheduler disabled. ISRs can't check the SysTick
+// control register since reading it would clear the count flag.
+static volatile bool scheduler_disabled = false;
+
+// The number of SysTick ticks counted up to the last time the scheduler ran.
+static uint64_t systick_total = 0;
+
+// The SysTick keeps counting between the time the scheduler reads it and the time it's
+// reloaded. Those ticks are added the next time it runs so that the clock doesn't drift.
+static uint32_t systick_lost = 0;
+
+// Reading the count flag clears it. This remembers that the SysTick wrapped
+// when the flag is read outside of the scheduler.
+static volatile bool systick_wrapped = false;
+
+// The number of SysTick interrupts and the SysTick ticks spent in the idle task.
+static uint32_t systick_interrupts = 0;
+static uint64_t idle_ticks = 0;
+
+// The number of times that the scheduler switched to another task.
+static uint32_t context_switches = 0;
+
+// True when the running task gave up the CPU with task_yield().
+// Tasks under its preemption threshold can then run instead.
+static bool yielded = false;
+
+// Returns the preempted job that runs instead of <next> or <next> if there's none.
+static struct task * preempted_peek(struct task * next);
 
 __root void systick_handle(void);
 
@@ -51,6 +92,7 @@ __root void systick_handle(void);
 __root void svc_handle(uint8_t value);
 static void svc_handle_yield(void);
 static void svc_handle_sleep(void);
+static void svc_handle_sleep_until(void);
 static void svc_handle_mutex_lock(void);
 static void svc_handle_mutex_unlock(void);
 static void svc_handle_channel_send(void);
@@ -58,18 +100,59 @@ static void svc_handle_channel_recv(void);
 static void svc_handle_channel_reply(void);
 static void svc_handle_task_return(void);
 static void svc_handle_task_wait(void);
+static void svc_handle_wait_multiple(void);
+static void svc_handle_barrier_wait(void);
+static void svc_handle_barrier_release(void);
+static void svc_handle_rcu_synchronize(void);
+static void svc_handle_rcu_unlock(void);
+static void svc_handle_futex_wait(void);
+static void svc_handle_futex_wake(void);
+static void svc_handle_mempool_alloc(void);
+static void svc_handle_mempool_free(void);
+static void svc_handle_group_join(void);
+static void svc_handle_workqueue_wait(void);
+static void svc_handle_workqueue_wake(void);
+
+// Run the work deferred by ISRs.
+static void run_deferred_work(void);
+
+// Stop waiting on all the objects given to wait_multiple().
+static void wait_multiple_cancel(struct task * task);
+
+// Wake up the highest priority task waiting on an object with wait_multiple().
+static struct task * wait_multiple_wake(struct pqueue * multi_waiters);
+
+// Put the running task on the list of sleeping tasks. If the ticks elapse before the
+// task is woken up the timeout function takes it off whatever it was waiting on.
+static void timeout_start(uint32_t ticks, void (*timeout)(struct task * task));
+static void timeout_mutex(struct task * task);
+static void timeout_channel_send(struct task * task);
+static void timeout_channel_recv(struct task * task);
+static void timeout_task_wait(struct task * task);
+static void timeout_wait_multiple(struct task * task);
+static void timeout_futex(struct task * task);
+static void timeout_mempool(struct task * task);
 
 // Internal OS tasks
+// The idle task needs room for its context, its own frames and the call_rcu() functions that it runs.
+#define IDLE_TASK_STACK_SIZE (128 + RCU_CALLBACK_STACK)
 #pragma data_alignment = 8
-static uint8_t idle_task_stack[128];
+static uint8_t idle_task_stack[IDLE_TASK_STACK_SIZE];
 #pragma data_alignment = 8
 static uint8_t init_task_stack[128];
 
 static struct task idle_task;
-static struct task init_task;
+struct task init_task;
 static __task void * kernel_task_idle(void * arg);
 static __task void * kernel_task_init(void * arg);
 static void schedule(void);
+static uint64_t systick_now(void);
+
+// Charge a task with a budget for the ticks that it ran.
+static void budget_charge(struct task * task, uint32_t ticks);
+
+// Give back the budget that was used a period ago.
+static void budget_replenish(void);
 
 void manticore_init(void)
 {
@@ -79,13 +162,20 @@ void manticore_init(void)
 
   // Initialize the lists of ready/sleeping tasks.
   pqueue_init(&ready_tasks, pqueue_wait_compare);
+  pqueue_init(&preempted_tasks, pqueue_preempted_compare);
   list_init(&sleeping_tasks);
+  list_init(&budgeted_tasks);
+  list_init(&deferred_works);
+  rcu_init();
+  futex_init();
 
   // Create the init and idle tasks.
   // Pretend that the init task is running so that it becomes the parent
   // for future tasks.
   task_init(&init_task, kernel_task_init, NULL, init_task_stack, sizeof(init_task_stack), 1);
   running_task = &init_task;
+  // The idle loop and rcu_process_callbacks() take up to 32 bytes on top of the callbacks.
+  assert(sizeof(idle_task_stack) - sizeof(struct context) >= RCU_CALLBACK_STACK + 32);
   task_init(&idle_task, kernel_task_idle, NULL, idle_task_stack, sizeof(idle_task_stack), 0);
 }
 
@@ -155,14 +245,11 @@ static void update_sleep_ticks(uint32_t ticks)
     struct task * t = container_of(node, struct task, sleep_node);
     if (ticks >= t->sleep)
     {
-      if (t->state == STATE_MUTEX)
+      // A task that was waiting for something timed out.
+      if (t->timeout != NULL)
       {
-        // In this case mutex_timed_lock() timed out.
-        t->mutex_locked = false;
-        task_stop_waiting(t);
-
-        // The task waiting for the mutex is no longer blocked on the mutex owner.
-        task_remove_blocked(t->mutex->owner, t);
+        t->timeout(t);
+        t->timed_out = true;
       }
 
       // The task is ready. Move it from the sleep list to the ready list.
@@ -178,38 +265,47 @@ static void update_sleep_ticks(uint32_t ticks)
   }
 }
 
-static struct task * get_next_task(struct list_head * list)
-{
-  struct task * next_task = NULL;
-  struct list_head * node;
-  list_for_each(node, list)
-  {
-    struct task * task = container_of(node, struct task, wait_node);
-    if (next_task == NULL ||
-        task->priority > next_task->priority)
-    {
-      next_task = task;
-    }
-  }
-  return next_task;
-}
-
 static void schedule(void)
 {
   // Update how many ticks are left before the sleeping tasks wake up.
   uint32_t systick_load = SysTick->LOAD;
   uint32_t systick_val = SysTick->VAL;
-  bool systick_fired = SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk;
-  uint32_t ticks = systick_load - systick_val;
+  bool systick_fired = (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) || systick_wrapped;
+  systick_wrapped = false;
+  uint32_t ticks = systick_load - systick_val + systick_lost;
   if (systick_fired)
-    ticks += systick_load;
+    ticks += systick_load + 1;
+  systick_total += ticks;
+  if (running_task == &idle_task)
+    idle_ticks += ticks;
+  if (running_task != NULL && running_task->budget != NULL)
+    budget_charge(running_task, ticks);
   update_sleep_ticks(ticks);
 
+  // ISRs may have made tasks ready.
+  run_deferred_work();
+  budget_replenish();
+  partition_advance(systick_total);
+
   // This is a priority round-robin scheduler. The highest
   // priority ready task will always run next and will never yield to
   // a lower priority task. The next task to run is the one at
-  // the front of the priority queue.
-  struct task * next_task = task_from_wait_node(pqueue_peek(&ready_tasks));
+  // the front of the priority queue. With time partitioning it's the
+  // first one that's allowed to run in the current window.
+  // A task with a preemption threshold that's switched out part way through
+  // a job keeps its threshold. It didn't block or yield.
+  if (running_task != NULL && running_task->state == STATE_READY && !yielded &&
+      running_task->threshold > running_task->priority)
+  {
+    pqueue_push(&preempted_tasks, &running_task->preempted_node);
+  }
+  yielded = false;
+
+  struct task * next_task = preempted_peek(partition_peek(&ready_tasks));
+  if (!list_empty(&next_task->preempted_node))
+  {
+    list_remove(&next_task->preempted_node);
+  }
   task_stop_waiting(next_task);
 
   // We now know the next task that will run. We need to find out if
@@ -219,35 +315,93 @@ static void schedule(void)
   // Have a peek at the next ready task. We need to use a time slice
   // if the next task has the same priority as the task we're about
   // to run. This ensures the CPU is shared between all the
-  // highest priority tasks.
-  if (!pqueue_empty(&ready_tasks) && task_from_wait_node(pqueue_peek(&ready_tasks))->priority == next_task->priority)
+  // highest priority tasks. A task with a deadline runs until it blocks
+  // or a task with an earlier deadline becomes ready instead.
+  // A task with a preemption threshold isn't time sliced either.
+  bool edf = next_task->deadline != TASK_NO_DEADLINE;
+  bool threshold = next_task->threshold > next_task->priority;
+  struct task * second_task = partition_peek(&ready_tasks);
+  if (!edf && !threshold && second_task != NULL && second_task->priority == next_task->priority &&
+      partition_active(second_task) == partition_active(next_task))
   {
     if (next_task == running_task && !systick_fired)
       task_ticks = MIN(TIME_SLICE_TICKS, systick_val);
     else
       task_ticks = TIME_SLICE_TICKS;
   }
+  if (running_task != NULL && running_task != next_task)
+  {
+    rcu_switch_out(running_task);
+    context_switches++;
+  }
   running_task = next_task;
 
+  // A task starts using its budget when it runs at its priority.
+  // It's stopped when the budget runs out.
+  struct task_budget * budget = next_task->budget;
+  if (budget != NULL && budget->remaining > 0)
+  {
+    if (!budget->active)
+    {
+      budget->active = true;
+      budget->activation = systick_total;
+    }
+    task_ticks = MIN(task_ticks, budget->remaining);
+  }
+
   // We need to check the sleeping tasks to see if one could wake us up early.
+  // A task's wakeup can be deferred by its slack. Using the latest time that's within
+  // the slack of every task lets wakeups that are close together share an interrupt.
   struct list_head * node;
   list_for_each(node, &sleeping_tasks)
   {
     struct task * t = container_of(node, struct task, sleep_node);
-    if (t->priority > next_task->priority)
+    uint32_t latest = MIN(t->sleep, MAX_SYSTICK_RELOAD) + MIN(t->slack, MAX_SYSTICK_RELOAD);
+
+    // A task under the preemption threshold of the next task can't preempt it.
+    // There's no need to wake it up on time.
+    if (threshold && !task_preempts(t, next_task))
+      continue;
+    if (t->priority > next_task->priority || (edf && t->priority == next_task->priority) ||
+        (partition_active(t) && !partition_active(next_task)))
     {
       // A higher priority sleeping task can reduce the ticks
-      // to less than the time slice.
-      task_ticks = MIN(task_ticks, t->sleep);
+      // to less than the time slice. So can an equal priority task
+      // when there's no time slice since it may have an earlier deadline
+      // and a task of the current window's partition when a background task runs.
+      task_ticks = MIN(task_ticks, latest);
     }
     else if (t->priority == next_task->priority)
     {
       // An equal priority sleeping task can reduce the ticks
       // but still needs to respect the time slice or leftover time slice.
-      task_ticks = MIN(task_ticks, MAX(TIME_SLICE_TICKS, t->sleep));
+      task_ticks = MIN(task_ticks, MAX(TIME_SLICE_TICKS, latest));
     }
   }
 
+  // A ready task whose budget is used up may need to preempt the next task when it's replenished.
+  list_for_each(node, &budgeted_tasks)
+  {
+    budget = container_of(node, struct task_budget, node);
+    if (budget->remaining == 0 && budget->task->state == STATE_READY && budget->priority > next_task->priority)
+    {
+      assert(budget->count > 0);
+      task_ticks = MIN(task_ticks, budget->replenishments[0].time - systick_total);
+    }
+  }
+
+  // The next window of the major frame starts on time.
+  uint64_t window_end;
+  if (partition_window_end(&window_end))
+    task_ticks = MIN(task_ticks, window_end - systick_total);
+
+  // Count the ticks since we read the SysTick. It's reloaded a tick after VAL is cleared.
+  uint32_t systick_end = SysTick->VAL;
+  if (systick_end <= systick_val)
+    systick_lost = systick_val - systick_end + 1;
+  else
+    systick_lost = systick_val + systick_load + 1 - systick_end + 1;
+
   // Setup the SysTick timer.
   // We also clear the IRQ if it fired while we were
   // handling the system call.
@@ -257,10 +411,73 @@ static void schedule(void)
   SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
   __DSB();
   __ISB();
+
+  // The task that made the system call may have disabled the scheduler.
+  // Work deferred by an ISR since we ran it couldn't trigger the SysTick.
+  scheduler_disabled = false;
+  if (!list_empty(&deferred_works))
+  {
+    SCB->ICSR = SCB_ICSR_PENDSTSET_Msk;
+    __DSB();
+    __ISB();
+  }
+}
+
+void budget_charge(struct task * task, uint32_t ticks)
+{
+  struct task_budget * budget = task->budget;
+  if (!budget->active)
+    return;
+
+  uint32_t used = MIN(ticks, budget->remaining);
+  budget->remaining -= used;
+  budget->consumed += used;
+  if (budget->remaining > 0 && task->state == STATE_READY)
+    return;
+
+  // The task blocked or used up its budget. What it used is given back a period after it
+  // became active. When too many replenishments are pending the last one is pushed back
+  // and merged with this one. This never gives back time earlier than it should.
+  budget->active = false;
+  uint64_t time = budget->activation + budget->period;
+  if (budget->count == TASK_BUDGET_REPLENISHMENTS)
+  {
+    budget->replenishments[budget->count - 1].time = time;
+    budget->replenishments[budget->count - 1].amount += budget->consumed;
+  }
+  else
+  {
+    budget->replenishments[budget->count].time = time;
+    budget->replenishments[budget->count].amount = budget->consumed;
+    budget->count++;
+  }
+  budget->consumed = 0;
+
+  // Run in the background until the budget is replenished.
+  if (budget->remaining == 0)
+    task_change_priority(task, budget->background);
+}
+
+void budget_replenish(void)
+{
+  struct list_head * node;
+  list_for_each(node, &budgeted_tasks)
+  {
+    struct task_budget * budget = container_of(node, struct task_budget, node);
+    while (budget->count > 0 && budget->replenishments[0].time <= systick_total)
+    {
+      budget->remaining = MIN(budget->budget, budget->remaining + budget->replenishments[0].amount);
+      budget->count--;
+      memmove(&budget->replenishments[0], &budget->replenishments[1], budget->count * sizeof(budget->replenishments[0]));
+      if (budget->task->provisioned_priority != budget->priority)
+        task_change_priority(budget->task, budget->priority);
+    }
+  }
 }
 
 void systick_handle(void)
 {
+  systick_interrupts++;
   svc_handle_yield();
   schedule();
 }
@@ -270,6 +487,7 @@ void svc_handle(uint8_t value)
   switch (value)
   {
   case SYSCALL_YIELD:
+    yielded = true;
     svc_handle_yield();
     break;
   case SYSCALL_SLEEP:
@@ -296,6 +514,49 @@ void svc_handle(uint8_t value)
   case SYSCALL_TASK_WAIT:
     svc_handle_task_wait();
     break;
+  case SYSCALL_WAIT_MULTIPLE:
+    svc_handle_wait_multiple();
+    break;
+  case SYSCALL_BARRIER_WAIT:
+    svc_handle_barrier_wait();
+    break;
+  case SYSCALL_BARRIER_RELEASE:
+    svc_handle_barrier_release();
+    break;
+  case SYSCALL_RCU_SYNCHRONIZE:
+    svc_handle_rcu_synchronize();
+    break;
+  case SYSCALL_RCU_UNLOCK:
+    svc_handle_rcu_unlock();
+    break;
+  case SYSCALL_FUTEX_WAIT:
+    svc_handle_futex_wait();
+    break;
+  case SYSCALL_FUTEX_WAKE:
+    svc_handle_futex_wake();
+    break;
+  case SYSCALL_MEMPOOL_ALLOC:
+    svc_handle_mempool_alloc();
+    break;
+  case SYSCALL_MEMPOOL_FREE:
+    svc_handle_mempool_free();
+    break;
+  case SYSCALL_GROUP_JOIN:
+    svc_handle_group_join();
+    break;
+  case SYSCALL_WORKQUEUE_WAIT:
+    svc_handle_workqueue_wait();
+    break;
+  case SYSCALL_WORKQUEUE_WAKE:
+    svc_handle_workqueue_wake();
+    break;
+  case SYSCALL_SLEEP_UNTIL:
+    svc_handle_sleep_until();
+    break;
+  case SYSCALL_RESCHEDULE:
+    // The running task is preempted. Unlike a yield it keeps its preemption threshold.
+    svc_handle_yield();
+    break;
   default:
     assert(false);
   }
@@ -303,6 +564,24 @@ void svc_handle(uint8_t value)
   return;
 }
 
+struct task * preempted_peek(struct task * next)
+{
+  // The preempted jobs are in priority order. The first one that <next> is under the
+  // threshold of runs instead of <next>. It must be one that partition_peek() could
+  // have picked. That's a job of the current window's partition or a background job
+  // when the partition has nothing ready, which is the case when <next> isn't in it.
+  struct list_head * node;
+  pqueue_for_each(node, &preempted_tasks)
+  {
+    struct task * task = container_of(node, struct task, preempted_node);
+    bool allowed = partition_active(task) ||
+                   (!partition_active(next) && task->partition == PARTITION_BACKGROUND);
+    if (task != next && allowed && !task_preempts(next, task))
+      return task;
+  }
+  return next;
+}
+
 void svc_handle_yield(void)
 {
   // There's nothing special to do here. One of the following occured:
@@ -317,8 +596,7 @@ void svc_handle_yield(void)
 void svc_handle_sleep(void)
 {
   running_task->state = STATE_SLEEP;
-  running_task->sleep *= SYSTICK_RELOAD_MS;
-  list_push_back(&sleeping_tasks, &running_task->sleep_node);
+  timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, NULL);
 }
 
 void svc_handle_mutex_lock(void)
@@ -326,33 +604,90 @@ void svc_handle_mutex_lock(void)
   struct mutex * mutex = running_task->mutex;
   assert(mutex != NULL);
 
+  // A task that was woken from a lock steal mutex is trying again.
+  // Its timeout is already in systicks.
+  bool retry = running_task->mutex_woken;
+  running_task->mutex_woken = false;
+
   // Add the active task to the queue of tasks waiting for the mutex.
   running_task->state = STATE_MUTEX;
   task_wait_on(running_task, &mutex->waiting_tasks);
 
   // The owner of the mutex is now blocking whoever tried to lock it.
-  task_add_blocked(mutex->owner, running_task);
+  // The owner of a priority ceiling mutex already runs at the ceiling.
+  if (!mutex->prio_ceiling)
+    task_add_blocked(mutex->owner, running_task);
 
   // Check if the task should timeout while waiting for the mutex.
   if (running_task->sleep > 0)
-  {
-    running_task->sleep *= SYSTICK_RELOAD_MS;
-    list_push_back(&sleeping_tasks, &running_task->sleep_node);
-  }
+    timeout_start(retry ? running_task->sleep : running_task->sleep * SYSTICK_RELOAD_MS, timeout_mutex);
+}
+
+void timeout_mutex(struct task * task)
+{
+  // In this case mutex_timed_lock() timed out.
+  task->mutex_locked = false;
+  task_stop_waiting(task);
+
+  // The task waiting for the mutex is no longer blocked on the mutex owner.
+  // Nobody is blocked on a priority ceiling or unlocked lock steal mutex.
+  if (task->blocked != NULL)
+    task_remove_blocked(task->blocked, task);
 }
 
 void svc_handle_mutex_unlock(void)
 {
   struct mutex * mutex = running_task->mutex;
   assert(mutex != NULL);
-  assert(!pqueue_empty(&mutex->waiting_tasks));
+  assert(!pqueue_empty(&mutex->waiting_tasks) || !pqueue_empty(&mutex->multi_waiters));
+
+  // Determine who the new owner will be. It's the highest priority task waiting
+  // either with mutex_lock() or wait_multiple(). Ties go to mutex_lock().
+  // A lock steal mutex is only handed to tasks waiting with wait_multiple().
+  // Tasks waiting with mutex_lock() are woken and have to try again.
+  struct task * new_owner = NULL;
+  bool handoff = !mutex->lock_steal;
+  if (!pqueue_empty(&mutex->waiting_tasks))
+  {
+    new_owner = task_from_wait_node(pqueue_peek(&mutex->waiting_tasks));
+  }
+
+  if (!pqueue_empty(&mutex->multi_waiters) &&
+      (new_owner == NULL ||
+       wait_object_from_node(pqueue_peek(&mutex->multi_waiters))->task->priority > new_owner->priority))
+  {
+    // The new owner was waiting with wait_multiple(). It isn't blocked on us.
+    new_owner = wait_multiple_wake(&mutex->multi_waiters);
+    handoff = true;
+  }
+  else
+  {
+    task_stop_waiting(new_owner);
+    list_remove(&new_owner->sleep_node); // Stop sleeping in case of mutex_timed_lock().
+    new_owner->mutex_locked = handoff;
+    new_owner->mutex_woken = !handoff;
+
+    // The new owner is no longer blocked on us.
+    if (!mutex->prio_ceiling)
+      task_remove_blocked(running_task, new_owner);
+  }
 
-  // Determine who the new owner will be.
-  struct task * new_owner = task_from_wait_node(pqueue_peek(&mutex->waiting_tasks));
-  task_stop_waiting(new_owner);
+  struct list_head * node;
+  if (mutex->lock_steal && !mutex->prio_ceiling)
+  {
+    // Nobody is blocked on an unlocked lock steal mutex. The remaining
+    // waiters will be blocked on whoever locks it next.
+    pqueue_for_each(node, &mutex->waiting_tasks)
+    {
+      task_remove_blocked(running_task, task_from_wait_node(node));
+    }
+  }
 
-  list_remove(&new_owner->sleep_node); // Stop sleeping in case of mutex_timed_lock().
-  new_owner->mutex_locked = true;
+  // Hand the mutex over while neither task is queued. For a priority ceiling
+  // mutex this moves the ceiling from the running task to the new owner.
+  mutex_release(mutex);
+  if (handoff)
+    mutex_acquire(mutex, new_owner);
 
   // Boths tasks are ready after the mutex is unlocked.
   // The running task is scheduled first so that it can finish its time slice.
@@ -361,12 +696,11 @@ void svc_handle_mutex_unlock(void)
   task_wait_on(running_task, &ready_tasks);
   task_wait_on(new_owner, &ready_tasks);
 
+  if (mutex->prio_ceiling || mutex->lock_steal)
+    return;
+
   // The previous owner (running task) of the mutex is no longer blocking tasks waiting
   // for the mutex. The new owner of the mutex is now blocking all those tasks.
-  mutex->owner = new_owner;
-  task_remove_blocked(running_task, new_owner);
-
-  struct list_head * node;
   pqueue_for_each(node, &mutex->waiting_tasks)
   {
     struct task * waiter = task_from_wait_node(node);
@@ -385,6 +719,7 @@ void svc_handle_channel_send(void)
   {
     // There's a task waiting for a message.
     recv->state = STATE_READY;
+    list_remove(&recv->sleep_node); // Stop sleeping in case of channel_timed_recv().
     task_wait_on(recv, &ready_tasks);
     channel->receive = NULL;
     channel->server = recv;
@@ -405,15 +740,48 @@ void svc_handle_channel_send(void)
   {
     // No task is waiting for a message.
     running_task->state = STATE_CHANNEL_SEND;
-    //task_wait_on(running_task, &channel->waiting_tasks);
+    task_wait_on(running_task, &channel->waiting_tasks);
+
+    // A task may be waiting for a message with wait_multiple().
+    // Let it know that the channel is ready. It will receive the message later.
+    if (!pqueue_empty(&channel->multi_waiters))
+    {
+      struct task * recv = wait_multiple_wake(&channel->multi_waiters);
+      recv->state = STATE_READY;
+      task_wait_on(recv, &ready_tasks);
+    }
+  }
+
+  // The timeout covers both waiting for a receiver and waiting for the reply.
+  if (running_task->sleep > 0)
+    timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, timeout_channel_send);
+}
+
+void timeout_channel_send(struct task * task)
+{
+  // In this case channel_timed_send() timed out.
+  if (task->state == STATE_CHANNEL_SEND)
+  {
+    // Nobody received the message.
+    task_stop_waiting(task);
+  }
+  else
+  {
+    // The message was received but not replied to. The reply will be dropped.
+    // We're no longer blocked on the task handling the message.
+    assert(task->state == STATE_CHANNEL_RPLY);
+    assert(task->channel->reply == task);
+    task->channel->reply = NULL;
+    task_remove_blocked(task->blocked, task);
   }
 }
 
 void svc_handle_channel_recv(void)
 {
-  struct task * send = get_next_task(&running_task->channel->waiting_tasks);
-  if (send != NULL)
+  if (!pqueue_empty(&running_task->channel->waiting_tasks))
   {
+    struct task * send = task_from_wait_node(pqueue_peek(&running_task->channel->waiting_tasks));
+
     // A task has already sent a message to this channel.
     running_task->state = STATE_READY;
     task_wait_on(running_task, &ready_tasks);
@@ -440,32 +808,45 @@ void svc_handle_channel_recv(void)
     // We become receive blocked.
     running_task->state = STATE_CHANNEL_RECV;
     running_task->channel->receive = running_task;
+    if (running_task->sleep > 0)
+      timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, timeout_channel_recv);
   }
 }
 
+void timeout_channel_recv(struct task * task)
+{
+  // In this case channel_timed_recv() timed out.
+  task->channel->receive = NULL;
+}
+
 void svc_handle_channel_reply(void)
 {
   struct channel * channel = running_task->channel;
   void * msg = running_task->channel_msg;
   size_t len = running_task->channel_len;
 
-  // Copy the reply to the task that sent us a message.
+  // The task that replied is still ready.
+  running_task->state = STATE_READY;
+  task_wait_on(running_task, &ready_tasks);
+
+  // The sender may have given up waiting for the reply.
   struct task * reply_task = channel->reply;
-  assert(reply_task != NULL);
+  assert(channel->server == running_task);
+  channel->reply = NULL;
+  channel->server = NULL;
+  if (reply_task == NULL)
+    return;
+
+  // Copy the reply to the task that sent us a message.
   assert(reply_task->channel_len >= len);
   memcpy(reply_task->channel_reply, msg, len);
   *reply_task->channel_reply_len = len;
-  channel->reply = NULL;
-  channel->server = NULL;
 
   // The task we replied to becomes unblocked.
   reply_task->state = STATE_READY;
+  list_remove(&reply_task->sleep_node); // Stop sleeping in case of channel_timed_send().
   task_wait_on(reply_task, &ready_tasks);
 
-  // The task that replied is still ready.
-  running_task->state = STATE_READY;
-  task_wait_on(running_task, &ready_tasks);
-
   // The task that replied is now longer blocking the sender.
   task_remove_blocked(running_task, reply_task);
 }
@@ -482,10 +863,35 @@ void svc_handle_task_return(void)
          pqueue_size(&running_task->blocking) == 1 &&
          container_of(pqueue_peek(&running_task->blocking), struct task, blocking)->state == STATE_WAIT);
 
-  struct task * parent = container_of(running_task->family.parent, struct task, family);
+  // It makes no sense to return from a read-side critical section either.
+  assert(running_task->rcu_nesting == 0);
+
+  struct task * parent = task_parent(running_task);
 
+  if (running_task->detached)
+  {
+    // No one can wait for a detached task. It ceases to exist right away
+    // so the init task doesn't need to run to reap it.
+    assert(pqueue_empty(&running_task->blocking));
+    task_destroy(running_task);
+  }
+  else if (running_task->group != NULL)
+  {
+    // The group collects our result. Only the last member to return
+    // wakes up the task joining the group.
+    struct task_group * group = running_task->group;
+    running_task->state = STATE_ZOMBIE;
+    group->remaining--;
+    if (group->remaining == 0 && group->joiner != NULL)
+    {
+      struct task * joiner = group->joiner;
+      group_collect(group);
+      joiner->state = STATE_READY;
+      task_wait_on(joiner, &ready_tasks);
+    }
+  }
   // Check if our parent is waiting for us or any of it's children.
-  if (parent->state == STATE_WAIT &&
+  else if (parent->state == STATE_WAIT &&
       (parent->wait == NULL || *parent->wait == NULL || *parent->wait == running_task))
   {
     // The parent is already waiting for us. Give it the return code.
@@ -504,6 +910,7 @@ void svc_handle_task_return(void)
 
     // The parent task becomes ready and the returned task ceases to exist.
     parent->state = STATE_READY;
+    list_remove(&parent->sleep_node); // Stop sleeping in case of task_timed_wait().
     task_wait_on(parent, &ready_tasks);
     task_destroy(running_task);
   }
@@ -512,19 +919,22 @@ void svc_handle_task_return(void)
     // The parent isn't waiting for us.
     // Go into the zombie state until the parent reaps us.
     running_task->state = STATE_ZOMBIE;
+    list_push_back(&parent->exited, &running_task->exited_node);
   }
 }
 
 void svc_handle_task_wait(void)
 {
   // It makes no sense to call wait when we have no children.
-  assert(tree_num_children(&running_task->family) > 0);
+  assert(!tree_no_children(&running_task->family));
 
   if (running_task->wait != NULL && *running_task->wait != NULL)
   {
     // We're waiting for a specific child task.
     struct task * child = *running_task->wait;
-    assert(child->family.parent == &running_task->family);
+    assert(task_parent(child) == running_task);
+    assert(!child->detached);
+    assert(child->group == NULL);
     if (child->state == STATE_ZOMBIE)
     {
       // The child task has already returned.
@@ -539,35 +949,282 @@ void svc_handle_task_wait(void)
       // The child task hasn't returned yet. Wait for it.
       task_add_blocked(child, running_task);
       running_task->state = STATE_WAIT;
+      if (running_task->sleep > 0)
+        timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, timeout_task_wait);
     }
   }
   else
   {
     // We're waiting for any child task to return.
-    // Check if there's already one that's returned.
-    running_task->state = STATE_WAIT;
-    struct tree_head * node;
-    tree_for_each_direct(node, &running_task->family)
+    // The children that already returned are queued in the order they returned.
+    if (!list_empty(&running_task->exited))
     {
-      struct task * child = container_of(node, struct task, family);
-      if (child->state == STATE_ZOMBIE)
+      // A child already terminated.
+      struct task * child = task_from_exited_node(list_front(&running_task->exited));
+      if (running_task->wait != NULL)
       {
-        // A child already terminated.
-        if (running_task->wait != NULL)
-        {
-          *running_task->wait = child;
-        }
-
-        running_task->state = STATE_READY;
-        task_wait_on(running_task, &ready_tasks);
-        running_task->wait_result = child->wait_result;
-        task_destroy(child);
-        break;
+        *running_task->wait = child;
       }
+
+      running_task->state = STATE_READY;
+      task_wait_on(running_task, &ready_tasks);
+      running_task->wait_result = child->wait_result;
+      task_destroy(child);
+    }
+    else
+    {
+      running_task->state = STATE_WAIT;
+      if (running_task->sleep > 0)
+        timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, timeout_task_wait);
+    }
+  }
+}
+
+void timeout_task_wait(struct task * task)
+{
+  // In this case task_timed_wait() timed out.
+  // We're no longer blocked on the child we were waiting for.
+  if (task->blocked != NULL)
+    task_remove_blocked(task->blocked, task);
+}
+
+void svc_handle_wait_multiple(void)
+{
+  struct wait_object * objects = running_task->wait_objects;
+  uint32_t count = running_task->wait_count;
+
+  // One of the objects may have become ready after the caller
+  // checked them, but before the system call.
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (wait_object_poll(&objects[i]))
+    {
+      running_task->wait_index = i;
+      running_task->state = STATE_READY;
+      task_wait_on(running_task, &ready_tasks);
+      return;
+    }
+  }
+
+  // Queue up on every object. The first one that becomes ready wakes us up.
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    objects[i].task = running_task;
+    pqueue_push(wait_object_queue(&objects[i]), &objects[i].node);
+  }
+  running_task->state = STATE_WAIT_MULTIPLE;
+
+  // Check if the task should timeout while waiting for the objects.
+  if (running_task->sleep > 0)
+    timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, timeout_wait_multiple);
+}
+
+void timeout_wait_multiple(struct task * task)
+{
+  // In this case wait_multiple() timed out.
+  wait_multiple_cancel(task);
+  task->wait_index = -1;
+}
+
+void wait_multiple_cancel(struct task * task)
+{
+  // Removing ourselves from each queue is constant time.
+  for (uint32_t i = 0; i < task->wait_count; ++i)
+  {
+    list_remove(&task->wait_objects[i].node);
+  }
+}
+
+struct task * wait_multiple_wake(struct pqueue * multi_waiters)
+{
+  struct wait_object * object = wait_object_from_node(pqueue_peek(multi_waiters));
+  struct task * task = object->task;
+  assert(task->state == STATE_WAIT_MULTIPLE);
+
+  // The caller is responsible for making the task ready.
+  task->wait_index = object - task->wait_objects;
+  wait_multiple_cancel(task);
+  list_remove(&task->sleep_node); // Stop sleeping in case of a timeout.
+  return task;
+}
+
+void svc_handle_barrier_wait(void)
+{
+  struct barrier * barrier = running_task->barrier;
+  assert(barrier != NULL);
+
+  running_task->state = STATE_BARRIER;
+  task_wait_on(running_task, &barrier->waiting_tasks);
+}
+
+void svc_handle_barrier_release(void)
+{
+  struct barrier * barrier = running_task->barrier;
+  assert(barrier != NULL);
+
+  // The running task is scheduled first so that it can finish its time slice.
+  running_task->state = STATE_READY;
+  task_wait_on(running_task, &ready_tasks);
+
+  // All the waiting tasks become ready. The waiting tasks are already sorted
+  // by priority so they're merged into the ready tasks in a single pass.
+  struct list_head * node;
+  pqueue_for_each(node, &barrier->waiting_tasks)
+  {
+    struct task * waiter = task_from_wait_node(node);
+    waiter->state = STATE_READY;
+    waiter->waiting = &ready_tasks;
+  }
+  pqueue_merge(&ready_tasks, &barrier->waiting_tasks);
+}
+
+void svc_handle_rcu_synchronize(void)
+{
+  if (rcu_grace_period_complete(running_task->rcu_target))
+  {
+    running_task->state = STATE_READY;
+    task_wait_on(running_task, &ready_tasks);
+  }
+  else
+  {
+    // Wait for the blocked readers to leave their critical sections.
+    running_task->state = STATE_RCU;
+    task_wait_on(running_task, &rcu_waiting_tasks);
+  }
+}
+
+void svc_handle_rcu_unlock(void)
+{
+  // We're no longer holding up any grace period.
+  running_task->rcu_blocked = false;
+  list_remove(&running_task->rcu_node);
+  running_task->state = STATE_READY;
+  task_wait_on(running_task, &ready_tasks);
+
+  // Wake up the tasks whose grace period has ended.
+  struct list_head * node;
+  list_for_each_safe(node, &rcu_waiting_tasks.list)
+  {
+    struct task * waiter = task_from_wait_node(node);
+    if (rcu_grace_period_complete(waiter->rcu_target))
+    {
+      task_stop_waiting(waiter);
+      waiter->state = STATE_READY;
+      task_wait_on(waiter, &ready_tasks);
     }
   }
 }
 
+void svc_handle_futex_wait(void)
+{
+  if (*running_task->futex_address != running_task->futex_value)
+  {
+    // The value changed before we got here. There's no point in waiting.
+    running_task->futex_woken = false;
+    running_task->state = STATE_READY;
+    task_wait_on(running_task, &ready_tasks);
+    return;
+  }
+
+  running_task->state = STATE_FUTEX;
+  task_wait_on(running_task, futex_queue(running_task->futex_address));
+
+  // Check if the task should timeout while waiting.
+  if (running_task->sleep > 0)
+    timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, timeout_futex);
+}
+
+void timeout_futex(struct task * task)
+{
+  // In this case wait_on_address() timed out.
+  task_stop_waiting(task);
+  task->futex_woken = false;
+}
+
+void svc_handle_futex_wake(void)
+{
+  // The running task is scheduled first so that it can finish its time slice.
+  running_task->state = STATE_READY;
+  task_wait_on(running_task, &ready_tasks);
+  running_task->futex_value = futex_wake(running_task->futex_address, running_task->futex_value);
+}
+
+void svc_handle_sleep_until(void)
+{
+  // The sleep countdown is only 32 bits. The task sleeps again
+  // if the time is further away than that.
+  uint64_t wakeup = running_task->sleep_until * SYSTICK_RELOAD_MS / 1000;
+  uint64_t now = systick_now();
+  if (wakeup <= now)
+  {
+    // The time already passed.
+    running_task->sleep_until = 0;
+    running_task->state = STATE_READY;
+    task_wait_on(running_task, &ready_tasks);
+    return;
+  }
+
+  if (wakeup - now <= UINT32_MAX)
+  {
+    running_task->sleep = wakeup - now;
+    running_task->sleep_until = 0;
+  }
+  else
+  {
+    running_task->sleep = UINT32_MAX;
+  }
+  running_task->state = STATE_SLEEP;
+  timeout_start(running_task->sleep, NULL);
+}
+
+void timeout_start(uint32_t ticks, void (*timeout)(struct task * task))
+{
+  running_task->sleep = ticks;
+  running_task->timeout = timeout;
+  list_push_back(&sleeping_tasks, &running_task->sleep_node);
+}
+
+uint64_t systick_now(void)
+{
+  // Interrupts are masked so that the SysTick can't be reloaded by the scheduler while we read it.
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t load = SysTick->LOAD;
+  uint32_t val = SysTick->VAL;
+  if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)
+  {
+    // The SysTick wrapped and the scheduler hasn't run since. It needs to know.
+    // Read the counter again in case it wrapped after we read it.
+    systick_wrapped = true;
+    val = SysTick->VAL;
+  }
+  uint64_t ticks = systick_total + systick_lost + load - val;
+  if (systick_wrapped)
+    ticks += load + 1;
+  __set_PRIMASK(primask);
+  return ticks;
+}
+
+uint64_t kernel_time_now(void)
+{
+  return systick_now() * 1000 / SYSTICK_RELOAD_MS;
+}
+
+uint32_t manticore_time(void)
+{
+  return (uint32_t)(systick_now() / SYSTICK_RELOAD_MS);
+}
+
+void kernel_get_stats(struct kernel_stats * stats)
+{
+  assert(stats != NULL);
+  kernel_scheduler_disable();
+  stats->interrupts = systick_interrupts;
+  stats->switches = context_switches;
+  stats->idle = idle_ticks * 1000 / SYSTICK_RELOAD_MS;
+  kernel_scheduler_enable();
+}
+
 /*
  * See section B2.5 of the ARM architecture reference manual.
  * Updates to the SCS registers require the use of DSB/ISB instructions.
@@ -576,6 +1233,7 @@ void svc_handle_task_wait(void)
 void kernel_scheduler_disable(void)
 {
   // Disable the system tick ISR
+  scheduler_disabled = true;
   SysTick->CTRL = SysTick_CTRL_ENABLE_Msk;
   __DSB();
   __ISB();
@@ -587,21 +1245,168 @@ void kernel_scheduler_enable(void)
   SysTick->CTRL = SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
   __DSB();
   __ISB();
+  scheduler_disabled = false;
   if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)
   {
-    // Trigger the systick ISR if the timer expired
-    // while the ISR was disabled.
+    // Reading the flag cleared it. Let the scheduler know that it wrapped.
+    systick_wrapped = true;
+  }
+  if (systick_wrapped || !list_empty(&deferred_works))
+  {
+    // Trigger the systick ISR if the timer expired or
+    // an ISR deferred work while the ISR was disabled.
     SCB->ICSR = SCB_ICSR_PENDSTSET_Msk;
     __DSB();
     __ISB();
   }
 }
 
+void deferred_work_init(struct deferred_work * work, void (*handler)(struct deferred_work *))
+{
+  assert(handler != NULL);
+  work->handler = handler;
+  list_init(&work->node);
+}
+
+void kernel_defer(struct deferred_work * work)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (list_empty(&work->node))
+  {
+    list_push_back(&deferred_works, &work->node);
+  }
+  __set_PRIMASK(primask);
+
+  // Run the scheduler as soon as possible. When it's disabled
+  // kernel_scheduler_enable() will see the work and run it.
+  if (!scheduler_disabled)
+  {
+    SCB->ICSR = SCB_ICSR_PENDSTSET_Msk;
+    __DSB();
+    __ISB();
+  }
+}
+
+void run_deferred_work(void)
+{
+  while (true)
+  {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    struct list_head * node = list_pop_front(&deferred_works);
+    __set_PRIMASK(primask);
+    if (node == NULL)
+      break;
+
+    struct deferred_work * work = container_of(node, struct deferred_work, node);
+    work->handler(work);
+  }
+}
+
+void svc_handle_mempool_alloc(void)
+{
+  struct mempool * pool = running_task->mempool;
+  assert(pool != NULL);
+
+  // A block may have been freed by an ISR since the pool was checked.
+  // Interrupts stay masked until we're queued so that a block freed
+  // by an ISR can't miss us.
+  // The tasks already waiting get the blocks first. A block that an ISR freed
+  // for them is handed over once its deferred work runs.
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  running_task->mempool_block = pqueue_empty(&pool->waiting_tasks) ? mempool_pop(pool) : NULL;
+  if (running_task->mempool_block != NULL)
+  {
+    running_task->state = STATE_READY;
+    task_wait_on(running_task, &ready_tasks);
+  }
+  else
+  {
+    running_task->state = STATE_MEMPOOL;
+    task_wait_on(running_task, &pool->waiting_tasks);
+  }
+  __set_PRIMASK(primask);
+
+  // Check if the task should timeout while waiting for a block.
+  if (running_task->state == STATE_MEMPOOL && running_task->sleep > 0)
+    timeout_start(running_task->sleep * SYSTICK_RELOAD_MS, timeout_mempool);
+}
+
+void timeout_mempool(struct task * task)
+{
+  // In this case mempool_timed_alloc() timed out.
+  task_stop_waiting(task);
+  task->mempool_block = NULL;
+}
+
+void svc_handle_group_join(void)
+{
+  struct task_group * group = running_task->group_joining;
+  assert(group != NULL);
+  assert(group->joiner == NULL);
+
+  if (group->remaining == 0)
+  {
+    // Every member already returned.
+    group_collect(group);
+    running_task->state = STATE_READY;
+    task_wait_on(running_task, &ready_tasks);
+  }
+  else
+  {
+    // The last member to return will wake us up.
+    group->joiner = running_task;
+    running_task->state = STATE_GROUP_JOIN;
+  }
+}
+
+void svc_handle_mempool_free(void)
+{
+  // The running task is scheduled first so that it can finish its time slice.
+  running_task->state = STATE_READY;
+  task_wait_on(running_task, &ready_tasks);
+  mempool_give(running_task->mempool, running_task->mempool_block);
+}
+
+void svc_handle_workqueue_wait(void)
+{
+  struct workqueue * queue = running_task->workqueue;
+  assert(queue != NULL);
+
+  // A job may have been submitted by an ISR since the queue was checked.
+  // Interrupts stay masked until we're queued so that the ISR sees us.
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (workqueue_pending(queue))
+  {
+    running_task->state = STATE_READY;
+    task_wait_on(running_task, &ready_tasks);
+  }
+  else
+  {
+    running_task->state = STATE_WORKQUEUE;
+    task_wait_on(running_task, &queue->idle_workers);
+  }
+  __set_PRIMASK(primask);
+}
+
+void svc_handle_workqueue_wake(void)
+{
+  // The submitting task is scheduled first so that it can finish its time slice.
+  running_task->state = STATE_READY;
+  task_wait_on(running_task, &ready_tasks);
+  workqueue_wake(running_task->workqueue);
+}
+
 static __task void * kernel_task_idle(void * arg)
 {
   while (true)
   {
-    // All that the idle task needs to do is wait for interrupts.
+    // Reclaim the memory released with call_rcu() while there's nothing else to do.
+    // Then wait for interrupts.
+    rcu_process_callbacks();
     __WFI();
   }
 }
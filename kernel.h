@@ -23,13 +23,44 @@
 void kernel_scheduler_disable(void);
 void kernel_scheduler_enable(void);
 
+// Work that an ISR hands over to the kernel. ISRs can't make system calls
+// so the handler is called from the scheduler the next time it runs.
+struct deferred_work
+{
+  void (*handler)(struct deferred_work * work);
+  struct list_head node;
+};
+
+void deferred_work_init(struct deferred_work * work, void (*handler)(struct deferred_work *));
+
+// Queue work for the kernel. Does nothing if the work is already queued.
+// Safe to call from ISRs.
+void kernel_defer(struct deferred_work * work);
+
+// Counters used to measure how often the kernel wakes up the CPU.
+struct kernel_stats
+{
+  uint32_t interrupts; // The number of SysTick interrupts.
+  uint64_t idle;       // The time in microseconds spent in the idle task.
+  uint32_t switches;   // The number of context switches.
+};
+
 // The list of all ready tasks
 extern struct pqueue ready_tasks;
 
+// The ready tasks that were preempted part way through a job. See task->preempted_node.
+extern struct pqueue preempted_tasks;
+
+// The tasks that have a CPU budget. See task_set_budget().
+extern struct list_head budgeted_tasks;
+
 // The task that's currently running.
 extern struct task * running_task;
 
 // True once manticore_main() has been called.
 extern bool kernel_running;
 
+// The init task reaps the tasks that were orphaned.
+extern struct task init_task;
+
 #endif
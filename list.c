@@ -76,18 +76,17 @@ void list_append(struct list_head * head, struct list_head * list)
 
   if (list_empty(list))
   {
+    return;
   }
-  else if (list_empty(head))
-  {
-    head->next = list->next;
-    head->prev = list->prev;
-  }
-  else
-  {
-    head->prev->next = list->next;
-    list->next->prev = head->prev;
-    head->prev = list->prev;
-  }
+
+  // Link the nodes of <list> between the last node and <head>.
+  head->prev->next = list->next;
+  list->next->prev = head->prev;
+  list->prev->next = head;
+  head->prev = list->prev;
+
+  // The nodes now belong to <head>.
+  list_init(list);
 }
 
 void list_insert(struct list_head * position, struct list_head * node)
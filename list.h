@@ -33,7 +33,7 @@ struct list_head * list_pop_front(struct list_head * head);
 // Remove an element from a list.
 void list_remove(struct list_head * node);
 
-// Append a list at the back of the list.
+// Append a list at the back of the list. <list> is left empty.
 void list_append(struct list_head * head, struct list_head * list);
 
 // Insert a node after <position>.
@@ -0,0 +1,64 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "mailbox.h"
+
+#include "manticore.h"
+
+#include "system.h"
+
+#include <assert.h>
+#include <string.h>
+
+void mailbox_init(struct mailbox * mailbox, void * buffer, size_t size, const void * data)
+{
+  assert(buffer != NULL);
+  assert(size > 0);
+  mailbox->sequence = 0;
+  mailbox->copies = (uint8_t *)buffer;
+  mailbox->size = size;
+
+  // Both copies start off with the initial value.
+  memcpy(mailbox->copies, data, size);
+  memcpy(mailbox->copies + size, data, size);
+}
+
+void mailbox_publish(struct mailbox * mailbox, const void * data)
+{
+  // Readers move to the 2nd copy while we update the 1st one.
+  mailbox->sequence++;
+  __DMB();
+  memcpy(mailbox->copies, data, mailbox->size);
+  __DMB();
+
+  // Readers move back to the 1st copy while we update the 2nd one.
+  mailbox->sequence++;
+  __DMB();
+  memcpy(mailbox->copies + mailbox->size, data, mailbox->size);
+  __DMB();
+}
+
+uint32_t mailbox_read(struct mailbox * mailbox, void * data)
+{
+  uint32_t sequence;
+  do
+  {
+    // The copy can only be torn if the writer preempted us.
+    // The sequence will have changed if that happened.
+    sequence = mailbox->sequence;
+    __DMB();
+    memcpy(data, mailbox->copies + (sequence & 1) * mailbox->size, mailbox->size);
+    __DMB();
+  } while (sequence != mailbox->sequence);
+
+  // The 1st copy is updated first so an odd sequence
+  // means we read the previously published value.
+  return sequence / 2;
+}
@@ -0,0 +1,37 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * A mailbox holds the latest value published by a single writer.
+ * Nothing in here enters the kernel. The mailbox is a sequence lock with
+ * 2 copies of the value. The writer updates one copy at a time and the
+ * sequence number tells the readers which copy is stable. A reader that
+ * preempts the writer never waits for it, it simply reads the other copy.
+ * A reader that gets preempted by the writer retries its read.
+ */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct mailbox
+{
+  // Incremented twice for every value published.
+  // Readers read the copy selected by the lowest bit.
+  volatile uint32_t sequence;
+
+  // The 2 copies of the value, each <size> bytes long.
+  uint8_t * copies;
+  size_t size;
+};
+
+#endif
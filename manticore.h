@@ -14,6 +14,19 @@
 #include "task.h"
 #include "mutex.h"
 #include "channel.h"
+#include "wait.h"
+#include "barrier.h"
+#include "mailbox.h"
+#include "rcu.h"
+#include "futex.h"
+#include "mempool.h"
+#include "heap.h"
+#include "group.h"
+#include "workqueue.h"
+#include "fiber.h"
+#include "active.h"
+#include "timer.h"
+#include "partition.h"
 
 #include <stdint.h>
 #include <string.h>
@@ -35,6 +48,27 @@ void manticore_init(void);
  */
 void manticore_main(void);
 
+/**
+ * Get the time since the kernel started.
+ * @return The number of milliseconds since the kernel started. Wraps around after about 49 days.
+ */
+uint32_t manticore_time(void);
+
+/**
+ * Get the time since the kernel started. The time is counted from the SysTick
+ * and doesn't drift when the scheduler reloads it.
+ * @return The number of microseconds since the kernel started.
+ */
+uint64_t kernel_time_now(void);
+
+struct kernel_stats;
+
+/**
+ * Get the number of SysTick interrupts and the time spent idle since the kernel started.
+ * @param stats Where the statistics are copied to.
+ */
+void kernel_get_stats(struct kernel_stats * stats);
+
 
 // --------------------------------------
 // Task
@@ -64,6 +98,73 @@ void task_init(struct task * task,
                uint32_t stackSize,
                uint8_t priority);
 
+// Controls if a task can be waited for or is destroyed as soon as it returns.
+#define TASK_ATTR_JOINABLE                      (0 << 0)
+#define TASK_ATTR_DETACHED                      (1 << 0)
+
+// Controls if a task runs in its parent's partition or in a partition of its own.
+// See partition_set_frame().
+#define TASK_ATTR_INHERIT_PARTITION             (0 << 1)
+#define TASK_ATTR_PARTITION(partition)          ((1 << 1) | ((uint32_t)(partition) << 8))
+
+// The default task can be waited for.
+#define TASK_ATTR_DEFAULT                       (TASK_ATTR_JOINABLE | TASK_ATTR_INHERIT_PARTITION)
+
+/**
+ * Initialize a new task with attributes.
+ * @param task The task to initialize.
+ * @param entry The entry point for the new task.
+ * @param arg The argument passed to the new task.
+ * @param stack The memory used for the stack.
+ * @param stackSize The size of the stack.
+ * @param priority The priority of the new task.
+ * @param attributes The attributes to initialize the task with. See TASK_ATTR_*.
+ */
+void task_init_attr(struct task * task,
+                    task_entry_t entry,
+                    void * arg,
+                    void * stack,
+                    uint32_t stackSize,
+                    uint8_t priority,
+                    uint32_t attributes);
+
+/**
+ * Detach a task. A detached task is destroyed as soon as it returns
+ * and its return value is discarded. It can't be waited for.
+ * A task that already returned is destroyed right away.
+ * A task can't be detached while its parent is waiting for it with task_wait(),
+ * either by name or as the parent's last child that can return.
+ * @param task The task to detach. Passing NULL detaches the caller.
+ */
+void task_detach(struct task * task);
+
+struct task_slab;
+
+// The size of the buffer needed by a slab of <count> tasks with <stack_size> byte stacks.
+#define TASK_SLAB_BUFFER_SIZE(stack_size, count) (TASK_SLAB_SLOT_SIZE(stack_size) * (count))
+
+/**
+ * Initialize a slab of tasks that share the same stack size.
+ * @param slab The slab to initialize.
+ * @param buffer The memory for the tasks and their stacks. Must be 8 byte aligned
+ *               and TASK_SLAB_BUFFER_SIZE(stack_size, count) bytes.
+ * @param stack_size The size of the stacks. Must be a multiple of 8.
+ * @param count The number of tasks.
+ */
+void task_slab_init(struct task_slab * slab, void * buffer, uint32_t stack_size, uint32_t count);
+
+/**
+ * Create a new task whose task and stack come from a slab.
+ * The task goes back to the slab once it's destroyed. The task handle
+ * must not be used after that since it can be reused by another spawn.
+ * @param entry The entry point for the new task.
+ * @param arg The argument passed to the new task.
+ * @param slab The slab to take the task and stack from.
+ * @param priority The priority of the new task.
+ * @return The new task or NULL if every task in the slab is in use.
+ */
+struct task * task_spawn(task_entry_t entry, void * arg, struct task_slab * slab, uint8_t priority);
+
 /**
  * Wait for a task to return.
  * If <task> is NULL then wait for any child.
@@ -74,6 +175,17 @@ void task_init(struct task * task,
  */
 void * task_wait(struct task ** task);
 
+/**
+ * Wait for a task to return. Give up after the elapsed time.
+ * See task_wait() for how <task> is used. A task that times out stays a child
+ * and can be waited for again.
+ * @param task The task to wait for.
+ * @param result Where the value that the task returned is stored.
+ * @param milliseconds The amount of time to wait before giving up. 0 waits forever.
+ * @return True if the task returned.
+ */
+bool task_timed_wait(struct task ** task, void ** result, uint32_t milliseconds);
+
 /**
  * Get a tasks priority.
  * @param task The task whose priority will be returned. Passing NULL will
@@ -94,12 +206,133 @@ void task_sleep(unsigned int seconds);
  */
 void task_delay(unsigned int milliseconds);
 
+/**
+ * Put the calling task to sleep until an absolute time. Periodic tasks
+ * should use this instead of task_delay() so that their period doesn't drift.
+ * The task doesn't sleep if the time already passed.
+ * @param time The time to wake up at in microseconds. See kernel_time_now().
+ */
+void task_delay_until(uint64_t time);
+
+/**
+ * Set how late the calling task is willing to wake up from sleeps and timeouts.
+ * The scheduler uses the slack to wake up tasks with close wakeup times
+ * with a single interrupt. The slack is 0 by default.
+ * @param microseconds The time that a wakeup can be late by.
+ */
+void task_set_slack(uint32_t microseconds);
+
+struct task_period;
+struct task_period_stats;
+
+/**
+ * Make the calling task periodic. A job is released at the start of every period.
+ * The call returns when the first job is released.
+ * @param period The period and statistics of the task. Must outlive the task.
+ * @param length The length of the period in microseconds.
+ * @param deadline The time in microseconds from the release of a job that it must complete within.
+ * @param offset The time in microseconds from now that the first job is released at.
+ */
+void task_set_period(struct task_period * period, uint32_t length, uint32_t deadline, uint32_t offset);
+
+/**
+ * Complete the current job of a periodic task and wait until the next one is released.
+ * A job that completes after the next release doesn't wait but still counts as late.
+ */
+void task_wait_period(void);
+
+/**
+ * Get the statistics of a periodic task.
+ * @param task The task.
+ * @param stats Where the statistics are copied to.
+ * @return False if the task isn't periodic.
+ */
+bool task_get_period_stats(struct task * task, struct task_period_stats * stats);
+
+/**
+ * Set the preemption threshold of a task. While the task runs only tasks with a higher priority
+ * than the threshold can preempt it. The task isn't time sliced either. This saves the context
+ * switches to tasks that don't need to run right away. Tasks with a priority up to the threshold
+ * never preempt each other so at most one of them is ever part way through its work.
+ * @param task The task. Passing NULL sets the threshold of the caller.
+ * @param threshold The preemption threshold. It's at least the priority of the task or 0 for none.
+ */
+void task_set_threshold(struct task * task, uint8_t threshold);
+
+struct task_budget;
+
+/**
+ * Limit the CPU time that the calling task gets at its priority. The task is a sporadic server.
+ * The time it runs for is given back one period after it started running. While its budget
+ * is used up it runs at its background priority. This bounds how much a bursty task
+ * delays lower priority tasks while it still responds quickly while it has budget left.
+ * @param budget The budget of the task. Must outlive the task.
+ * @param microseconds The CPU time that the task can use in any period.
+ * @param period The replenishment period in microseconds.
+ * @param background The priority while the budget is used up. Must be lower than the task's priority.
+ */
+void task_set_budget(struct task_budget * budget, uint32_t microseconds, uint32_t period, uint8_t background);
+
+/**
+ * Schedule the calling task earliest deadline first. Tasks of equal priority
+ * with deadlines run before those without and aren't time sliced. Each job
+ * of a periodic task is due relative to its release. Other tasks call this
+ * again at the start of each job.
+ * Tasks blocked on a task with a later deadline lend it their deadline.
+ * @param microseconds The relative deadline of the current job from now. 0 schedules the task by priority only.
+ */
+void task_set_deadline(uint32_t microseconds);
+
 /**
  * Yield to the next task.
  * This will cause the calling task to give up its remaining time slice.
  */
 void task_yield(void);
 
+// --------------------------------------
+// Task group
+// --------------------------------------
+
+struct task_group;
+
+/**
+ * Initialize a new task group.
+ * @param group The group to initialize.
+ */
+void group_init(struct task_group * group);
+
+/**
+ * Create a batch of tasks that belong to a group. The scheduler only decides
+ * who runs next once every task was created. The members can't be waited for
+ * with task_wait(), their results are collected with group_join_all().
+ * @param group The group. The previous batch must have been joined.
+ * @param tasks The <count> tasks to initialize.
+ * @param stacks The memory for the stacks. Must be <count> * <stack_size> bytes.
+ * @param stack_size The size of each stack. Must be a multiple of 8.
+ * @param count The number of tasks.
+ * @param entry The entry point for the new tasks.
+ * @param args The <count> arguments passed to the new tasks or NULL to pass NULL to all of them.
+ * @param priority The priority of the new tasks.
+ */
+void group_spawn(struct task_group * group,
+                 struct task * tasks,
+                 void * stacks,
+                 uint32_t stack_size,
+                 uint32_t count,
+                 task_entry_t entry,
+                 void ** args,
+                 uint8_t priority);
+
+/**
+ * Wait for every task in a group to return. The caller is only woken up once
+ * the last task returns. The tasks don't lend their priority to the caller.
+ * Joining a group whose batch was already joined returns right away.
+ * @param group The group to join.
+ * @param results Where the <count> return values are stored, in the order of the
+ *                tasks given to group_spawn(). May be NULL.
+ */
+void group_join_all(struct task_group * group, void ** results);
+
 // --------------------------------------
 // Mutex
 // --------------------------------------
@@ -110,8 +343,22 @@ struct mutex;
 #define MUTEX_ATTR_NON_RECURSIVE                (0 << 0)
 #define MUTEX_ATTR_RECURSIVE                    (1 << 0)
 
-// The default mutex is non-recursive.
-#define MUTEX_ATTR_DEFAULT                      MUTEX_ATTR_NON_RECURSIVE
+// Controls how the mutex avoids priority inversion. By default the owner inherits the
+// priority of the tasks blocked on the mutex. With a priority ceiling the owner runs at
+// the ceiling from the moment it locks the mutex until it unlocks it. The ceiling must be
+// at least the priority of every task that locks the mutex.
+#define MUTEX_ATTR_PRIO_INHERIT                 (0 << 1)
+#define MUTEX_ATTR_PRIO_CEILING(ceiling)        ((1 << 1) | ((uint32_t)(ceiling) << 8))
+
+// Controls what happens when a mutex is unlocked while tasks are waiting for it. By default
+// the mutex is handed to the highest priority waiter. With lock stealing the waiter is only
+// woken and the mutex stays unlocked until a task locks it. A task that unlocks and relocks
+// the mutex right away keeps running instead of blocking behind the waiter.
+#define MUTEX_ATTR_HANDOFF                      (0 << 2)
+#define MUTEX_ATTR_LOCK_STEAL                   (1 << 2)
+
+// The default mutex is non-recursive, uses priority inheritance and hands off the lock.
+#define MUTEX_ATTR_DEFAULT                      (MUTEX_ATTR_NON_RECURSIVE | MUTEX_ATTR_PRIO_INHERIT | MUTEX_ATTR_HANDOFF)
 
 /**
  * Initialize a new mutex.
@@ -175,6 +422,25 @@ void channel_send(struct channel * channel,
                   void * reply,
                   size_t * reply_len);
 
+/**
+ * Send a message through a channel. Give up after the elapsed time.
+ * The time covers waiting for a receiver and waiting for the reply.
+ * A reply to a message that timed out is dropped.
+ * @param channel The channel to send the message to.
+ * @param data The data to send.
+ * @param len The length of data to send.
+ * @param reply The buffer where the reply can be stored.
+ * @param reply_len The length of the reply buffer.
+ * @param milliseconds The amount of time to wait before giving up. 0 waits forever.
+ * @return True if the message was replied to.
+ */
+bool channel_timed_send(struct channel * channel,
+                        void * data,
+                        size_t len,
+                        void * reply,
+                        size_t * reply_len,
+                        uint32_t milliseconds);
+
 /**
  * Receive a message from a channel.
  * @param channel The channel to receive a message from.
@@ -184,6 +450,16 @@ void channel_send(struct channel * channel,
  */
 size_t channel_recv(struct channel * channel, void * data, size_t len);
 
+/**
+ * Receive a message from a channel. Give up after the elapsed time.
+ * @param channel The channel to receive a message from.
+ * @param data The buffer where the message can be stored.
+ * @param len The length of the receive buffer. Updated with the size of the received message.
+ * @param milliseconds The amount of time to wait before giving up. 0 waits forever.
+ * @return True if a message was received.
+ */
+bool channel_timed_recv(struct channel * channel, void * data, size_t * len, uint32_t milliseconds);
+
 /**
  * Reply to a previously received message.
  * @param channel The channel to reply to.
@@ -192,4 +468,553 @@ size_t channel_recv(struct channel * channel, void * data, size_t len);
  */
 void channel_reply(struct channel * channel, void * data, size_t len);
 
+// --------------------------------------
+// Barrier
+// --------------------------------------
+
+struct barrier;
+
+/**
+ * Initialize a new barrier.
+ * @param barrier The barrier to initialize.
+ * @param count The number of tasks that must reach the barrier before they're released.
+ */
+void barrier_init(struct barrier * barrier, uint32_t count);
+
+/**
+ * Wait for all the tasks to reach the barrier.
+ * The last task to arrive releases all the others and the barrier is reset for the next cycle.
+ * @param barrier The barrier to wait on.
+ * @return True for the last task to arrive. False for the others.
+ */
+bool barrier_wait(struct barrier * barrier);
+
+// --------------------------------------
+// Mailbox
+// --------------------------------------
+
+struct mailbox;
+
+// The size of the buffer needed by a mailbox holding values of <size> bytes.
+#define MAILBOX_BUFFER_SIZE(size)               (2 * (size))
+
+/**
+ * Initialize a new mailbox.
+ * A mailbox holds the latest value published by a single writer.
+ * Neither the writer nor the readers ever block or enter the kernel.
+ * @param mailbox The mailbox to initialize.
+ * @param buffer The memory used to hold the value. Must be MAILBOX_BUFFER_SIZE(size) bytes.
+ * @param size The size of the value.
+ * @param data The initial value.
+ */
+void mailbox_init(struct mailbox * mailbox, void * buffer, size_t size, const void * data);
+
+/**
+ * Publish a new value. Only one task may publish to a mailbox.
+ * @param mailbox The mailbox to publish to.
+ * @param data The value to publish.
+ */
+void mailbox_publish(struct mailbox * mailbox, const void * data);
+
+/**
+ * Read the latest value. The read is retried if the writer preempts us.
+ * @param mailbox The mailbox to read from.
+ * @param data The buffer where the value will be stored.
+ * @return The version of the value that was read. The initial value is
+ *         version 0 and every publish increments the version.
+ */
+uint32_t mailbox_read(struct mailbox * mailbox, void * data);
+
+// --------------------------------------
+// Read-copy-update
+// --------------------------------------
+
+struct rcu_head;
+
+/**
+ * Enter a read-side critical section. These can be nested.
+ * Data published with rcu_assign_pointer() won't be reclaimed until
+ * the matching rcu_read_unlock().
+ */
+void rcu_read_lock(void);
+
+/**
+ * Leave a read-side critical section.
+ */
+void rcu_read_unlock(void);
+
+/**
+ * Wait until every task that was in a read-side critical section has left it.
+ * Must not be called from a read-side critical section.
+ */
+void synchronize_rcu(void);
+
+// The most stack in bytes that a call_rcu() function may use. The idle task has this much
+// stack left over for them. Callers of call_rcu() also need to have it to spare.
+#define RCU_CALLBACK_STACK                      (128)
+
+/**
+ * Call a function once every task that is in a read-side critical section has left it.
+ * The function is called from call_rcu() or from the idle task so it must not block.
+ * It may use up to RCU_CALLBACK_STACK bytes of stack. The idle task only runs when the
+ * CPU has nothing else to do. Under full load the functions are only called from call_rcu().
+ * @param head The node used to queue the call. Usually embedded in the data to reclaim.
+ * @param func The function to call.
+ */
+void call_rcu(struct rcu_head * head, rcu_callback_t func);
+
+// Read a pointer that is protected by RCU.
+#define rcu_dereference(p)                      (p)
+
+// Publish a pointer that is protected by RCU.
+// The pointed to data is written to memory before the pointer.
+#define rcu_assign_pointer(p, v)\
+  do {\
+    __DMB();\
+    (p) = (v);\
+  } while (0)
+
+// --------------------------------------
+// Wait on address
+// --------------------------------------
+
+/**
+ * Wait until another task calls wake_address() with the same address.
+ * The value is checked by the kernel before going to sleep so a wake up
+ * between reading the value and calling this function can't be lost.
+ * @param address The address to wait on.
+ * @param expected Only wait if the value at <address> is still <expected>.
+ * @param milliseconds The amount of time to wait before giving up. 0 waits forever.
+ * @return True if woken up. False if the value had changed or the wait timed out.
+ */
+bool wait_on_address(volatile uint32_t * address, uint32_t expected, uint32_t milliseconds);
+
+/**
+ * Wake up the tasks waiting on an address. The highest priority tasks are woken first.
+ * This doesn't enter the kernel when no task can be waiting on the address.
+ * @param address The address that the tasks are waiting on.
+ * @param count The maximum number of tasks to wake up.
+ * @return The number of tasks woken up.
+ */
+uint32_t wake_address(volatile uint32_t * address, uint32_t count);
+
+struct futex_mutex;
+
+/**
+ * Initialize a mutex built on top of wait_on_address().
+ * This mutex doesn't do priority inheritance but it never enters
+ * the kernel unless it's contended.
+ * @param mutex The mutex to initialize.
+ */
+void futex_mutex_init(struct futex_mutex * mutex);
+
+/**
+ * Lock a futex mutex. This call will block if the mutex is already locked.
+ * @param mutex The mutex to lock.
+ */
+void futex_mutex_lock(struct futex_mutex * mutex);
+
+/**
+ * Try to lock a futex mutex. This call won't block if the mutex is already locked.
+ * @param mutex The mutex to lock.
+ * @return True if the mutex was locked.
+ */
+bool futex_mutex_trylock(struct futex_mutex * mutex);
+
+/**
+ * Unlock a futex mutex.
+ * @param mutex The mutex to unlock.
+ */
+void futex_mutex_unlock(struct futex_mutex * mutex);
+
+// --------------------------------------
+// Wait multiple
+// --------------------------------------
+
+struct wait_object;
+
+// The types of objects that can be waited on.
+// A channel is ready when a message can be received without blocking.
+// A mutex is ready when it has been locked by the waiting task.
+#define WAIT_OBJECT_CHANNEL                     (0)
+#define WAIT_OBJECT_MUTEX                       (1)
+
+/**
+ * Initialize an object that can be waited on with wait_multiple().
+ * @param object The wait object to initialize.
+ * @param type The type of object to wait on. See WAIT_OBJECT_*.
+ * @param handle The channel, mutex, ... to wait on.
+ */
+void wait_object_init(struct wait_object * object, uint8_t type, void * handle);
+
+/**
+ * Wait until one of multiple objects becomes ready.
+ * The task waiting on a mutex with this call doesn't lend its priority
+ * to the owner of the mutex.
+ * @param objects The objects to wait on.
+ * @param count The number of objects.
+ * @param milliseconds The amount of time to wait before giving up. 0 waits forever.
+ * @return The index of the object that became ready or -1 on timeout.
+ */
+int32_t wait_multiple(struct wait_object * objects, uint32_t count, uint32_t milliseconds);
+
+// --------------------------------------
+// Memory pool
+// --------------------------------------
+
+struct mempool;
+
+// The size of a block holding <size> bytes. Blocks are pointer aligned.
+#define MEMPOOL_BLOCK_SIZE(size)                (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+// The size of the buffer needed by a pool of <count> blocks of <size> bytes.
+#define MEMPOOL_BUFFER_SIZE(size, count)        (MEMPOOL_BLOCK_SIZE(size) * (count))
+
+/**
+ * Initialize a new memory pool of fixed size blocks.
+ * @param pool The pool to initialize.
+ * @param buffer The memory that the blocks are carved from. Must be pointer aligned
+ *               and MEMPOOL_BUFFER_SIZE(size, count) bytes.
+ * @param size The size of the blocks.
+ * @param count The number of blocks.
+ */
+void mempool_init(struct mempool * pool, void * buffer, size_t size, uint32_t count);
+
+/**
+ * Allocate a block. This call will block until a block is freed if the pool is empty.
+ * @param pool The pool to allocate from.
+ * @return The block.
+ */
+void * mempool_alloc(struct mempool * pool);
+
+/**
+ * Try to allocate a block. This call won't block if the pool is empty.
+ * Safe to call from ISRs.
+ * @param pool The pool to allocate from.
+ * @return The block or NULL if the pool is empty or tasks are waiting for a block.
+ */
+void * mempool_tryalloc(struct mempool * pool);
+
+/**
+ * Allocate a block. This call will block until a block is freed if the pool is empty.
+ * @param pool The pool to allocate from.
+ * @param milliseconds The amount of time to wait before giving up. 0 waits forever.
+ * @return The block or NULL if the allocation timed out.
+ */
+void * mempool_timed_alloc(struct mempool * pool, uint32_t milliseconds);
+
+/**
+ * Free a block. The highest priority task waiting for a block gets it.
+ * Safe to call from ISRs.
+ * @param pool The pool that the block was allocated from.
+ * @param block The block to free.
+ */
+void mempool_free(struct mempool * pool, void * block);
+
+/**
+ * Get the number of blocks allocated from a pool.
+ * @param pool The pool.
+ * @return The number of blocks allocated.
+ */
+uint32_t mempool_used(struct mempool * pool);
+
+/**
+ * Get the most blocks that were ever allocated at once from a pool.
+ * @param pool The pool.
+ * @return The high-water mark of allocated blocks.
+ */
+uint32_t mempool_peak(struct mempool * pool);
+
+// --------------------------------------
+// Heap
+// --------------------------------------
+
+struct heap;
+
+/**
+ * Initialize a new heap for variable size allocations.
+ * Allocating and freeing take constant time no matter how the heap is used.
+ * The scheduler is disabled while the heap is updated so it can be shared between tasks.
+ * It must not be used from ISRs.
+ * @param heap The heap to initialize.
+ * @param buffer The memory that the allocations are carved from. Must be 4 byte aligned.
+ * @param size The size of the buffer. Must be less than 64KB.
+ */
+void heap_init(struct heap * heap, void * buffer, size_t size);
+
+/**
+ * Allocate memory from a heap.
+ * @param heap The heap to allocate from.
+ * @param size The number of bytes to allocate.
+ * @return The 4 byte aligned memory or NULL if there's no free block big enough.
+ */
+void * heap_alloc(struct heap * heap, size_t size);
+
+/**
+ * Free memory allocated from a heap.
+ * @param heap The heap that the memory was allocated from.
+ * @param ptr The memory to free. Nothing is done if it's NULL.
+ */
+void heap_free(struct heap * heap, void * ptr);
+
+/**
+ * Get the number of bytes allocated from a heap. This includes the block headers.
+ * @param heap The heap.
+ * @return The number of bytes allocated.
+ */
+size_t heap_used(struct heap * heap);
+
+/**
+ * Get the most bytes that were ever allocated at once from a heap.
+ * @param heap The heap.
+ * @return The high-water mark of allocated bytes.
+ */
+size_t heap_peak(struct heap * heap);
+
+/**
+ * Get how fragmented the free memory of a heap is.
+ * This isn't constant time, it looks through the list holding the largest free block.
+ * @param heap The heap.
+ * @return The percentage of the free memory that isn't part of the largest free block.
+ */
+uint32_t heap_fragmentation(struct heap * heap);
+
+// --------------------------------------
+// Work queue
+// --------------------------------------
+
+struct work;
+struct workqueue;
+
+/**
+ * Initialize a job that can be submitted to a work queue.
+ * @param work The job to initialize.
+ * @param func The function that runs the job.
+ * @param arg The argument passed to <func>.
+ */
+void work_init(struct work * work, void (*func)(void *), void * arg);
+
+/**
+ * Initialize a new work queue and create its workers. The workers are
+ * detached and never return.
+ * @param queue The work queue to initialize.
+ * @param workers The <count> tasks used as workers.
+ * @param stacks The memory for the stacks. Must be <count> * <stack_size> bytes.
+ * @param stack_size The size of each stack. Must be a multiple of 8.
+ * @param count The number of workers.
+ * @param priority The priority that the jobs run at.
+ */
+void workqueue_init(struct workqueue * queue,
+                    struct task * workers,
+                    void * stacks,
+                    uint32_t stack_size,
+                    uint32_t count,
+                    uint8_t priority);
+
+/**
+ * Submit a job to a work queue. The jobs run in the order they were submitted.
+ * Nothing is done if the job is already pending. A job can be submitted
+ * again as soon as it starts running. Safe to call from ISRs.
+ * @param queue The work queue.
+ * @param work The job to run.
+ */
+void workqueue_submit(struct workqueue * queue, struct work * work);
+
+// --------------------------------------
+// Fiber
+// --------------------------------------
+
+struct fiber;
+struct fiber_host;
+
+// What a fiber returns to its host.
+#define FIBER_WAITING                           (0) // Still waiting. Nothing happened since the last run.
+#define FIBER_YIELDED                           (1) // Gave the other fibers a chance to run.
+#define FIBER_DONE                              (2) // Finished. It won't run again.
+#define FIBER_PROGRESS                          (3) // Ran some code and is waiting again.
+
+// Entry signature for all fibers
+typedef uint8_t (*fiber_entry_t)(struct fiber *);
+
+// A fiber resumes from the last line that it waited on. The code of a fiber
+// must be between FIBER_BEGIN() and FIBER_END(). Local variables aren't kept
+// while it waits and the waits can't be inside a switch statement.
+#define FIBER_BEGIN(fiber)\
+  uint8_t fiber_result = FIBER_WAITING; switch ((fiber)->resume) { case 0:
+#define FIBER_END(fiber)\
+  } (void)fiber_result; (fiber)->resume = 0; return FIBER_DONE
+
+// Wait until a condition is true. The condition is checked every time the host runs the fiber.
+// A fiber that reaches the wait by running code rather than by resuming reports progress
+// even if it's the same wait as the last time.
+#define FIBER_WAIT_UNTIL(fiber, condition)\
+  do { (fiber)->resume = __LINE__; fiber_result = FIBER_PROGRESS; case __LINE__: if (!(condition)) return fiber_result; } while (0)
+
+// Give the other fibers a chance to run.
+#define FIBER_YIELD(fiber)\
+  do { (fiber)->resume = __LINE__; return FIBER_YIELDED; case __LINE__:; } while (0)
+
+// Wait for a number of milliseconds.
+#define FIBER_DELAY(fiber, milliseconds)\
+  do { fiber_timer_start((fiber), (milliseconds)); FIBER_WAIT_UNTIL((fiber), fiber_timer_expired(fiber)); } while (0)
+
+// Wait until a message can be received from a channel without blocking.
+#define FIBER_WAIT_CHANNEL(fiber, channel)      FIBER_WAIT_UNTIL((fiber), fiber_channel_ready((fiber), (channel)))
+
+/**
+ * Initialize a new fiber host.
+ * @param host The host to initialize.
+ * @param objects The wait objects used to block on channels. One is needed for each
+ *                fiber that can wait on a channel at the same time.
+ * @param count The number of wait objects.
+ */
+void fiber_host_init(struct fiber_host * host, struct wait_object * objects, uint32_t count);
+
+/**
+ * Start a new fiber. It runs the next time the host runs its fibers.
+ * @param host The host that runs the fiber.
+ * @param fiber The fiber to start.
+ * @param entry The entry point for the fiber.
+ * @param arg The argument that the fiber can get with fiber_arg().
+ */
+void fiber_start(struct fiber_host * host, struct fiber * fiber, fiber_entry_t entry, void * arg);
+
+/**
+ * Run the fibers of a host from the calling task. The task blocks when
+ * none of the fibers can make progress.
+ * Fibers that only wait on conditions changed by other tasks are polled every millisecond,
+ * even while other fibers wait on channels or timers.
+ * @param host The host whose fibers are run.
+ * @return This function returns once every fiber is done.
+ */
+void fiber_host_run(struct fiber_host * host);
+
+/**
+ * Get the argument that a fiber was started with.
+ * @param fiber The fiber.
+ * @return The argument given to fiber_start().
+ */
+void * fiber_arg(struct fiber * fiber);
+
+// These are used by the FIBER_* macros.
+void fiber_timer_start(struct fiber * fiber, uint32_t milliseconds);
+bool fiber_timer_expired(struct fiber * fiber);
+bool fiber_channel_ready(struct fiber * fiber, struct channel * channel);
+
+// --------------------------------------
+// Active object
+// --------------------------------------
+
+struct active_object;
+struct active_scheduler;
+
+// Handles an event. It must not block since every object shares the host task.
+typedef void (*active_dispatch_t)(struct active_object *, uint32_t);
+
+/**
+ * Initialize a new active object scheduler.
+ * @param scheduler The scheduler to initialize.
+ */
+void active_scheduler_init(struct active_scheduler * scheduler);
+
+/**
+ * Initialize a new active object.
+ * @param object The active object to initialize.
+ * @param scheduler The scheduler that dispatches its events.
+ * @param dispatch The function that handles its events.
+ * @param priority The priority of the object. Must be less than ACTIVE_PRIORITIES
+ *                 and unique within the scheduler.
+ * @param events The buffer for the events waiting to be dispatched.
+ * @param count The number of events that can wait.
+ */
+void active_init(struct active_object * object,
+                 struct active_scheduler * scheduler,
+                 active_dispatch_t dispatch,
+                 uint8_t priority,
+                 uint32_t * events,
+                 uint32_t count);
+
+/**
+ * Post an event to an active object. An object posting to an object with
+ * a higher priority is preempted until the event is handled.
+ * Safe to call from ISRs.
+ * @param object The active object.
+ * @param event The event.
+ * @return False if the object's queue of events is full.
+ */
+bool active_post(struct active_object * object, uint32_t event);
+
+/**
+ * Dispatch the events of the active objects from the calling task.
+ * The task blocks while there are no events to dispatch.
+ * @param scheduler The scheduler.
+ * @return This function never returns.
+ */
+void active_scheduler_run(struct active_scheduler * scheduler);
+
+// --------------------------------------
+// Timer
+// --------------------------------------
+
+struct timer;
+
+/**
+ * Create the task that calls the functions of the timers that expire.
+ * This must be called once before starting any timers.
+ * @param task The service task to initialize. It never returns.
+ * @param stack The stack of the service task. The timer functions run on it.
+ * @param stack_size The size of the stack.
+ * @param priority The priority that the timer functions run at.
+ */
+void timer_service_init(struct task * task, void * stack, uint32_t stack_size, uint8_t priority);
+
+/**
+ * Initialize a new timer.
+ * @param timer The timer to initialize.
+ * @param func The function called when the timer expires. It must not block for long
+ *             since the other timers wait for it.
+ */
+void timer_init(struct timer * timer, void (*func)(struct timer *));
+
+/**
+ * Start a timer. A timer that is already running is restarted.
+ * @param timer The timer to start.
+ * @param milliseconds The time from now that the timer expires at.
+ * @param period The time between the expiries that follow or 0 for a one-shot timer.
+ */
+void timer_start(struct timer * timer, uint32_t milliseconds, uint32_t period);
+
+/**
+ * Stop a timer. Its function won't be called unless it's already running.
+ * @param timer The timer to stop.
+ * @return True if the timer was running.
+ */
+bool timer_stop(struct timer * timer);
+
+/**
+ * Check if a timer is running. A one-shot timer stops running when it expires.
+ * @param timer The timer.
+ * @return True if the timer is running.
+ */
+bool timer_active(struct timer * timer);
+
+// --------------------------------------
+// Partition
+// --------------------------------------
+
+// The partition of the tasks created before the kernel starts, including the kernel's.
+// Its tasks run when the partition of the current window has nothing to run.
+#define PARTITION_BACKGROUND (0)
+
+struct partition_window;
+
+/**
+ * Set the major frame of time partitioning. The windows repeat in order forever and
+ * only the tasks of a window's partition and the background partition run during it.
+ * The frame starts over right away. Passing no windows turns off time partitioning.
+ * @param windows The windows of the major frame. Must outlive the frame.
+ * @param count The number of windows.
+ */
+void partition_set_frame(const struct partition_window * windows, uint32_t count);
+
 #endif
@@ -0,0 +1,182 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "mempool.h"
+
+#include "manticore.h"
+
+#include "system.h"
+#include "syscall.h"
+#include "kernel.h"
+
+#include <assert.h>
+
+static void mempool_push(struct mempool * pool, void * block);
+static void mempool_deferred(struct deferred_work * work);
+
+void mempool_init(struct mempool * pool, void * buffer, size_t block_size, uint32_t count)
+{
+  static uint8_t mempool_id_counter = 0;
+  assert(buffer != NULL);
+  assert(((uintptr_t)buffer & (sizeof(void*) - 1)) == 0);
+  assert(count > 0);
+
+  pool->id = mempool_id_counter++;
+  pool->buffer = (uint8_t*)buffer;
+  pool->block_size = MEMPOOL_BLOCK_SIZE(block_size);
+  pool->num_blocks = count;
+  pool->used = 0;
+  pool->peak = 0;
+  pqueue_init(&pool->waiting_tasks, pqueue_wait_compare);
+  deferred_work_init(&pool->deferred, mempool_deferred);
+
+  // Thread the free list through the blocks. The first block is handed out first.
+  pool->free_blocks = NULL;
+  for (uint32_t i = count; i > 0; --i)
+  {
+    void ** block = (void**)(pool->buffer + (i - 1) * pool->block_size);
+    *block = pool->free_blocks;
+    pool->free_blocks = block;
+  }
+}
+
+void * mempool_alloc(struct mempool * pool)
+{
+  return mempool_timed_alloc(pool, 0);
+}
+
+void * mempool_tryalloc(struct mempool * pool)
+{
+  // Don't take a block ahead of the tasks already waiting for one.
+  if (!pqueue_empty(&pool->waiting_tasks))
+  {
+    return NULL;
+  }
+  return mempool_pop(pool);
+}
+
+void * mempool_timed_alloc(struct mempool * pool, uint32_t milliseconds)
+{
+  void * block = mempool_tryalloc(pool);
+  if (block != NULL)
+  {
+    return block;
+  }
+
+  // The pool is empty or other tasks are waiting for it. The kernel checks
+  // again before blocking in case a block is freed before we get there.
+  running_task->mempool = pool;
+  running_task->sleep = milliseconds;
+  SVC_MEMPOOL_ALLOC();
+  return running_task->mempool_block;
+}
+
+void mempool_free(struct mempool * pool, void * block)
+{
+  assert((uint8_t*)block >= pool->buffer);
+  assert((uint8_t*)block < pool->buffer + pool->num_blocks * pool->block_size);
+  assert(((uint8_t*)block - pool->buffer) % pool->block_size == 0);
+
+  if (SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk)
+  {
+    // We're in an ISR. The kernel will hand the block to the waiting task.
+    // Until then the tasks allocating from the pool leave it alone.
+    mempool_push(pool, block);
+    if (!pqueue_empty(&pool->waiting_tasks))
+    {
+      kernel_defer(&pool->deferred);
+    }
+    return;
+  }
+
+  kernel_scheduler_disable();
+  if (pqueue_empty(&pool->waiting_tasks))
+  {
+    // No one to wake up.
+    mempool_push(pool, block);
+    kernel_scheduler_enable();
+    return;
+  }
+
+  // The block goes straight to the highest priority waiting task.
+  running_task->mempool = pool;
+  running_task->mempool_block = block;
+  SVC_MEMPOOL_FREE();
+}
+
+uint32_t mempool_used(struct mempool * pool)
+{
+  return pool->used;
+}
+
+uint32_t mempool_peak(struct mempool * pool)
+{
+  return pool->peak;
+}
+
+void * mempool_pop(struct mempool * pool)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  void ** block = (void**)pool->free_blocks;
+  if (block != NULL)
+  {
+    pool->free_blocks = *block;
+    pool->used++;
+    if (pool->used > pool->peak)
+      pool->peak = pool->used;
+  }
+  __set_PRIMASK(primask);
+  return block;
+}
+
+void mempool_push(struct mempool * pool, void * block)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  assert(pool->used > 0);
+  *(void**)block = pool->free_blocks;
+  pool->free_blocks = block;
+  pool->used--;
+  __set_PRIMASK(primask);
+}
+
+void mempool_give(struct mempool * pool, void * block)
+{
+  if (pqueue_empty(&pool->waiting_tasks))
+  {
+    mempool_push(pool, block);
+    return;
+  }
+
+  // The highest priority task gets the block first.
+  struct task * waiter = task_from_wait_node(pqueue_peek(&pool->waiting_tasks));
+  task_stop_waiting(waiter);
+  list_remove(&waiter->sleep_node); // Stop sleeping in case of mempool_timed_alloc().
+  waiter->mempool_block = block;
+  waiter->state = STATE_READY;
+  task_wait_on(waiter, &ready_tasks);
+}
+
+void mempool_wake(struct mempool * pool)
+{
+  while (!pqueue_empty(&pool->waiting_tasks))
+  {
+    void * block = mempool_pop(pool);
+    if (block == NULL)
+      break;
+    mempool_give(pool, block);
+  }
+}
+
+void mempool_deferred(struct deferred_work * work)
+{
+  mempool_wake(container_of(work, struct mempool, deferred));
+}
@@ -0,0 +1,63 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * A memory pool hands out fixed size blocks from a caller provided buffer.
+ * The free blocks are kept in a singly linked list threaded through the
+ * blocks themselves so allocating and freeing are constant time.
+ * Interrupts are masked while the list is updated so blocks can be freed
+ * from ISRs. An ISR can't enter the kernel so it defers handing the block
+ * to a waiting task to the next time the scheduler runs.
+ */
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include "kernel.h"
+#include "pqueue.h"
+#include "task.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct mempool
+{
+  uint8_t id;
+
+  // The first free block. Each free block holds a pointer to the next one.
+  void * free_blocks;
+
+  // The buffer that the blocks are carved from.
+  uint8_t * buffer;
+  size_t block_size;
+  uint32_t num_blocks;
+
+  // The number of blocks allocated now and the most that were ever allocated at once.
+  uint32_t used;
+  uint32_t peak;
+
+  // The tasks waiting for a block.
+  struct pqueue waiting_tasks;
+
+  // Hands the blocks freed from ISRs to the waiting tasks.
+  struct deferred_work deferred;
+};
+
+// Returns a free block or NULL. Safe to call from ISRs and the kernel.
+void * mempool_pop(struct mempool * pool);
+
+// Gives a block to the highest priority waiting task or puts it back in the pool
+// if no one is waiting. Must be called from the kernel.
+void mempool_give(struct mempool * pool, void * block);
+
+// Gives the free blocks to the waiting tasks. Must be called from the kernel.
+void mempool_wake(struct mempool * pool);
+
+#endif
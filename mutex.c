@@ -17,6 +17,7 @@
 #include "syscall.h"
 #include "utils.h"
 #include "kernel.h"
+#include "wait.h"
 
 #include <assert.h>
 
@@ -27,7 +28,12 @@ void mutex_init(struct mutex * mutex, uint32_t options)
   mutex->owner = NULL;
   mutex->locked = 0;
   mutex->recursive = options & MUTEX_ATTR_RECURSIVE;
+  mutex->prio_ceiling = (options & MUTEX_ATTR_PRIO_CEILING(0)) != 0;
+  mutex->ceiling = (options >> 8) & 0xFF;
+  mutex->lock_steal = options & MUTEX_ATTR_LOCK_STEAL;
+  list_init(&mutex->ceiling_node);
   pqueue_init(&mutex->waiting_tasks, pqueue_wait_compare);
+  pqueue_init(&mutex->multi_waiters, pqueue_wait_object_compare);
 }
 
 void mutex_lock(struct mutex * mutex)
@@ -45,9 +51,7 @@ bool mutex_trylock(struct mutex * mutex)
   }
   else
   {
-    assert(mutex->locked != UINT8_MAX);
-    mutex->locked++;
-    mutex->owner = running_task;
+    mutex_acquire(mutex, running_task);
     kernel_scheduler_enable();
     return true;
   }
@@ -56,22 +60,26 @@ bool mutex_trylock(struct mutex * mutex)
 bool mutex_timed_lock(struct mutex * mutex, uint32_t milliseconds)
 {
   kernel_scheduler_disable();
-  if (!mutex->locked || (mutex->recursive && mutex->owner == running_task))
-  {
-    // The mutex is already ours or unlocked. Just take it.
-    assert(mutex->locked != UINT8_MAX);
-    mutex->locked++;
-    mutex->owner = running_task;
-    kernel_scheduler_enable();
-    return true;
-  }
-  else
+  running_task->mutex_woken = false;
+  running_task->sleep = milliseconds;
+  while (mutex->locked && (!mutex->recursive || mutex->owner != running_task))
   {
     running_task->mutex = mutex;
-    running_task->sleep = milliseconds;
     SVC_MUTEX_LOCK();
-    return running_task->mutex_locked;
+    if (!running_task->mutex_woken)
+    {
+      // The mutex was handed to us or we timed out.
+      return running_task->mutex_locked;
+    }
+
+    // A lock steal mutex was unlocked. Try again with whatever is left of the timeout.
+    kernel_scheduler_disable();
   }
+
+  // The mutex is already ours or unlocked. Just take it.
+  mutex_acquire(mutex, running_task);
+  kernel_scheduler_enable();
+  return true;
 }
 
 void mutex_unlock(struct mutex * mutex)
@@ -79,7 +87,8 @@ void mutex_unlock(struct mutex * mutex)
   assert(mutex->locked);
   assert(mutex->owner == running_task);
   kernel_scheduler_disable();
-  if (mutex->locked == 1 && !pqueue_empty(&mutex->waiting_tasks))
+  if (mutex->locked == 1 &&
+      (!pqueue_empty(&mutex->waiting_tasks) || !pqueue_empty(&mutex->multi_waiters)))
   {
     // Another task is waiting for this mutex.
     // Let the kernel run to unblock it.
@@ -90,9 +99,67 @@ void mutex_unlock(struct mutex * mutex)
   {
     // The current task still has the mutex
     // or no one else is waiting for it.
-    mutex->locked--;
-    if (!mutex->locked)
-      mutex->owner = NULL;
-    kernel_scheduler_enable();
+    mutex_release(mutex);
+
+    // We may have dropped from a priority ceiling below a ready task.
+    task_reschedule();
+  }
+}
+
+void mutex_acquire(struct mutex * mutex, struct task * task)
+{
+  assert(mutex->locked != UINT8_MAX);
+  mutex->locked++;
+  mutex->owner = task;
+
+  if (mutex->prio_ceiling && mutex->locked == 1)
+  {
+    // A task above the ceiling could preempt the owner and find the mutex locked.
+    assert(task->provisioned_priority <= mutex->ceiling);
+    assert(task->waiting == NULL);
+    assert(task->blocked == NULL);
+
+    // Run at the ceiling while we own the mutex. The task isn't in any
+    // priority queue so raising its priority is all there is to do.
+    pqueue_push(&task->ceilings, &mutex->ceiling_node);
+    if (mutex->ceiling > task->priority)
+      task->priority = mutex->ceiling;
+  }
+  else if (mutex->lock_steal && mutex->locked == 1)
+  {
+    // The tasks still waiting on a lock steal mutex weren't blocked on
+    // anyone while it was unlocked. They're now blocked on the new owner.
+    struct list_head * node;
+    pqueue_for_each(node, &mutex->waiting_tasks)
+    {
+      task_add_blocked(task, task_from_wait_node(node));
+    }
   }
 }
+
+void mutex_release(struct mutex * mutex)
+{
+  assert(mutex->locked);
+  mutex->locked--;
+  if (mutex->locked)
+    return;
+
+  struct task * task = mutex->owner;
+  mutex->owner = NULL;
+
+  if (mutex->prio_ceiling)
+  {
+    // Drop back to whatever priority we'd have without this ceiling.
+    assert(task->waiting == NULL);
+    assert(task->blocked == NULL);
+    list_remove(&mutex->ceiling_node);
+    task->priority = task_effective_priority(task, &task->deadline);
+  }
+}
+
+bool pqueue_ceiling_compare(struct list_head * a, struct list_head * b)
+{
+  struct mutex * ma = container_of(a, struct mutex, ceiling_node);
+  struct mutex * mb = container_of(b, struct mutex, ceiling_node);
+  return ma->ceiling > mb->ceiling;
+}
@@ -28,8 +28,30 @@ struct mutex
   bool recursive;
   struct task * owner; // The task that owns this mutex.
 
+  // A priority ceiling mutex raises its owner to the ceiling priority instead
+  // of having the owner inherit the priority of the tasks blocked on it.
+  bool prio_ceiling;
+  uint8_t ceiling;
+  struct list_head ceiling_node; // Node in the owner's priority queue of ceilings.
+
+  // Unlocking a contended lock steal mutex wakes the top waiter without giving it the mutex.
+  bool lock_steal;
+
   // The priority queue of tasks waiting for this mutex.
   struct pqueue waiting_tasks;
+
+  // The priority queue of tasks waiting for this mutex with wait_multiple().
+  // These tasks don't take part in priority inheritance.
+  struct pqueue multi_waiters;
 };
 
+// Lock/unlock the mutex on behalf of a task. The priority of the owner is
+// updated for priority ceiling mutexes. Must be called with the scheduler
+// disabled or from the kernel. The owner can't be waiting on a priority queue.
+void mutex_acquire(struct mutex * mutex, struct task * task);
+void mutex_release(struct mutex * mutex);
+
+// Compares the ceilings of 2 mutexes given their ceiling_nodes.
+bool pqueue_ceiling_compare(struct list_head * a, struct list_head * b);
+
 #endif
@@ -0,0 +1,104 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "partition.h"
+
+#include "manticore.h"
+
+#include "kernel.h"
+#include "clock.h"
+
+#include <assert.h>
+
+static struct
+{
+  const struct partition_window * windows;
+  uint32_t count;
+  uint32_t current; // The index of the current window.
+  uint64_t end;     // The time in systicks that the current window ends at or 0 if it hasn't started.
+} frame;
+
+void partition_set_frame(const struct partition_window * windows, uint32_t count)
+{
+  assert(windows != NULL || count == 0);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    assert(windows[i].duration > 0);
+  }
+
+  // The frame starts the next time the scheduler runs.
+  if (kernel_running)
+    kernel_scheduler_disable();
+  frame.windows = count > 0 ? windows : NULL;
+  frame.count = count;
+  frame.current = 0;
+  frame.end = 0;
+  if (kernel_running)
+    task_yield();
+}
+
+void partition_advance(uint64_t now)
+{
+  if (frame.windows == NULL)
+    return;
+
+  if (frame.end == 0)
+  {
+    frame.end = now + frame.windows[0].duration * (SYSTICK_HZ / 1000);
+    return;
+  }
+
+  // The scheduler may run late if the SysTick was disabled. Skip the windows that were missed.
+  while (now >= frame.end)
+  {
+    frame.current = (frame.current + 1) % frame.count;
+    frame.end += frame.windows[frame.current].duration * (SYSTICK_HZ / 1000);
+  }
+}
+
+bool partition_window_end(uint64_t * end)
+{
+  *end = frame.end;
+  return frame.windows != NULL;
+}
+
+bool partition_active(struct task * task)
+{
+  return frame.windows == NULL || task->partition == frame.windows[frame.current].partition;
+}
+
+struct task * partition_peek(struct pqueue * ready)
+{
+  if (pqueue_empty(ready))
+    return NULL;
+  if (frame.windows == NULL)
+    return task_from_wait_node(pqueue_peek(ready));
+
+  // The ready tasks are in priority order. Take the first one of the current
+  // partition or the first background task if the partition has nothing ready.
+  struct task * background = NULL;
+  struct list_head * node;
+  pqueue_for_each(node, ready)
+  {
+    struct task * task = task_from_wait_node(node);
+    if (partition_active(task))
+      return task;
+    if (background == NULL && task->partition == PARTITION_BACKGROUND)
+      background = task;
+  }
+  return background;
+}
+
+bool partition_precedes(struct task * a, struct task * b)
+{
+  if (partition_active(a) != partition_active(b))
+    return partition_active(a);
+  return task_precedes(a, b);
+}
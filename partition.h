@@ -0,0 +1,55 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Time partitioning isolates independent applications from each other.
+ * A static major frame of windows repeats forever and each window belongs
+ * to a partition. While a window is active the scheduler only picks the
+ * ready tasks of its partition. Tasks of the background partition run
+ * when the window's partition has nothing ready. A task is in the same
+ * partition as its parent so each application is a subtree of the family
+ * tree. The partition is cached in the task when it's created so that
+ * orphans adopted by the init task stay in their partition.
+ */
+
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include "task.h"
+#include "pqueue.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct partition_window
+{
+  uint8_t partition; // The partition whose tasks run in the window.
+  uint32_t duration; // The length of the window in milliseconds.
+};
+
+// Move to the window that the time is in. The time is in systicks.
+void partition_advance(uint64_t now);
+
+// Returns the time in systicks that the current window ends at
+// or false if there's no major frame.
+bool partition_window_end(uint64_t * end);
+
+// Returns true if a task is in the partition of the current window.
+// Every task is when there's no major frame.
+bool partition_active(struct task * task);
+
+// Returns the ready task that should run next or NULL if none can.
+struct task * partition_peek(struct pqueue * ready);
+
+// Returns true if <a> should run before <b>. A task of the current window's
+// partition runs before a background task. Otherwise the highest priority runs first.
+bool partition_precedes(struct task * a, struct task * b);
+
+#endif
@@ -57,6 +57,22 @@ void pqueue_push(struct pqueue * pqueue, struct list_head * elem)
   list_insert(it, elem);
 }
 
+void pqueue_merge(struct pqueue * pqueue, struct pqueue * other)
+{
+  assert(pqueue);
+  assert(other);
+  // Both lists are sorted so we never need to move backwards.
+  // Elements from <other> go after the elements of equal priority.
+  struct list_head * it = pqueue->list.next;
+  while (!list_empty(&other->list)) {
+    struct list_head * elem = other->list.next;
+    while (it != &pqueue->list && !pqueue->compare(elem, it))
+      it = it->next;
+    list_remove(elem);
+    list_insert(it->prev, elem);
+  }
+}
+
 void pqueue_increase(struct pqueue * pqueue, struct list_head * elem)
 {
   assert(pqueue);
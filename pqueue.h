@@ -31,6 +31,10 @@ struct list_head * pqueue_peek(struct pqueue * pqueue);
 struct list_head * pqueue_pop(struct pqueue * pqueue);
 void pqueue_push(struct pqueue * pqueue, struct list_head * elem);
 
+// Moves all the elements of <other> into the priority queue in a single pass.
+// Both queues must use the same ordering. <other> will be empty afterwards.
+void pqueue_merge(struct pqueue * pqueue, struct pqueue * other);
+
 // TODO This needs to be called from task_reschedule.
 // Reschedules an element after its priority has changed.
 void pqueue_increase(struct pqueue * pqueue, struct list_head * elem);
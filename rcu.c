@@ -0,0 +1,126 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "rcu.h"
+
+#include "manticore.h"
+
+#include "syscall.h"
+#include "kernel.h"
+#include "utils.h"
+
+#include <assert.h>
+
+struct list_head rcu_blocked_readers;
+struct pqueue rcu_waiting_tasks;
+
+// The callbacks waiting for their grace period to end.
+// They're queued in grace period order.
+static struct list_head rcu_callbacks;
+
+// The number of the most recent grace period.
+static uint32_t rcu_grace_period = 0;
+
+void rcu_init(void)
+{
+  list_init(&rcu_blocked_readers);
+  list_init(&rcu_callbacks);
+  pqueue_init(&rcu_waiting_tasks, pqueue_wait_compare);
+}
+
+void rcu_read_lock(void)
+{
+  running_task->rcu_nesting++;
+  __DMB();
+}
+
+void rcu_read_unlock(void)
+{
+  __DMB();
+  assert(running_task->rcu_nesting > 0);
+  running_task->rcu_nesting--;
+
+  // Let the kernel know if someone may be waiting for us.
+  // This only happens if we were switched out in the critical section.
+  if (running_task->rcu_nesting == 0 && running_task->rcu_blocked)
+  {
+    SVC_RCU_UNLOCK();
+  }
+}
+
+void synchronize_rcu(void)
+{
+  // Waiting in a read-side critical section would wait for ourselves.
+  assert(running_task->rcu_nesting == 0);
+
+  kernel_scheduler_disable();
+  running_task->rcu_target = ++rcu_grace_period;
+  if (rcu_grace_period_complete(rcu_grace_period))
+  {
+    // No reader was switched out in a critical section.
+    kernel_scheduler_enable();
+  }
+  else
+  {
+    SVC_RCU_SYNCHRONIZE();
+  }
+}
+
+void call_rcu(struct rcu_head * head, rcu_callback_t func)
+{
+  assert(head != NULL);
+  assert(func != NULL);
+  head->func = func;
+
+  kernel_scheduler_disable();
+  head->grace_period = ++rcu_grace_period;
+  list_push_back(&rcu_callbacks, &head->node);
+  kernel_scheduler_enable();
+
+  // Take the opportunity to reclaim older memory.
+  rcu_process_callbacks();
+}
+
+void rcu_switch_out(struct task * task)
+{
+  if (task->rcu_nesting > 0 && !task->rcu_blocked)
+  {
+    // Any grace period that starts from now on doesn't need to wait for this task.
+    task->rcu_blocked = true;
+    task->rcu_grace_period = rcu_grace_period;
+    list_push_back(&rcu_blocked_readers, &task->rcu_node);
+  }
+}
+
+bool rcu_grace_period_complete(uint32_t grace_period)
+{
+  // The first blocked reader was blocked the earliest.
+  struct list_head * first = list_front(&rcu_blocked_readers);
+  return first == NULL ||
+         container_of(first, struct task, rcu_node)->rcu_grace_period >= grace_period;
+}
+
+void rcu_process_callbacks(void)
+{
+  while (true)
+  {
+    kernel_scheduler_disable();
+    struct list_head * first = list_front(&rcu_callbacks);
+    struct rcu_head * head = container_of(first, struct rcu_head, node);
+    if (first == NULL || !rcu_grace_period_complete(head->grace_period))
+    {
+      kernel_scheduler_enable();
+      return;
+    }
+    list_remove(first);
+    kernel_scheduler_enable();
+    head->func(head);
+  }
+}
@@ -0,0 +1,61 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Read-copy-update for data that is read often and rarely replaced.
+ * Readers only increment and decrement a counter in their task.
+ *
+ * There's a single CPU so a reader can only be in the middle of a read-side
+ * critical section while another task runs if it was switched out inside it.
+ * The scheduler puts such readers on a list of blocked readers, stamped with
+ * the current grace period number. A grace period is over once every reader
+ * that was blocked before it started has left its critical section.
+ * The blocked list is kept in stamp order so checking that is constant time.
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+#include "list.h"
+#include "task.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct rcu_head;
+
+typedef void (*rcu_callback_t)(struct rcu_head *);
+
+struct rcu_head
+{
+  struct list_head node;
+  rcu_callback_t func;
+  uint32_t grace_period; // The grace period that must end before calling func.
+};
+
+// The tasks that were switched out in a read-side critical section.
+extern struct list_head rcu_blocked_readers;
+
+// The tasks waiting in synchronize_rcu().
+extern struct pqueue rcu_waiting_tasks;
+
+void rcu_init(void);
+
+// Called by the scheduler when a task is switched out.
+// A reader switched out in a read-side critical section holds up grace periods.
+void rcu_switch_out(struct task * task);
+
+// Returns true if the grace period has ended.
+bool rcu_grace_period_complete(uint32_t grace_period);
+
+// Runs the callbacks whose grace period has ended.
+void rcu_process_callbacks(void);
+
+#endif
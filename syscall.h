@@ -23,6 +23,20 @@
 #define SYSCALL_CHANNEL_REPLY (7) // Reply to a message on a channel
 #define SYSCALL_TASK_RETURN   (8) // A task makes this syscall when it returns
 #define SYSCALL_TASK_WAIT     (9) // Wait for a task to finish
+#define SYSCALL_WAIT_MULTIPLE (10) // Wait for one of multiple objects
+#define SYSCALL_BARRIER_WAIT  (11) // Wait for the other tasks to reach a barrier
+#define SYSCALL_BARRIER_RELEASE (12) // Release the tasks waiting on a barrier
+#define SYSCALL_RCU_SYNCHRONIZE (13) // Wait for an RCU grace period to end
+#define SYSCALL_RCU_UNLOCK    (14) // Leave a read-side critical section after being switched out
+#define SYSCALL_FUTEX_WAIT    (15) // Wait on an address
+#define SYSCALL_FUTEX_WAKE    (16) // Wake up the tasks waiting on an address
+#define SYSCALL_MEMPOOL_ALLOC (17) // Wait for a block from an empty memory pool
+#define SYSCALL_MEMPOOL_FREE  (18) // Free a block that a task is waiting for
+#define SYSCALL_GROUP_JOIN    (19) // Wait for every task in a group to return
+#define SYSCALL_WORKQUEUE_WAIT (20) // Wait for a job to be submitted to a work queue
+#define SYSCALL_WORKQUEUE_WAKE (21) // Wake a worker for a job submitted to a work queue
+#define SYSCALL_SLEEP_UNTIL   (22) // Sleep until an absolute time
+#define SYSCALL_RESCHEDULE    (23) // Let a task that's ready preempt the running task
 
 // Macros to do the system calls
 #define SVC_YIELD()           asm ("SVC #1")
@@ -34,5 +48,19 @@
 #define SVC_CHANNEL_REPLY()   asm ("SVC #7")
 #define SVC_TASK_RETURN()     asm ("SVC #8")
 #define SVC_TASK_WAIT()       asm ("SVC #9")
+#define SVC_WAIT_MULTIPLE()   asm ("SVC #10")
+#define SVC_BARRIER_WAIT()    asm ("SVC #11")
+#define SVC_BARRIER_RELEASE() asm ("SVC #12")
+#define SVC_RCU_SYNCHRONIZE() asm ("SVC #13")
+#define SVC_RCU_UNLOCK()      asm ("SVC #14")
+#define SVC_FUTEX_WAIT()      asm ("SVC #15")
+#define SVC_FUTEX_WAKE()      asm ("SVC #16")
+#define SVC_MEMPOOL_ALLOC()   asm ("SVC #17")
+#define SVC_MEMPOOL_FREE()    asm ("SVC #18")
+#define SVC_GROUP_JOIN()      asm ("SVC #19")
+#define SVC_WORKQUEUE_WAIT()  asm ("SVC #20")
+#define SVC_WORKQUEUE_WAKE()  asm ("SVC #21")
+#define SVC_SLEEP_UNTIL()     asm ("SVC #22")
+#define SVC_RESCHEDULE()      asm ("SVC #23")
 
 #endif
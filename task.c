@@ -3,6 +3,9 @@
 #include "manticore.h"
 
 #include "kernel.h"
+#include "partition.h"
+#include "wait.h"
+#include "clock.h"
 #include "utils.h"
 
 #include <assert.h>
@@ -10,44 +13,167 @@
 
 #define TASK_STACK_MAGIC (0x45e2c902)
 
+// The longest delay whose systicks fit in 32 bits.
+#define TASK_DELAY_MAX_MS (UINT32_MAX / (SYSTICK_HZ / 1000))
+
 static void task_return(void * result);
 
+// Sleeps until the current job of a periodic task is released.
+static void task_period_release(struct task_period * period);
+
+// Sets the deadline of the calling task's current job. The scheduler must be disabled.
+static void task_set_job_deadline(uint64_t deadline);
+
+// Returns true if the task's parent is waiting for it to return. That's the case when the
+// parent waits for it by name or when it's the only child that could wake the parent up.
+static bool task_awaited(struct task * task);
+
 void task_init(struct task * task, task_entry_t entry, void * arg, void * stack, uint32_t stack_size, uint8_t priority)
 {
-  assert(stack != NULL);
-  assert(((uintptr_t)stack & 7) == 0); // The stack must be 8 byte aligned.
-  assert(stack_size >= sizeof(struct context));
+  task_init_attr(task, entry, arg, stack, stack_size, priority, TASK_ATTR_DEFAULT);
+}
 
+void task_init_attr(struct task * task, task_entry_t entry, void * arg, void * stack, uint32_t stack_size, uint8_t priority, uint32_t attributes)
+{
   if (kernel_running)
   {
     // We can't be preempted while creating a new task.
     kernel_scheduler_disable();
   }
 
-  static uint8_t task_id_counter = 0;
+  task_setup(task, stack, stack_size);
+  task->slab = NULL;
+  task_start(task, entry, arg, stack_size, priority);
+  task->detached = attributes & TASK_ATTR_DETACHED;
+  if (attributes & TASK_ATTR_PARTITION(0))
+  {
+    task->partition = (uint8_t)(attributes >> 8);
+  }
+
+  if (kernel_running)
+  {
+    task_reschedule();
+  }
+}
+
+void task_slab_init(struct task_slab * slab, void * buffer, uint32_t stack_size, uint32_t count)
+{
+  assert(buffer != NULL);
+  assert(((uintptr_t)buffer & 7) == 0); // The stacks must be 8 byte aligned.
+  assert((stack_size & 7) == 0);
+  slab->buffer = (uint8_t*)buffer;
+  slab->stack_size = stack_size;
+  slab->count = count;
+  slab->used = 0;
+  list_init(&slab->cache);
+}
+
+struct task * task_spawn(task_entry_t entry, void * arg, struct task_slab * slab, uint8_t priority)
+{
+  if (kernel_running)
+  {
+    // We can't be preempted while taking a task from the slab.
+    kernel_scheduler_disable();
+  }
+
+  struct task * task;
+  struct list_head * cached = list_pop_front(&slab->cache);
+  if (cached != NULL)
+  {
+    // This task was already setup and destroyed. It only needs to be restarted.
+    task = task_from_wait_node(cached);
+    assert(task->state == STATE_DEAD);
+  }
+  else if (slab->used < slab->count)
+  {
+    // Take a slot that was never used.
+    uint8_t * slot = slab->buffer + slab->used * TASK_SLAB_SLOT_SIZE(slab->stack_size);
+    slab->used++;
+    task = (struct task *)(slot + slab->stack_size);
+    task_setup(task, slot, slab->stack_size);
+    task->slab = slab;
+  }
+  else
+  {
+    // Every task in the slab is in use.
+    if (kernel_running)
+    {
+      kernel_scheduler_enable();
+    }
+    return NULL;
+  }
+
+  task_start(task, entry, arg, slab->stack_size, priority);
+  if (kernel_running)
+  {
+    task_reschedule();
+  }
+  return task;
+}
+
+void task_setup(struct task * task, void * stack, uint32_t stack_size)
+{
+  assert(stack != NULL);
+  assert(((uintptr_t)stack & 7) == 0); // The stack must be 8 byte aligned.
+  assert(stack_size >= sizeof(struct context));
+
+  task->stack = stack;
+  task->blocked = NULL;
+  pqueue_init(&task->blocking, pqueue_blocking_compare);
+  pqueue_init(&task->ceilings, pqueue_ceiling_compare);
+  list_init(&task->blocking_node);
+  list_init(&task->sleep_node);
+  list_init(&task->rcu_node);
+  list_init(&task->exited);
+  list_init(&task->exited_node);
+  list_init(&task->preempted_node);
+  task->waiting = NULL;
+  list_init(&task->wait_node);
+}
+
+void task_start(struct task * task, task_entry_t entry, void * arg, uint32_t stack_size, uint8_t priority)
+{
+  // Everything that was setup by task_setup() must be as the last run left it.
+  assert(task->blocked == NULL);
+  assert(pqueue_empty(&task->blocking));
+  assert(pqueue_empty(&task->ceilings));
+  assert(task->waiting == NULL);
+  assert(list_empty(&task->exited));
+
+  // The ids are never reused so that orphans can tell that their parent is gone.
+  static uint32_t task_id_counter = 0;
   task->id = task_id_counter++;
   task->state = STATE_READY;
   task->provisioned_priority = priority;
   task->priority = priority;
-  task->stack_pointer = (uint32_t)stack + stack_size;
+  task->partition = running_task != NULL ? running_task->partition : PARTITION_BACKGROUND;
+  task->threshold = 0;
+  task->relative_deadline = 0;
+  task->provisioned_deadline = TASK_NO_DEADLINE;
+  task->deadline = TASK_NO_DEADLINE;
+  task->stack_pointer = (uint32_t)task->stack + stack_size;
   task->stack_pointer -= sizeof(struct context);
-  task->stack = stack;
   *(uint32_t*)task->stack = TASK_STACK_MAGIC;
-  task->blocked = NULL;
-  pqueue_init(&task->blocking, pqueue_blocking_compare);
-  list_init(&task->blocking_node);
-  list_init(&task->sleep_node);
   task->sleep = 0;
+  task->slack = 0;
+  task->timeout = NULL;
+  task->timed_out = false;
+  task->rcu_nesting = 0;
+  task->rcu_blocked = false;
+  task->rcu_grace_period = 0;
+  task->detached = false;
+  task->group = NULL;
+  task->period = NULL;
+  task->budget = NULL;
 
   tree_init(&task->family);
+  task->parent_id = task->id;
   if (running_task != NULL)
   {
     tree_add_child(&running_task->family, &task->family);
+    task->parent_id = running_task->id;
   }
 
-  task->waiting = NULL;
-  list_init(&task->wait_node);
-
   struct context * context = (struct context*)task->stack_pointer;
   memset(context, 0, sizeof(*context)); // Most registers will start off as zero.
   context->R0 = (uint32_t)arg;
@@ -57,26 +183,87 @@ void task_init(struct task * task, task_entry_t entry, void * arg, void * stack,
 
   // Add the task to the queue of ready tasks.
   task_wait_on(task, &ready_tasks);
+}
 
-  if (kernel_running)
+void task_reschedule(void)
+{
+  struct task * next = partition_peek(&ready_tasks);
+  if (next != NULL && task_preempts(next, running_task))
   {
-    if (priority > task_get_priority(NULL))
-    {
-      // The new task has a higher priority than us. Yield to it.
-      task_yield();
-    }
-    else
+    // A new task has a higher priority or an earlier deadline than us. We're
+    // preempted rather than yielding so that we keep our preemption threshold.
+    SVC_RESCHEDULE();
+  }
+  else
+  {
+    kernel_scheduler_enable();
+  }
+}
+
+void task_detach(struct task * task)
+{
+  kernel_scheduler_disable();
+  if (task == NULL)
+  {
+    task = running_task;
+  }
+  assert(!task->detached);
+  // The parent would never be woken up by a detached task.
+  assert(!task_awaited(task));
+  task->detached = true;
+
+  if (task->state == STATE_ZOMBIE)
+  {
+    // The task already returned. No one will ever reap it.
+    task_destroy(task);
+  }
+  kernel_scheduler_enable();
+}
+
+bool task_awaited(struct task * task)
+{
+  struct task * parent = task_parent(task);
+  if (parent->state != STATE_WAIT || parent == &init_task)
+  {
+    // The init task always waits. It only reaps the tasks that return to it.
+    return false;
+  }
+
+  if (parent->wait != NULL && *parent->wait != NULL)
+  {
+    return *parent->wait == task;
+  }
+
+  // The parent waits for any child. Look for another one that can still return to it.
+  struct list_head * node;
+  list_for_each(node, &parent->family.children)
+  {
+    struct task * child = container_of(node, struct task, family.siblings);
+    if (child != task && !child->detached && child->group == NULL)
     {
-      kernel_scheduler_enable();
+      return false;
     }
   }
+  return true;
 }
 
 void * task_wait(struct task ** task)
+{
+  void * result;
+  task_timed_wait(task, &result, 0);
+  return result;
+}
+
+bool task_timed_wait(struct task ** task, void ** result, uint32_t milliseconds)
 {
   running_task->wait = task;
+  running_task->sleep = milliseconds;
+  running_task->timed_out = false;
   SVC_TASK_WAIT();
-  return running_task->wait_result;
+  if (running_task->timed_out)
+    return false;
+  *result = running_task->wait_result;
+  return true;
 }
 
 uint8_t task_get_priority(struct task * task)
@@ -95,16 +282,200 @@ void task_yield(void)
 
 void task_sleep(unsigned int seconds)
 {
-  // TODO: Test the max value. It won't work due to overflow so fix it.
-  task_delay(seconds * 1000);
+  task_delay_until(kernel_time_now() + seconds * 1000000ull);
 }
 
 void task_delay(unsigned int ms)
 {
+  if (ms > TASK_DELAY_MAX_MS)
+  {
+    // The delay in systicks doesn't fit in 32 bits.
+    task_delay_until(kernel_time_now() + ms * 1000ull);
+    return;
+  }
   running_task->sleep = ms;
   SVC_SLEEP();
 }
 
+void task_delay_until(uint64_t time)
+{
+  // The kernel clears the time once the task has slept until it.
+  running_task->sleep_until = time;
+  do {
+    SVC_SLEEP_UNTIL();
+  } while (running_task->sleep_until != 0);
+}
+
+void task_set_slack(uint32_t microseconds)
+{
+  // Only the scheduler reads the slack of a task and it doesn't run while we're writing it.
+  running_task->slack = (uint32_t)((uint64_t)microseconds * SYSTICK_HZ / 1000000);
+}
+
+void task_set_period(struct task_period * period, uint32_t length, uint32_t deadline, uint32_t offset)
+{
+  assert(length > 0);
+  assert(deadline > 0);
+  period->period = length;
+  period->deadline = deadline;
+  memset(&period->stats, 0, sizeof(period->stats));
+  period->release = kernel_time_now() + offset;
+  running_task->period = period;
+  task_period_release(period);
+}
+
+void task_wait_period(void)
+{
+  struct task_period * period = running_task->period;
+  assert(period != NULL);
+
+  // The job is complete.
+  uint32_t response = (uint32_t)(kernel_time_now() - period->release);
+  kernel_scheduler_disable();
+  period->stats.jobs++;
+  period->stats.last_response = response;
+  period->stats.max_response = MAX(period->stats.max_response, response);
+  if (response > period->deadline)
+  {
+    period->stats.overruns++;
+  }
+  kernel_scheduler_enable();
+
+  // The releases are kept on the period boundaries even if a job runs late.
+  period->release += period->period;
+  task_period_release(period);
+}
+
+bool task_get_period_stats(struct task * task, struct task_period_stats * stats)
+{
+  // The statistics are copied in one go so that they're consistent.
+  kernel_scheduler_disable();
+  bool periodic = task->period != NULL;
+  if (periodic)
+  {
+    *stats = task->period->stats;
+  }
+  kernel_scheduler_enable();
+  return periodic;
+}
+
+void task_set_deadline(uint32_t microseconds)
+{
+  kernel_scheduler_disable();
+  running_task->relative_deadline = microseconds;
+  task_set_job_deadline(microseconds != 0 ? kernel_time_now() + microseconds : TASK_NO_DEADLINE);
+  task_reschedule();
+}
+
+void task_set_job_deadline(uint64_t deadline)
+{
+  // The running task isn't queued anywhere so it doesn't need to be moved.
+  running_task->provisioned_deadline = deadline;
+  running_task->priority = task_effective_priority(running_task, &running_task->deadline);
+}
+
+void task_period_release(struct task_period * period)
+{
+  // The next job of an EDF task is due relative to its release.
+  if (running_task->relative_deadline != 0)
+  {
+    kernel_scheduler_disable();
+    task_set_job_deadline(period->release + running_task->relative_deadline);
+    task_reschedule();
+  }
+
+  task_delay_until(period->release);
+  uint32_t jitter = (uint32_t)(kernel_time_now() - period->release);
+  kernel_scheduler_disable();
+  period->stats.max_jitter = MAX(period->stats.max_jitter, jitter);
+  kernel_scheduler_enable();
+}
+
+void task_set_threshold(struct task * task, uint8_t threshold)
+{
+  kernel_scheduler_disable();
+  if (task == NULL)
+  {
+    task = running_task;
+  }
+  assert(threshold == 0 || threshold >= task->provisioned_priority);
+  uint8_t previous = task->threshold;
+  task->threshold = threshold;
+
+  if (task == running_task && threshold < previous)
+  {
+    // Lowering our own threshold may let a task preempt us. The SysTick may not have
+    // fired for the tasks under our old threshold so the scheduler needs to catch up
+    // on the ones that woke up in the meantime.
+    SVC_RESCHEDULE();
+  }
+  else
+  {
+    kernel_scheduler_enable();
+  }
+}
+
+void task_set_budget(struct task_budget * budget, uint32_t microseconds, uint32_t period, uint8_t background)
+{
+  assert(budget != NULL);
+  assert(microseconds > 0);
+  assert(microseconds <= period);
+  kernel_scheduler_disable();
+  assert(running_task->budget == NULL);
+  assert(background < running_task->provisioned_priority);
+  budget->budget = (uint32_t)((uint64_t)microseconds * SYSTICK_HZ / 1000000);
+  budget->period = (uint32_t)((uint64_t)period * SYSTICK_HZ / 1000000);
+  budget->remaining = budget->budget;
+  budget->consumed = 0;
+  budget->active = false;
+  budget->priority = running_task->provisioned_priority;
+  budget->background = background;
+  budget->count = 0;
+  budget->task = running_task;
+  running_task->budget = budget;
+  list_push_back(&budgeted_tasks, &budget->node);
+  kernel_scheduler_enable();
+
+  // The budget starts being used the next time we're scheduled.
+  task_yield();
+}
+
+void task_change_priority(struct task * task, uint8_t priority)
+{
+  task->provisioned_priority = priority;
+
+  // Walk through the chain of tasks that we're blocked on
+  // and update their priority until one doesn't change.
+  while (task) {
+    uint64_t deadline;
+    uint8_t effective = task_effective_priority(task, &deadline);
+    if (effective == task->priority && deadline == task->deadline)
+      break;
+
+    bool increase = effective > task->priority || (effective == task->priority && deadline < task->deadline);
+    task->priority = effective;
+    task->deadline = deadline;
+    if (increase) {
+      if (task->waiting)
+        pqueue_increase(task->waiting, &task->wait_node);
+      if (task->blocked)
+        pqueue_increase(&task->blocked->blocking, &task->blocking_node);
+      if (!list_empty(&task->preempted_node))
+        pqueue_increase(&preempted_tasks, &task->preempted_node);
+    }
+    else {
+      if (task->waiting)
+        pqueue_decrease(task->waiting, &task->wait_node);
+      if (task->blocked)
+        pqueue_decrease(&task->blocked->blocking, &task->blocking_node);
+      if (!list_empty(&task->preempted_node))
+        pqueue_decrease(&preempted_tasks, &task->preempted_node);
+    }
+    wait_multiple_requeue(task, increase);
+    task = task->blocked;
+  }
+}
+
 void task_add_blocked(struct task * task, struct task * blocked)
 {
   assert(task != NULL);
@@ -117,14 +488,16 @@ void task_add_blocked(struct task * task, struct task * blocked)
   pqueue_push(&task->blocking, &blocked->blocking_node);
 
   // Walk through the chain of tasks that we're blocked on
-  // and increase their priority if needed.
-  while (task && blocked->priority > task->priority)
+  // and increase their priority or deadline if needed.
+  while (task && task_precedes(blocked, task))
   {
     task->priority = blocked->priority;
+    task->deadline = blocked->deadline;
     if (task->waiting)
       pqueue_increase(task->waiting, &task->wait_node);
     if (task->blocked)
       pqueue_increase(&task->blocked->blocking, &task->blocking_node);
+    wait_multiple_requeue(task, true);
     task = task->blocked;
   }
 }
@@ -144,24 +517,20 @@ void task_remove_blocked(struct task * task, struct task * unblocked)
   list_remove(&unblocked->blocking_node);
 
   // Walk through the chain of tasks that we're blocked on
-  // and decrease their priority if needed.
+  // and decrease their priority or deadline if needed.
   while (task) {
-    // Our next priority is the maximum of our provisioned priority and
-    // the priority of the tasks that are blocked on us.
-    uint8_t priority = task->provisioned_priority;
-    if (!pqueue_empty(&task->blocking)) {
-      struct task * high = task_from_blocking_node(pqueue_peek(&task->blocking));
-      if (high->priority > priority)
-        priority = high->priority;
-    }
+    uint64_t deadline;
+    uint8_t priority = task_effective_priority(task, &deadline);
 
     assert(priority <= task->priority);
-    if (priority < task->priority) {
+    if (priority < task->priority || deadline > task->deadline) {
       task->priority = priority;
+      task->deadline = deadline;
       if (task->blocked)
         pqueue_decrease(&task->blocked->blocking, &task->blocking_node);
       if (task->waiting)
         pqueue_decrease(task->waiting, &task->wait_node);
+      wait_multiple_requeue(task, false);
       task = task->blocked;
     }
     else {
@@ -173,6 +542,25 @@ void task_remove_blocked(struct task * task, struct task * unblocked)
   }
 }
 
+uint8_t task_effective_priority(struct task * task, uint64_t * deadline)
+{
+  uint8_t priority = task->provisioned_priority;
+  *deadline = task->provisioned_deadline;
+  if (!pqueue_empty(&task->blocking)) {
+    struct task * high = task_from_blocking_node(pqueue_peek(&task->blocking));
+    if (high->priority > priority || (high->priority == priority && high->deadline < *deadline)) {
+      priority = high->priority;
+      *deadline = high->deadline;
+    }
+  }
+  if (!pqueue_empty(&task->ceilings)) {
+    struct mutex * high = container_of(pqueue_peek(&task->ceilings), struct mutex, ceiling_node);
+    if (high->ceiling > priority)
+      priority = high->ceiling;
+  }
+  return priority;
+}
+
 void task_wait_on(struct task * task, struct pqueue * pqueue)
 {
   assert(task);
@@ -199,9 +587,50 @@ void task_destroy(struct task * task)
   // or they'll be permanantly blocked.
   assert(pqueue_empty(&task->blocking));
 
-  // Remove the task from the family tree.
-  tree_remove(&task->family);
+  // A zombie is no longer waiting to be reaped.
+  list_remove(&task->exited_node);
   task->state = STATE_DEAD;
+
+  // The kernel stops replenishing our budget.
+  if (task->budget != NULL)
+  {
+    list_remove(&task->budget->node);
+    task->budget = NULL;
+  }
+
+  // The init task adopts our children, including the ones that returned.
+  // The children find out about their new parent in task_parent().
+  tree_remove_adopt(&task->family, &init_task.family);
+  list_append(&init_task.exited, &task->exited);
+  if (init_task.state == STATE_WAIT && !list_empty(&init_task.exited))
+  {
+    // The init task is waiting for any child. Give it one that returned.
+    struct task * zombie = task_from_exited_node(list_front(&init_task.exited));
+    init_task.wait_result = zombie->wait_result;
+    init_task.state = STATE_READY;
+    task_wait_on(&init_task, &ready_tasks);
+    task_destroy(zombie);
+  }
+
+  if (task->slab != NULL)
+  {
+    // Give the task back to its slab so that it can be spawned again.
+    list_push_back(&task->slab->cache, &task->wait_node);
+  }
+}
+
+struct task * task_parent(struct task * task)
+{
+  struct task * parent = container_of(task->family.parent, struct task, family);
+  if (parent->id != task->parent_id || parent->state == STATE_DEAD)
+  {
+    // Our parent was destroyed. Its task may even have been reused.
+    // We were moved to the init task's children when that happened.
+    task->family.parent = &init_task.family;
+    task->parent_id = init_task.id;
+    parent = &init_task;
+  }
+  return parent;
 }
 
 void task_return(void * result)
@@ -218,16 +647,36 @@ bool task_check(struct task * task)
   return *(uint32_t*)task->stack == TASK_STACK_MAGIC;
 }
 
+bool task_precedes(struct task * a, struct task * b)
+{
+  return a->priority > b->priority || (a->priority == b->priority && a->deadline < b->deadline);
+}
+
+bool task_preempts(struct task * task, struct task * running)
+{
+  if (running->threshold > running->priority && task->priority <= running->threshold &&
+      partition_active(task) == partition_active(running))
+    return false;
+  return partition_precedes(task, running);
+}
+
 bool pqueue_wait_compare(struct list_head * a, struct list_head * b)
 {
   struct task * ta = container_of(a, struct task, wait_node);
   struct task * tb = container_of(b, struct task, wait_node);
-  return ta->priority > tb->priority;
+  return task_precedes(ta, tb);
 }
 
 bool pqueue_blocking_compare(struct list_head * a, struct list_head * b)
 {
   struct task * ta = container_of(a, struct task, blocking_node);
   struct task * tb = container_of(b, struct task, blocking_node);
-  return ta->priority > tb->priority;
+  return task_precedes(ta, tb);
+}
+
+bool pqueue_preempted_compare(struct list_head * a, struct list_head * b)
+{
+  struct task * ta = container_of(a, struct task, preempted_node);
+  struct task * tb = container_of(b, struct task, preempted_node);
+  return task_precedes(ta, tb);
 }
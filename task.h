@@ -24,6 +24,9 @@
 #define MIN_PRIORITY (0)
 #define MAX_PRIORITY (255)
 
+// The deadline of a task that's scheduled by priority only.
+#define TASK_NO_DEADLINE (UINT64_MAX)
+
 enum task_state
 {
   STATE_RUNNING,
@@ -35,6 +38,13 @@ enum task_state
   STATE_CHANNEL_RPLY,
   STATE_ZOMBIE,
   STATE_WAIT,
+  STATE_WAIT_MULTIPLE,
+  STATE_BARRIER,
+  STATE_RCU,
+  STATE_FUTEX,
+  STATE_MEMPOOL,
+  STATE_GROUP_JOIN,
+  STATE_WORKQUEUE,
   STATE_DEAD
 };
 
@@ -70,11 +80,46 @@ struct task
   void * stack;
   enum task_state state;
 
+  // The slab that the task and its stack came from or NULL for task_init().
+  struct task_slab * slab;
+
+  // A detached task is destroyed as soon as it returns. No one can wait for it.
+  bool detached;
+
+  // The group that the task belongs to. The group collects its result instead of its parent.
+  struct task_group * group;
+
+  // The period of a periodic task or NULL. See task_set_period().
+  struct task_period * period;
+
+  // The CPU budget of a task or NULL. See task_set_budget().
+  struct task_budget * budget;
+
   // The provisioned and real priorities. The real priority is updated
   // via priority inheritence when other tasks block/unblock on this task.
   uint8_t provisioned_priority;
   uint8_t priority;
 
+  // Only tasks with a higher priority than the preemption threshold can preempt
+  // the task while it runs. It has no effect unless it's higher than the priority.
+  uint8_t threshold;
+
+  // Queued on the preempted tasks while the task is switched out part way through a job
+  // because a task above its preemption threshold preempted it. It keeps its threshold
+  // until it runs again.
+  struct list_head preempted_node;
+
+  // The partition that the task runs in. It's cached from the parent
+  // when the task is created so that orphans stay in their partition.
+  uint8_t partition;
+
+  // Tasks of equal priority run earliest deadline first. The relative deadline is 0 for tasks
+  // that are scheduled by priority only. The provisioned and real deadlines are the times in
+  // microseconds that the current job is due. The real deadline is inherited with the priority.
+  uint32_t relative_deadline;
+  uint64_t provisioned_deadline;
+  uint64_t deadline;
+
   // The task that we're blocked on.
   struct task * blocked;
 
@@ -82,8 +127,17 @@ struct task
   struct pqueue blocking;
   struct list_head blocking_node;
 
+  // The priority queue of priority ceiling mutexes that we own.
+  struct pqueue ceilings;
+
   // The tree that represents the parent/child relationship between tasks.
+  // The id of the parent tells if the parent is still the task at family.parent.
   struct tree_head family;
+  uint32_t parent_id;
+
+  // The children that returned and are waiting to be reaped, oldest first.
+  struct list_head exited;
+  struct list_head exited_node;
 
   // The priority queue that we're waiting on.
   struct pqueue * waiting;
@@ -96,6 +150,21 @@ struct task
   // The time in systicks that we need to sleep for before becoming ready.
   unsigned int sleep;
 
+  // Called when a wait times out to take us off whatever we're waiting on.
+  // It's NULL when we're only sleeping. The flag tells if the last wait timed out.
+  void (*timeout)(struct task * task);
+  bool timed_out;
+
+  // The time in systicks that a wakeup can be late by so that it shares
+  // a SysTick interrupt with the wakeup of another task.
+  unsigned int slack;
+
+  // The read-copy-update state. See rcu.h.
+  volatile uint8_t rcu_nesting;  // The depth of nested read-side critical sections.
+  volatile bool rcu_blocked;     // True when switched out in a read-side critical section.
+  uint32_t rcu_grace_period;     // The most recent grace period when we were switched out.
+  struct list_head rcu_node;     // Node in the list of blocked readers.
+
   // The context that needs to be saved when in a blocked state.
   // A task can only be in one state at a time so a union is used to save space.
   union
@@ -104,6 +173,7 @@ struct task
     {
       struct mutex * mutex; // The mutex we're waiting on.
       bool mutex_locked;    // False when timed lock fails.
+      bool mutex_woken;     // True when woken to try locking a lock steal mutex again.
     };
 
     struct channel_context
@@ -126,30 +196,162 @@ struct task
       struct task ** wait;
       void * wait_result;
     };
+
+    // The objects we're waiting on and the index of the one that became ready.
+    struct wait_multiple_context
+    {
+      struct wait_object * wait_objects;
+      uint32_t wait_count;
+      int32_t wait_index; // -1 on timeout.
+    };
+
+    // The barrier we're waiting on.
+    struct barrier * barrier;
+
+    // The grace period we're waiting for in synchronize_rcu().
+    uint32_t rcu_target;
+
+    // The address we're waiting on or waking up.
+    struct futex_context
+    {
+      volatile uint32_t * futex_address;
+      uint32_t futex_value; // The expected value or the number of tasks to wake.
+      bool futex_woken;     // False when the wait timed out.
+    };
+
+    struct mempool_context
+    {
+      struct mempool * mempool;
+      void * mempool_block; // The allocated block or NULL when the allocation timed out.
+    };
+
+    // The group that we're waiting on in group_join_all().
+    struct task_group * group_joining;
+
+    // The work queue that a worker is waiting on or that a job was submitted to.
+    struct workqueue * workqueue;
+
+    // The time that task_delay_until() sleeps until or 0 once it's reached.
+    uint64_t sleep_until;
   };
 };
 
+// Tasks spawned with the same stack size come from a slab. Each slot holds a stack
+// followed by the task. Slots that were never used are handed out in order.
+// Once they're all used, tasks come from the cache of tasks that were destroyed.
+// A cached task only needs the state that changes between runs to be reset.
+struct task_slab
+{
+  uint8_t * buffer;
+  uint32_t stack_size;
+  uint32_t count;
+  uint32_t used;       // The number of slots that were ever used.
+  struct list_head cache;
+};
+
+// The statistics of a periodic task. The times are in microseconds.
+struct task_period_stats
+{
+  uint32_t jobs;          // The number of jobs that completed.
+  uint32_t overruns;      // The number of jobs that completed after their deadline.
+  uint32_t last_response; // The time from the release of the last job to its completion.
+  uint32_t max_response;  // The longest time from the release of a job to its completion.
+  uint32_t max_jitter;    // The longest time from the release of a job to it starting to run.
+};
+
+// A periodic task releases a job at the start of every period.
+// Each job should complete within the deadline of its release.
+struct task_period
+{
+  uint64_t release; // The time that the current job was released at.
+  uint32_t period;
+  uint32_t deadline;
+  struct task_period_stats stats;
+};
+
+// The number of replenishments that a task with a budget can have pending.
+#define TASK_BUDGET_REPLENISHMENTS (4)
+
+// A sporadic server limits the CPU time that a task gets at its priority. The time that
+// it uses is given back a period after the task started using it. The task runs at its
+// background priority while its budget is used up. The times are in systicks.
+struct task_budget
+{
+  uint32_t budget;
+  uint32_t period;
+  uint32_t remaining;   // The budget that's left.
+  uint32_t consumed;    // The budget used since the task became active.
+  uint64_t activation;  // When the task became active.
+  bool active;          // True while the task is using its budget.
+  uint8_t priority;     // The priority while there's budget left.
+  uint8_t background;   // The priority while the budget is used up.
+  uint8_t count;        // The number of pending replenishments.
+  struct
+  {
+    uint64_t time;
+    uint32_t amount;
+  } replenishments[TASK_BUDGET_REPLENISHMENTS];
+  struct task * task;
+  struct list_head node; // Node in the list of tasks with a budget.
+};
+
+// The size of a slot in a slab. The task is kept 8 byte aligned like the stacks.
+#define TASK_SLAB_SLOT_SIZE(stack_size) ((stack_size) + ((sizeof(struct task) + 7) & ~7))
+
+// Sets up the parts of a task that are left as they were when the task is destroyed.
+// A task recycled by a slab doesn't need these again.
+void task_setup(struct task * task, void * stack, uint32_t stack_size);
+
+// Resets the rest of the task and makes it ready. The scheduler must be disabled.
+void task_start(struct task * task, void * (__task * entry)(void *), void * arg, uint32_t stack_size, uint8_t priority);
+
+// Yields if a new task has a higher priority than us. Otherwise reenables the scheduler.
+void task_reschedule(void);
+
 // A task has (un)blocked on this task. This will add/remove the task to the list
 // of blocked tasks and will return true if the tasks priority has changed.
 // TODO Add a version that takes a list/pqueue. These shouldn't be called in a loop (MUTEX).
 void task_add_blocked(struct task * task, struct task * blocked);
 void task_remove_blocked(struct task * task, struct task * unblocked);
 
+// Returns the priority a task should have. This is the maximum of its provisioned priority,
+// the priority of the tasks blocked on it and the ceiling of the mutexes it owns.
+// The deadline it should have goes with the priority.
+uint8_t task_effective_priority(struct task * task, uint64_t * deadline);
+
+// Changes the provisioned priority of a task. The priority of the tasks
+// that it's blocked on is updated like with task_add/remove_blocked().
+void task_change_priority(struct task * task, uint8_t priority);
+
+// Returns true if <a> should run before <b>. This is the case if it has a higher priority
+// or the same priority and an earlier deadline.
+bool task_precedes(struct task * a, struct task * b);
+
+// Returns true if a ready task should preempt the running task.
+// This takes the preemption threshold of the running task into account.
+bool task_preempts(struct task * task, struct task * running);
+
 // Start and stop waiting on a priority queue.
 void task_wait_on(struct task * task, struct pqueue * pqueue);
 void task_stop_waiting(struct task * task);
 
 // Destroy a task. Release all allocated resources.
+// The init task adopts the children of the destroyed task.
 void task_destroy(struct task * task);
 
+// Returns the parent of a task. Orphans were adopted by the init task.
+struct task * task_parent(struct task * task);
+
 // Perform a sanity check on the task.
 bool task_check(struct task * task);
 
 // Compares the priority of 2 tasks given their wait_nodes.
 bool pqueue_wait_compare(struct list_head * a, struct list_head * b);
 bool pqueue_blocking_compare(struct list_head * a, struct list_head * b);
+bool pqueue_preempted_compare(struct list_head * a, struct list_head * b);
 
 #define task_from_wait_node(node) container_of((node), struct task, wait_node)
 #define task_from_blocking_node(node) container_of((node), struct task, blocking_node)
+#define task_from_exited_node(node) container_of((node), struct task, exited_node)
 
 #endif
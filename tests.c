@@ -78,6 +78,24 @@ static __task void * task_test_recursive_mutex_priority_high(void * arg);
 static __task void * task_test_recursive_mutex_priority_low(void * arg);
 static void test_recursive_mutex_priority(void);
 
+// Tests for priority ceiling mutexes.
+static __task void * task_test_mutex_prio_ceiling_low(void * arg);
+static __task void * task_test_mutex_prio_ceiling_med(void * arg);
+static void test_mutex_prio_ceiling(void);
+
+static __task void * task_test_mutex_prio_ceiling_performance(void * arg);
+static __task void * task_test_mutex_prio_ceiling_performance_periodic(void * arg);
+static uint32_t test_mutex_prio_ceiling_performance_run(uint32_t attributes, uint32_t * contended);
+static void test_mutex_prio_ceiling_performance(void);
+
+// Tests for lock steal mutexes.
+static __task void * task_test_mutex_lock_steal1(void * arg);
+static __task void * task_test_mutex_lock_steal2(void * arg);
+static void test_mutex_lock_steal(void);
+
+static __task void * task_test_mutex_lock_steal_performance(void * arg);
+static void test_mutex_lock_steal_performance(void);
+
 // Tests for time slices
 static __task void * task_test_sched_time_slice_length(void * arg);
 static void test_sched_time_slice_length(void);
@@ -101,10 +119,183 @@ static __task void * task_test_sched_context_switch_performance(void * arg);
 static void test_sched_context_switch_performance1(void);
 static void test_sched_context_switch_performance2(void);
 
+// Tests for waiting on multiple objects
+static __task void * task_test_wait_multiple_channel_server(void * arg);
+static __task void * task_test_wait_multiple_channel_client(void * arg);
+static void test_wait_multiple_channel(void);
+
+static __task void * task_test_wait_multiple_mutex_owner(void * arg);
+static __task void * task_test_wait_multiple_mutex_waiter(void * arg);
+static void test_wait_multiple_mutex(void);
+
+static __task void * task_test_wait_multiple_requeue(void * arg);
+static void test_wait_multiple_requeue(void);
+
+// Tests for barriers
+static __task void * task_test_barrier(void * arg);
+static void test_barrier(void);
+
+static __task void * task_test_barrier_performance(void * arg);
+static uint32_t test_barrier_performance(uint32_t participants);
+static void test_barrier_performance_all(void);
+
+// Tests for mailboxes
+static __task void * task_test_mailbox_writer(void * arg);
+static __task void * task_test_mailbox_reader(void * arg);
+static void test_mailbox(void);
+
+// Tests for read-copy-update
+static __task void * task_test_rcu_reader(void * arg);
+static __task void * task_test_rcu_writer(void * arg);
+static void test_rcu(void);
+
+// Tests for waiting on addresses
+static __task void * task_test_futex_timeout(void * arg);
+static void test_futex_timeout(void);
+
+static __task void * task_test_futex_mutex_lock(void * arg);
+static void test_futex_mutex_lock(void);
+
+static __task void * task_test_futex_mutex_performance(void * arg);
+static __task void * task_test_mutex_performance(void * arg);
+static void test_futex_mutex_performance(void);
+
+// Tests for memory pools
+static __task void * task_test_mempool(void * arg);
+static void test_mempool(void);
+
+// Tests for heaps
+static void test_heap(void);
+
+// Tests for spawning tasks from slabs
+static __task void * task_test_spawn(void * arg);
+static void test_spawn(void);
+
+static __task void * task_test_init_performance(void * arg);
+static __task void * task_test_spawn_performance(void * arg);
+static void test_spawn_performance(void);
+
+// Tests for detached tasks
+static __task void * task_test_detach(void * arg);
+static void test_detach(void);
+
+// Tests for reaping tasks
+static __task void * task_test_wait_any_order(void * arg);
+static void test_wait_any_order(void);
+
+static __task void * task_test_orphan_parent(void * arg);
+static __task void * task_test_orphan_child(void * arg);
+static void test_orphan(void);
+
+// Tests for task groups
+static __task void * task_test_group(void * arg);
+static void test_group(void);
+
+static __task void * task_test_group_individual_performance(void * arg);
+static __task void * task_test_group_join_performance(void * arg);
+static void test_group_performance(void);
+
+// Tests for work queues
+static void work_test_count(void * arg);
+static void test_workqueue(void);
+
+static __task void * task_test_job(void * arg);
+static __task void * task_test_job_task_performance(void * arg);
+static __task void * task_test_job_workqueue_performance(void * arg);
+static void test_workqueue_performance(void);
+
+// Tests for fibers
+static uint8_t fiber_test_delay(struct fiber * fiber);
+static uint8_t fiber_test_wait(struct fiber * fiber);
+static uint8_t fiber_test_channel(struct fiber * fiber);
+static __task void * task_test_fiber_host(void * arg);
+static void test_fiber(void);
+
+static uint8_t fiber_test_ping(struct fiber * fiber);
+static uint8_t fiber_test_pong(struct fiber * fiber);
+static void test_fiber_polling(void);
+
+static uint8_t fiber_test_switch_performance(struct fiber * fiber);
+static __task void * task_test_switch_performance(void * arg);
+static void test_fiber_performance(void);
+
+// Tests for active objects
+static void active_test_low(struct active_object * object, uint32_t event);
+static void active_test_high(struct active_object * object, uint32_t event);
+static __task void * task_test_active_host(void * arg);
+static void test_active(void);
+
+static void active_test_ping(struct active_object * object, uint32_t event);
+static void active_test_pong(struct active_object * object, uint32_t event);
+static __task void * task_test_channel_ping(void * arg);
+static __task void * task_test_channel_pong(void * arg);
+static void test_active_performance(void);
+
+// Tests for the kernel clock
+static void test_delay_until(void);
+static void test_delay_until_jitter(void);
+
+// Tests for periodic tasks
+static __task void * task_test_periodic(void * arg);
+static void test_periodic(void);
+
+// Tests for software timers
+static void timer_test_count(struct timer * timer);
+static void test_timer(void);
+static void test_timer_performance(void);
+
+// Tests for timer slack
+static __task void * task_test_slack(void * arg);
+static void test_slack(void);
+static void test_slack_coalescing(void);
+
+// Tests for timeouts
+static __task void * task_test_timeout_server(void * arg);
+static __task void * task_test_timeout_child(void * arg);
+static void test_timeout_channel(void);
+static void test_timeout_task_wait(void);
+
+// Tests for earliest deadline first scheduling
+static __task void * task_test_edf_order(void * arg);
+static __task void * task_test_edf_lock(void * arg);
+static __task void * task_test_edf_spin(void * arg);
+static __task void * task_test_edf_periodic(void * arg);
+static void test_edf_burn(uint32_t loops);
+static uint32_t test_edf_overruns(uint32_t * periods, uint32_t * work, bool edf);
+static uint32_t test_edf_max_utilization(uint32_t * periods, uint32_t * weights, bool edf);
+static void test_edf(void);
+static void test_edf_inheritance(void);
+static void test_edf_utilization(void);
+
+// Tests for CPU budgets
+static __task void * task_test_budget(void * arg);
+static __task void * task_test_budget_control(void * arg);
+static void test_budget(void);
+
+// Tests for time partitioning
+static __task void * task_test_partition(void * arg);
+static void test_partition(void);
+static void test_partition_threshold(void);
+
+// Tests for preemption thresholds
+static __task void * task_test_threshold(void * arg);
+static __task void * task_test_threshold_periodic(void * arg);
+static uint32_t test_threshold_switches(bool threshold, uint32_t * max_active);
+static void test_threshold(void);
+static void test_threshold_switches_and_stack(void);
+
 // Helper asserts
 static void assert_full_time_slice(void);
 static void assert_max_time_slice(void);
 
+// The number of periods that the jitter of a periodic task is measured over.
+#define JITTER_PERIODS (1000)
+
+// The number of random task sets and the time in milliseconds that each
+// set runs for when measuring the schedulable utilization.
+#define EDF_TASK_SETS (3)
+#define EDF_RUN_MS (100)
+
 // 128 bytes of stack should be enough for these dummy tasks.
 #define NUM_TASKS (8)
 #define STACK_SIZE (128)
@@ -129,6 +320,10 @@ void test_run_all(void)
   test_recursive_mutex_lock();
   test_recursive_mutex_trylock();
   test_recursive_mutex_priority();
+  test_mutex_prio_ceiling();
+  test_mutex_prio_ceiling_performance();
+  test_mutex_lock_steal();
+  test_mutex_lock_steal_performance();
   test_sched_time_slice_length();
   test_sched_time_slice_yield1();
   test_sched_time_slice_yield2();
@@ -137,6 +332,49 @@ void test_run_all(void)
   test_sched_time_slice_mutex();
   test_sched_context_switch_performance1();
   test_sched_context_switch_performance2();
+  test_wait_multiple_channel();
+  test_wait_multiple_mutex();
+  test_wait_multiple_requeue();
+  test_barrier();
+  test_barrier_performance_all();
+  test_mailbox();
+  test_rcu();
+  test_futex_timeout();
+  test_futex_mutex_lock();
+  test_futex_mutex_performance();
+  test_mempool();
+  test_heap();
+  test_spawn();
+  test_spawn_performance();
+  test_detach();
+  test_wait_any_order();
+  test_orphan();
+  test_group();
+  test_group_performance();
+  test_workqueue();
+  test_workqueue_performance();
+  test_fiber();
+  test_fiber_polling();
+  test_fiber_performance();
+  test_active();
+  test_active_performance();
+  test_delay_until();
+  test_delay_until_jitter();
+  test_periodic();
+  test_timer();
+  test_timer_performance();
+  test_slack();
+  test_slack_coalescing();
+  test_timeout_channel();
+  test_timeout_task_wait();
+  test_edf();
+  test_edf_inheritance();
+  test_edf_utilization();
+  test_budget();
+  test_partition();
+  test_partition_threshold();
+  test_threshold();
+  test_threshold_switches_and_stack();
 }
 
 void test_context_switching(void)
@@ -766,6 +1004,264 @@ static __task void * task_test_sched_time_slice_length(void * arg)
   return NULL;
 }
 
+struct test_mutex_prio_ceiling_data
+{
+  struct task * med;
+  struct task * low;
+  struct mutex outer;
+  struct mutex inner;
+};
+
+static __task void * task_test_mutex_prio_ceiling_low(void * arg)
+{
+  struct test_mutex_prio_ceiling_data * data = (struct test_mutex_prio_ceiling_data *)arg;
+
+  ut_assert(task_get_priority(NULL) == 3);
+
+  // We run at the ceiling as soon as we own the mutex.
+  mutex_lock(&data->outer);
+  ut_assert(task_get_priority(NULL) == 6);
+  mutex_lock(&data->inner);
+  ut_assert(task_get_priority(NULL) == 7);
+  mutex_unlock(&data->inner);
+  ut_assert(task_get_priority(NULL) == 6);
+
+  // The medium priority task can't preempt us while we're at the ceiling.
+  task_init(data->med, task_test_mutex_prio_ceiling_med, data, stacks[1], STACK_SIZE, 5);
+  ut_assert(data->med->state == STATE_READY);
+
+  // Let it block on the mutex. We don't need to inherit its priority.
+  task_delay(5);
+  ut_assert(data->med->state == STATE_MUTEX);
+  ut_assert(task_get_priority(NULL) == 6);
+
+  // The medium priority task gets the mutex and runs at the ceiling.
+  mutex_unlock(&data->outer);
+  ut_assert(data->med->state == STATE_ZOMBIE);
+  ut_assert(task_get_priority(NULL) == 3);
+
+  // The init task would adopt it if we returned first.
+  task_wait(&data->med);
+  return NULL;
+}
+
+static __task void * task_test_mutex_prio_ceiling_med(void * arg)
+{
+  struct test_mutex_prio_ceiling_data * data = (struct test_mutex_prio_ceiling_data *)arg;
+
+  ut_assert(data->low->state == STATE_SLEEP);
+  mutex_lock(&data->outer);
+  ut_assert(task_get_priority(NULL) == 6);
+  ut_assert(data->low->priority == 3);
+  mutex_unlock(&data->outer);
+  ut_assert(task_get_priority(NULL) == 5);
+  return NULL;
+}
+
+static void test_mutex_prio_ceiling(void)
+{
+  struct test_mutex_prio_ceiling_data data = {
+    .med = &tasks[1],
+    .low = &tasks[0]
+  };
+  mutex_init(&data.outer, MUTEX_ATTR_PRIO_CEILING(6));
+  mutex_init(&data.inner, MUTEX_ATTR_PRIO_CEILING(7));
+  task_init(&tasks[0], task_test_mutex_prio_ceiling_low, &data, stacks[0], STACK_SIZE, 3);
+  task_wait(NULL);
+  ut_assert(!data.outer.locked);
+  ut_assert(!data.inner.locked);
+}
+
+struct test_mutex_prio_ceiling_performance_data
+{
+  struct mutex mutex;
+  volatile uint32_t contended; // How many times a task found the mutex locked.
+  volatile bool stop;
+};
+
+static __task void * task_test_mutex_prio_ceiling_performance(void * arg)
+{
+  // Hold the mutex for most of the time so that the other tasks wake up while it's locked.
+  struct test_mutex_prio_ceiling_performance_data * data =
+    (struct test_mutex_prio_ceiling_performance_data *)arg;
+  uint32_t count = 0;
+  while (!data->stop) {
+    mutex_lock(&data->mutex);
+    for (volatile uint32_t i = 0; i < 100; ++i);
+    ++count;
+    mutex_unlock(&data->mutex);
+  }
+  return (void*)count;
+}
+
+static __task void * task_test_mutex_prio_ceiling_performance_periodic(void * arg)
+{
+  // Wake up every millisecond and take the mutex once.
+  struct test_mutex_prio_ceiling_performance_data * data =
+    (struct test_mutex_prio_ceiling_performance_data *)arg;
+  uint32_t count = 0;
+  while (!data->stop) {
+    if (data->mutex.locked)
+    {
+      data->contended++;
+    }
+    mutex_lock(&data->mutex);
+    ++count;
+    mutex_unlock(&data->mutex);
+    task_delay(1);
+  }
+  return (void*)count;
+}
+
+static uint32_t test_mutex_prio_ceiling_performance_run(uint32_t attributes, uint32_t * contended)
+{
+  // A low priority task holds the mutex most of the time and 3 higher priority tasks
+  // wake up every millisecond to take it. Count the lock/unlock pairs of all the tasks.
+  struct test_mutex_prio_ceiling_performance_data data;
+  uint32_t count = 0;
+  mutex_init(&data.mutex, attributes);
+  data.contended = 0;
+  data.stop = false;
+  task_init(&tasks[0], task_test_mutex_prio_ceiling_performance, &data, stacks[0], STACK_SIZE, 5);
+  for (int32_t i = 1; i < 4; ++i)
+  {
+    task_init(&tasks[i], task_test_mutex_prio_ceiling_performance_periodic, &data, stacks[i], STACK_SIZE, 5 + i);
+  }
+  task_sleep(1);
+  data.stop = true;
+  for (int32_t i = 0; i < 4; ++i)
+  {
+    count += (uint32_t)task_wait(NULL);
+  }
+  *contended = data.contended;
+  return count;
+}
+
+static void test_mutex_prio_ceiling_performance(void)
+{
+  // A performance test to compare how many lock/unlock pairs per second 4 tasks
+  // can do when they contend for a priority inheritance mutex and a priority
+  // ceiling mutex.
+  uint32_t inherit_contended;
+  uint32_t ceiling_contended;
+  uint32_t inherit_count = test_mutex_prio_ceiling_performance_run(MUTEX_ATTR_PRIO_INHERIT, &inherit_contended);
+  uint32_t ceiling_count = test_mutex_prio_ceiling_performance_run(MUTEX_ATTR_PRIO_CEILING(8), &ceiling_contended);
+
+  // The higher priority tasks preempt the owner of the priority inheritance mutex
+  // and block on it. They can't preempt the owner of the priority ceiling mutex
+  // so they only run once it's free and never block on it. That saves the context
+  // switches to them and back while the mutex is locked.
+  ut_assert(inherit_contended > 0);
+  ut_assert(ceiling_contended == 0);
+  ut_assert(ceiling_count > inherit_count);
+}
+
+struct test_mutex_lock_steal_data
+{
+  struct task * t1;
+  struct task * t2;
+  struct mutex mutex;
+};
+
+static __task void * task_test_mutex_lock_steal1(void * arg)
+{
+  struct test_mutex_lock_steal_data * data = (struct test_mutex_lock_steal_data *)arg;
+  mutex_lock(&data->mutex);
+  task_yield();
+  ut_assert(data->t2->state == STATE_MUTEX);
+  ut_assert(data->t2->blocked == data->t1);
+
+  // The waiter is woken but the mutex is still free so we can take it back.
+  mutex_unlock(&data->mutex);
+  ut_assert(data->t2->state == STATE_READY);
+  ut_assert(data->t2->blocked == NULL);
+  ut_assert(mutex_trylock(&data->mutex));
+
+  // The waiter tries again and blocks on us.
+  task_yield();
+  ut_assert(data->t2->state == STATE_MUTEX);
+  ut_assert(data->t2->blocked == data->t1);
+  mutex_unlock(&data->mutex);
+  ut_assert(data->t2->state == STATE_READY);
+  return NULL;
+}
+
+static __task void * task_test_mutex_lock_steal2(void * arg)
+{
+  struct test_mutex_lock_steal_data * data = (struct test_mutex_lock_steal_data *)arg;
+  ut_assert(data->mutex.owner == data->t1);
+  mutex_lock(&data->mutex);
+  ut_assert(data->mutex.owner == data->t2);
+  ut_assert(data->t1->state == STATE_ZOMBIE);
+  mutex_unlock(&data->mutex);
+  return NULL;
+}
+
+static void test_mutex_lock_steal(void)
+{
+  struct test_mutex_lock_steal_data data = {
+    .t1 = &tasks[0],
+    .t2 = &tasks[1]
+  };
+  mutex_init(&data.mutex, MUTEX_ATTR_LOCK_STEAL);
+  task_init(&tasks[0], task_test_mutex_lock_steal1, &data, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_mutex_lock_steal2, &data, stacks[1], STACK_SIZE, 5);
+  // Delay so that the first task is a zombie when the second one checks on it.
+  task_delay(5);
+  task_wait(NULL);
+  task_wait(NULL);
+  ut_assert(!data.mutex.locked);
+}
+
+struct test_mutex_lock_steal_performance_data
+{
+  struct mutex mutex;
+  volatile bool stop;
+};
+
+static __task void * task_test_mutex_lock_steal_performance(void * arg)
+{
+  struct test_mutex_lock_steal_performance_data * data =
+    (struct test_mutex_lock_steal_performance_data *)arg;
+  uint32_t count = 0;
+  while (!data->stop) {
+    mutex_lock(&data->mutex);
+    ++count;
+    mutex_unlock(&data->mutex);
+  }
+  return (void*)count;
+}
+
+static void test_mutex_lock_steal_performance(void)
+{
+  // A performance test to compare how many lock/unlock pairs per second 2 tasks
+  // relocking the same mutex can do. Once one of the tasks is preempted while
+  // holding a handoff mutex every unlock hands it over and forces a context switch.
+  struct test_mutex_lock_steal_performance_data data;
+  uint32_t handoff_count = 0;
+  uint32_t steal_count = 0;
+
+  mutex_init(&data.mutex, MUTEX_ATTR_HANDOFF);
+  data.stop = false;
+  task_init(&tasks[0], task_test_mutex_lock_steal_performance, &data, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_mutex_lock_steal_performance, &data, stacks[1], STACK_SIZE, 5);
+  task_sleep(1);
+  data.stop = true;
+  handoff_count += (uint32_t)task_wait(NULL);
+  handoff_count += (uint32_t)task_wait(NULL);
+
+  mutex_init(&data.mutex, MUTEX_ATTR_LOCK_STEAL);
+  data.stop = false;
+  task_init(&tasks[0], task_test_mutex_lock_steal_performance, &data, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_mutex_lock_steal_performance, &data, stacks[1], STACK_SIZE, 5);
+  task_sleep(1);
+  data.stop = true;
+  steal_count += (uint32_t)task_wait(NULL);
+  steal_count += (uint32_t)task_wait(NULL);
+
+  ut_assert(steal_count > handoff_count);
+}
+
 static void test_sched_time_slice_length(void)
 {
   uint32_t done = 0;
@@ -992,6 +1488,2378 @@ static void test_sched_context_switch_performance2(void)
 #endif
 }
 
+struct test_wait_multiple_data
+{
+  struct channel channels[2];
+  struct mutex mutex;
+};
+
+struct test_wait_multiple_client
+{
+  struct channel * channel;
+  uint32_t msg;
+  uint32_t delay;
+};
+
+static __task void * task_test_wait_multiple_channel_server(void * arg)
+{
+  struct test_wait_multiple_data * data = (struct test_wait_multiple_data *)arg;
+  struct wait_object objects[2];
+  wait_object_init(&objects[0], WAIT_OBJECT_CHANNEL, &data->channels[0]);
+  wait_object_init(&objects[1], WAIT_OBJECT_CHANNEL, &data->channels[1]);
+
+  // The client of the 2nd channel sends its message first.
+  for (int32_t expected = 1; expected >= 0; --expected)
+  {
+    int32_t index = wait_multiple(objects, 2, 0);
+    ut_assert(index == expected);
+
+    uint32_t msg;
+    size_t len = channel_recv(&data->channels[index], &msg, sizeof(msg));
+    ut_assert(len == sizeof(msg));
+    ut_assert(msg == (uint32_t)index);
+    msg++;
+    channel_reply(&data->channels[index], &msg, sizeof(msg));
+  }
+
+  // No one sends messages anymore so we should timeout.
+  ut_assert(wait_multiple(objects, 2, 10) == -1);
+  return NULL;
+}
+
+static __task void * task_test_wait_multiple_channel_client(void * arg)
+{
+  struct test_wait_multiple_client * client = (struct test_wait_multiple_client *)arg;
+  uint32_t reply;
+  size_t reply_len = sizeof(reply);
+  task_delay(client->delay);
+  channel_send(client->channel, &client->msg, sizeof(client->msg), &reply, &reply_len);
+  ut_assert(reply_len == sizeof(reply));
+  ut_assert(reply == client->msg + 1);
+  return NULL;
+}
+
+static void test_wait_multiple_channel(void)
+{
+  struct test_wait_multiple_data data;
+  channel_init(&data.channels[0]);
+  channel_init(&data.channels[1]);
+  struct test_wait_multiple_client clients[2] = {
+    { .channel = &data.channels[0], .msg = 0, .delay = 10 },
+    { .channel = &data.channels[1], .msg = 1, .delay = 5 }
+  };
+  task_init(&tasks[0], task_test_wait_multiple_channel_server, &data, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_wait_multiple_channel_client, &clients[0], stacks[1], STACK_SIZE, 5);
+  task_init(&tasks[2], task_test_wait_multiple_channel_client, &clients[1], stacks[2], STACK_SIZE, 5);
+
+  // The client of the 2nd channel should finish first.
+  struct task * finished = NULL;
+  task_wait(&finished);
+  ut_assert(finished == &tasks[2]);
+  finished = NULL;
+  task_wait(&finished);
+  ut_assert(finished == &tasks[1]);
+  finished = NULL;
+  task_wait(&finished);
+  ut_assert(finished == &tasks[0]);
+}
+
+static __task void * task_test_wait_multiple_mutex_owner(void * arg)
+{
+  struct test_wait_multiple_data * data = (struct test_wait_multiple_data *)arg;
+  mutex_lock(&data->mutex);
+  task_delay(10);
+
+  // The other task is waiting and hasn't lent us its priority.
+  ut_assert(tasks[1].state == STATE_WAIT_MULTIPLE);
+  ut_assert(tasks[0].priority == tasks[0].provisioned_priority);
+
+  // Unlocking the mutex gives it to the other task which runs right away.
+  mutex_unlock(&data->mutex);
+  ut_assert(tasks[1].state == STATE_ZOMBIE);
+  ut_assert(data->mutex.owner == NULL);
+  return NULL;
+}
+
+static __task void * task_test_wait_multiple_mutex_waiter(void * arg)
+{
+  struct test_wait_multiple_data * data = (struct test_wait_multiple_data *)arg;
+  struct wait_object objects[2];
+  wait_object_init(&objects[0], WAIT_OBJECT_CHANNEL, &data->channels[0]);
+  wait_object_init(&objects[1], WAIT_OBJECT_MUTEX, &data->mutex);
+
+  // Let the other task lock the mutex.
+  task_delay(5);
+  ut_assert(data->mutex.owner == &tasks[0]);
+  ut_assert(wait_multiple(objects, 2, 0) == 1);
+  ut_assert(data->mutex.owner == &tasks[1]);
+  mutex_unlock(&data->mutex);
+
+  // The mutex is free so we shouldn't block at all.
+  ut_assert(wait_multiple(objects, 2, 0) == 1);
+  mutex_unlock(&data->mutex);
+  return NULL;
+}
+
+static void test_wait_multiple_mutex(void)
+{
+  struct test_wait_multiple_data data;
+  channel_init(&data.channels[0]);
+  mutex_init(&data.mutex, MUTEX_ATTR_DEFAULT);
+  task_init(&tasks[0], task_test_wait_multiple_mutex_owner, &data, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_wait_multiple_mutex_waiter, &data, stacks[1], STACK_SIZE, 6);
+  // Delay so that the waiter is a zombie when the owner checks on it.
+  task_delay(20);
+  task_wait(NULL);
+  task_wait(NULL);
+}
+
+struct test_wait_multiple_requeue_data
+{
+  struct channel * channel;
+  struct mutex * mutex;
+  bool lock;     // Whether the task locks the mutex. It waits on the channel otherwise.
+  char name;
+  char ** order; // Where each task writes its name when it's done.
+};
+
+static __task void * task_test_wait_multiple_requeue(void * arg)
+{
+  struct test_wait_multiple_requeue_data * data = (struct test_wait_multiple_requeue_data *)arg;
+  if (data->lock)
+  {
+    mutex_lock(data->mutex);
+    *(*data->order)++ = data->name;
+    mutex_unlock(data->mutex);
+    return NULL;
+  }
+
+  // The lowest priority waiter owns the mutex while it waits on the channel.
+  bool owner = data->mutex->owner == NULL;
+  if (owner)
+  {
+    mutex_lock(data->mutex);
+  }
+  struct wait_object object;
+  wait_object_init(&object, WAIT_OBJECT_CHANNEL, data->channel);
+  ut_assert(wait_multiple(&object, 1, 0) == 0);
+
+  uint32_t msg;
+  channel_recv(data->channel, &msg, sizeof(msg));
+  *(*data->order)++ = data->name;
+  channel_reply(data->channel, &msg, sizeof(msg));
+  if (owner)
+  {
+    mutex_unlock(data->mutex);
+  }
+  return NULL;
+}
+
+static void test_wait_multiple_requeue(void)
+{
+  // L and M wait on a channel. L owns a mutex that H blocks on. L inherits the
+  // priority of H and moves ahead of M in the queue of the channel.
+  struct channel channel;
+  struct mutex mutex;
+  char order[3];
+  char * next = order;
+  channel_init(&channel);
+  mutex_init(&mutex, MUTEX_ATTR_DEFAULT);
+  struct test_wait_multiple_requeue_data data[3] = {
+    {.channel = &channel, .mutex = &mutex, .lock = false, .name = 'l', .order = &next},
+    {.channel = &channel, .mutex = &mutex, .lock = false, .name = 'm', .order = &next},
+    {.channel = &channel, .mutex = &mutex, .lock = true, .name = 'h', .order = &next},
+  };
+  task_init(&tasks[0], task_test_wait_multiple_requeue, &data[0], stacks[0], STACK_SIZE, 4);
+  task_delay(5);
+  task_init(&tasks[1], task_test_wait_multiple_requeue, &data[1], stacks[1], STACK_SIZE, 5);
+  task_delay(5);
+  task_init(&tasks[2], task_test_wait_multiple_requeue, &data[2], stacks[2], STACK_SIZE, 7);
+  task_delay(5);
+  ut_assert(tasks[0].priority == 7);
+
+  // L gets the first message. It then lets H have the mutex before M gets the second one.
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    uint32_t msg = i;
+    size_t len = sizeof(msg);
+    channel_send(&channel, &msg, sizeof(msg), &msg, &len);
+  }
+  task_delay(5);
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+  ut_assert(next == order + 3);
+  ut_assert(order[0] == 'l');
+  ut_assert(order[1] == 'h');
+  ut_assert(order[2] == 'm');
+}
+
+struct test_barrier_data
+{
+  struct barrier barrier;
+  volatile uint32_t arrived;
+  volatile uint32_t serial;
+};
+
+static __task void * task_test_barrier(void * arg)
+{
+  // Every task should see everyone arrive before being released.
+  struct test_barrier_data * data = (struct test_barrier_data *)arg;
+  for (uint32_t cycle = 1; cycle <= 10; ++cycle)
+  {
+    task_delay(task_get_priority(NULL));
+    data->arrived++;
+    if (barrier_wait(&data->barrier))
+    {
+      data->serial++;
+    }
+    ut_assert(data->arrived >= cycle * NUM_TASKS);
+    ut_assert(data->barrier.generation >= cycle);
+  }
+  return NULL;
+}
+
+static void test_barrier(void)
+{
+  struct test_barrier_data data;
+  data.arrived = 0;
+  data.serial = 0;
+  barrier_init(&data.barrier, NUM_TASKS);
+  for (uint32_t i = 0; i < NUM_TASKS; ++i)
+  {
+    task_init(&tasks[i], task_test_barrier, &data, stacks[i], STACK_SIZE, 2 + i);
+  }
+  for (uint32_t i = 0; i < NUM_TASKS; ++i)
+  {
+    task_wait(NULL);
+  }
+
+  // Exactly one task was the last to arrive in each cycle.
+  ut_assert(data.serial == 10);
+  ut_assert(data.barrier.generation == 10);
+  ut_assert(pqueue_empty(&data.barrier.waiting_tasks));
+}
+
+struct test_barrier_performance_data
+{
+  struct barrier barrier;
+  uint32_t cycles;
+  volatile bool stop;
+  volatile bool quit[2];
+};
+
+static __task void * task_test_barrier_performance(void * arg)
+{
+  struct test_barrier_performance_data * data = (struct test_barrier_performance_data *)arg;
+  while (true)
+  {
+    bool serial = barrier_wait(&data->barrier);
+
+    // The generation can't change again until we arrive at the barrier.
+    // The last task to arrive decides if everyone quits after the next cycle.
+    // Using 2 flags makes sure that everyone sees the same decision.
+    uint32_t generation = data->barrier.generation;
+    if (data->quit[generation & 1])
+      break;
+    if (serial)
+    {
+      data->cycles++;
+      data->quit[(generation + 1) & 1] = data->stop;
+    }
+  }
+  return NULL;
+}
+
+static uint32_t test_barrier_performance(uint32_t participants)
+{
+  // A performance test to see how many barrier cycles per second
+  // we can do with equal priority tasks.
+  struct test_barrier_performance_data data;
+  data.cycles = 0;
+  data.stop = false;
+  data.quit[0] = false;
+  data.quit[1] = false;
+  barrier_init(&data.barrier, participants);
+  for (uint32_t i = 0; i < participants; ++i)
+  {
+    task_init(&tasks[i], task_test_barrier_performance, &data, stacks[i], STACK_SIZE, 5);
+  }
+  task_sleep(1);
+  data.stop = true;
+  for (uint32_t i = 0; i < participants; ++i)
+  {
+    task_wait(NULL);
+  }
+  return data.cycles;
+}
+
+static void test_barrier_performance_all(void)
+{
+  // Every cycle needs one more context switch per participant
+  // so adding participants can only make things slower.
+  uint32_t cycles2 = test_barrier_performance(2);
+  uint32_t cycles4 = test_barrier_performance(4);
+  uint32_t cycles8 = test_barrier_performance(8);
+  ut_assert(cycles2 > cycles4);
+  ut_assert(cycles4 > cycles8);
+  ut_assert(cycles8 > 0);
+}
+
+struct test_mailbox_sample
+{
+  uint32_t value;
+  uint32_t inverse;
+};
+
+struct test_mailbox_data
+{
+  struct mailbox mailbox;
+  uint8_t buffer[MAILBOX_BUFFER_SIZE(sizeof(struct test_mailbox_sample))];
+  volatile bool stop;
+};
+
+static __task void * task_test_mailbox_writer(void * arg)
+{
+  // Publish as fast as possible so that the readers preempt us mid-publish.
+  struct test_mailbox_data * data = (struct test_mailbox_data *)arg;
+  struct test_mailbox_sample sample = { .value = 0, .inverse = ~0 };
+  while (!data->stop)
+  {
+    sample.value++;
+    sample.inverse = ~sample.value;
+    mailbox_publish(&data->mailbox, &sample);
+  }
+  return (void*)sample.value;
+}
+
+static __task void * task_test_mailbox_reader(void * arg)
+{
+  struct test_mailbox_data * data = (struct test_mailbox_data *)arg;
+  uint32_t previous = 0;
+  for (int32_t i = 0; i < 50; ++i)
+  {
+    task_delay(1);
+
+    // The sample is never torn and is always the one matching the version.
+    struct test_mailbox_sample sample;
+    uint32_t version = mailbox_read(&data->mailbox, &sample);
+    ut_assert(sample.inverse == ~sample.value);
+    ut_assert(sample.value == version);
+    ut_assert(version >= previous);
+    previous = version;
+  }
+  return NULL;
+}
+
+static void test_mailbox(void)
+{
+  struct test_mailbox_data data;
+  struct test_mailbox_sample initial = { .value = 0, .inverse = ~0 };
+  mailbox_init(&data.mailbox, data.buffer, sizeof(initial), &initial);
+  data.stop = false;
+  task_init(&tasks[0], task_test_mailbox_writer, &data, stacks[0], STACK_SIZE, 4);
+  for (int32_t i = 1; i < NUM_TASKS; ++i)
+  {
+    task_init(&tasks[i], task_test_mailbox_reader, &data, stacks[i], STACK_SIZE, 5);
+  }
+  for (int32_t i = 1; i < NUM_TASKS; ++i)
+  {
+    struct task * reader = &tasks[i];
+    task_wait(&reader);
+  }
+  data.stop = true;
+  ut_assert(task_wait(NULL) != NULL);
+}
+
+struct test_rcu_table
+{
+  uint32_t value;
+  struct rcu_head head;
+  volatile bool reclaimed;
+};
+
+struct test_rcu_data
+{
+  struct test_rcu_table tables[3];
+  struct test_rcu_table * current;
+  volatile bool reading;
+};
+
+static void test_rcu_reclaim(struct rcu_head * head)
+{
+  struct test_rcu_table * table = container_of(head, struct test_rcu_table, head);
+  table->reclaimed = true;
+}
+
+static __task void * task_test_rcu_reader(void * arg)
+{
+  // Hold on to the table while being switched out.
+  struct test_rcu_data * data = (struct test_rcu_data *)arg;
+  rcu_read_lock();
+  struct test_rcu_table * table = rcu_dereference(data->current);
+  uint32_t value = table->value;
+  data->reading = true;
+  task_delay(10);
+  ut_assert(!table->reclaimed);
+  ut_assert(table->value == value);
+  data->reading = false;
+  rcu_read_unlock();
+  return NULL;
+}
+
+static __task void * task_test_rcu_writer(void * arg)
+{
+  struct test_rcu_data * data = (struct test_rcu_data *)arg;
+
+  // No one is reading so this shouldn't block.
+  synchronize_rcu();
+
+  // Replace the table while the reader is using it.
+  // We can only continue once the reader is done with the old table.
+  task_delay(5);
+  ut_assert(data->reading);
+  rcu_assign_pointer(data->current, &data->tables[1]);
+  synchronize_rcu();
+  ut_assert(!data->reading);
+  return NULL;
+}
+
+static void test_rcu(void)
+{
+  struct test_rcu_data data;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    data.tables[i].value = i;
+    data.tables[i].reclaimed = false;
+  }
+  data.current = &data.tables[0];
+  data.reading = false;
+
+  // Make sure synchronize_rcu() waits for the reader.
+  task_init(&tasks[0], task_test_rcu_reader, &data, stacks[0], STACK_SIZE, 4);
+  task_init(&tasks[1], task_test_rcu_writer, &data, stacks[1], STACK_SIZE, 5);
+  task_wait(NULL);
+  task_wait(NULL);
+
+  // Make sure call_rcu() waits for the reader.
+  task_init(&tasks[0], task_test_rcu_reader, &data, stacks[0], STACK_SIZE, 4);
+  task_delay(5);
+  ut_assert(data.reading);
+  rcu_assign_pointer(data.current, &data.tables[2]);
+  call_rcu(&data.tables[1].head, test_rcu_reclaim);
+  ut_assert(!data.tables[1].reclaimed);
+  task_wait(NULL);
+
+  // The idle task will reclaim the old table once it runs.
+  task_delay(5);
+  ut_assert(data.tables[1].reclaimed);
+  ut_assert(!data.tables[2].reclaimed);
+}
+
+static __task void * task_test_futex_timeout(void * arg)
+{
+  volatile uint32_t * value = (volatile uint32_t *)arg;
+
+  // The value doesn't match so we shouldn't wait.
+  ut_assert(!wait_on_address(value, *value + 1, 0));
+
+  // No one wakes us up so we should timeout.
+  ut_assert(!wait_on_address(value, *value, 5));
+
+  // The other task wakes us up.
+  ut_assert(wait_on_address(value, *value, 0));
+  return NULL;
+}
+
+static void test_futex_timeout(void)
+{
+  volatile uint32_t value = 0;
+  ut_assert(wake_address(&value, 1) == 0);
+  task_init(&tasks[0], task_test_futex_timeout, (void*)&value, stacks[0], STACK_SIZE, 5);
+  task_delay(10);
+  ut_assert(tasks[0].state == STATE_FUTEX);
+  value = 1;
+  ut_assert(wake_address(&value, 1) == 1);
+  task_wait(NULL);
+}
+
+struct test_futex_mutex_data
+{
+  struct futex_mutex mutex;
+  volatile bool critical_section;
+};
+
+static __task void * task_test_futex_mutex_lock(void * arg)
+{
+  struct test_futex_mutex_data * data = (struct test_futex_mutex_data *)arg;
+  for (int32_t i = 0; i < 10; ++i)
+  {
+    futex_mutex_lock(&data->mutex);
+    ut_assert(!data->critical_section);
+    data->critical_section = true;
+    task_yield();
+    task_delay(2);
+    ut_assert(data->critical_section);
+    data->critical_section = false;
+    futex_mutex_unlock(&data->mutex);
+  }
+  return NULL;
+}
+
+static void test_futex_mutex_lock(void)
+{
+  struct test_futex_mutex_data data;
+  futex_mutex_init(&data.mutex);
+  data.critical_section = false;
+  for (int32_t i = 0; i < NUM_TASKS; ++i)
+  {
+    task_init(&tasks[i], task_test_futex_mutex_lock, &data, stacks[i], STACK_SIZE, 5);
+  }
+  for (int32_t i = 0; i < NUM_TASKS; ++i)
+  {
+    task_wait(NULL);
+  }
+  ut_assert(data.mutex.state == 0);
+}
+
+static __task void * task_test_futex_mutex_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  struct futex_mutex mutex;
+  futex_mutex_init(&mutex);
+  uint32_t count = 0;
+  while (!*stop) {
+    futex_mutex_lock(&mutex);
+    ++count;
+    futex_mutex_unlock(&mutex);
+  }
+  return (void*)count;
+}
+
+static __task void * task_test_mutex_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  struct mutex mutex;
+  mutex_init(&mutex, MUTEX_ATTR_DEFAULT);
+  uint32_t count = 0;
+  while (!*stop) {
+    mutex_lock(&mutex);
+    ++count;
+    mutex_unlock(&mutex);
+  }
+  return (void*)count;
+}
+
+static void test_futex_mutex_performance(void)
+{
+  // A performance test to compare how many uncontended lock/unlock pairs
+  // per second we can do with a futex mutex and a kernel mutex.
+  bool stop = false;
+  task_init(&tasks[0], task_test_futex_mutex_performance, &stop, stacks[0], STACK_SIZE, 5);
+  task_sleep(1);
+  stop = true;
+  uint32_t futex_count = (uint32_t)task_wait(NULL);
+
+  stop = false;
+  task_init(&tasks[0], task_test_mutex_performance, &stop, stacks[0], STACK_SIZE, 5);
+  task_sleep(1);
+  stop = true;
+  uint32_t mutex_count = (uint32_t)task_wait(NULL);
+
+  // Masking interrupts is cheaper than disabling the SysTick with barriers.
+  ut_assert(futex_count > mutex_count);
+}
+
+static __task void * task_test_mempool(void * arg)
+{
+  struct mempool * pool = (struct mempool *)arg;
+  return mempool_alloc(pool);
+}
+
+static void test_mempool(void)
+{
+  struct mempool pool;
+  uint32_t buffer[MEMPOOL_BUFFER_SIZE(10, 2) / sizeof(uint32_t)];
+  mempool_init(&pool, buffer, 10, 2);
+
+  void * a = mempool_alloc(&pool);
+  void * b = mempool_tryalloc(&pool);
+  ut_assert(a != NULL);
+  ut_assert(b != NULL);
+  ut_assert(a != b);
+  ut_assert(mempool_used(&pool) == 2);
+  ut_assert(mempool_peak(&pool) == 2);
+
+  // The pool is empty.
+  ut_assert(mempool_tryalloc(&pool) == NULL);
+  ut_assert(mempool_timed_alloc(&pool, 5) == NULL);
+
+  // The block is handed to the task waiting for it.
+  task_init(&tasks[0], task_test_mempool, &pool, stacks[0], STACK_SIZE, 5);
+  task_delay(5);
+  ut_assert(tasks[0].state == STATE_MEMPOOL);
+  mempool_free(&pool, a);
+  ut_assert(tasks[0].state == STATE_READY);
+  ut_assert(mempool_used(&pool) == 2);
+  ut_assert(task_wait(NULL) == a);
+
+  // The blocks go to the waiting tasks in priority order. The task that frees
+  // a block can't take it back while someone is waiting for it.
+  task_init(&tasks[0], task_test_mempool, &pool, stacks[0], STACK_SIZE, 4);
+  task_init(&tasks[1], task_test_mempool, &pool, stacks[1], STACK_SIZE, 6);
+  task_delay(5);
+  mempool_free(&pool, a);
+  ut_assert(tasks[0].state == STATE_MEMPOOL);
+  ut_assert(tasks[1].state == STATE_READY);
+  ut_assert(mempool_tryalloc(&pool) == NULL);
+  mempool_free(&pool, b);
+  ut_assert(tasks[0].state == STATE_READY);
+  ut_assert(mempool_used(&pool) == 2);
+  struct task * task = &tasks[1];
+  ut_assert(task_wait(&task) == a);
+  task = &tasks[0];
+  ut_assert(task_wait(&task) == b);
+
+  mempool_free(&pool, a);
+  mempool_free(&pool, b);
+  ut_assert(mempool_used(&pool) == 0);
+  ut_assert(mempool_peak(&pool) == 2);
+}
+
+static void test_heap(void)
+{
+  // These are too big for the stack of the test task.
+  static struct heap heap;
+  static uint32_t buffer[128];
+  uint8_t * blocks[8] = {0};
+  uint32_t sizes[8];
+  uint32_t seed = 1;
+
+  heap_init(&heap, buffer, sizeof(buffer));
+  ut_assert(heap_used(&heap) == 0);
+  ut_assert(heap_fragmentation(&heap) == 0);
+  ut_assert(heap_alloc(&heap, 0) == NULL);
+  ut_assert(heap_alloc(&heap, sizeof(buffer)) == NULL);
+
+  // Allocate and free blocks of random sizes. Each block is filled
+  // with its index to make sure that the blocks never overlap.
+  for (int32_t i = 0; i < 1000; ++i)
+  {
+    seed = seed * 1103515245 + 12345;
+    uint32_t index = (seed >> 16) % 8;
+    if (blocks[index] != NULL)
+    {
+      for (uint32_t j = 0; j < sizes[index]; ++j)
+      {
+        ut_assert(blocks[index][j] == index);
+      }
+      heap_free(&heap, blocks[index]);
+      blocks[index] = NULL;
+    }
+    else
+    {
+      sizes[index] = 1 + (seed >> 8) % 64;
+      blocks[index] = heap_alloc(&heap, sizes[index]);
+      if (blocks[index] != NULL)
+      {
+        ut_assert(((uintptr_t)blocks[index] & 3) == 0);
+        memset(blocks[index], index, sizes[index]);
+      }
+    }
+  }
+  ut_assert(heap_peak(&heap) > 0);
+  ut_assert(heap_peak(&heap) <= sizeof(buffer));
+
+  // Every block is merged back together once they're all freed.
+  for (int32_t i = 0; i < 8; ++i)
+  {
+    heap_free(&heap, blocks[i]);
+  }
+  ut_assert(heap_used(&heap) == 0);
+  ut_assert(heap_fragmentation(&heap) == 0);
+  void * block = heap_alloc(&heap, sizeof(buffer) / 2);
+  ut_assert(block != NULL);
+  heap_free(&heap, block);
+}
+
+static __task void * task_test_spawn(void * arg)
+{
+  return arg;
+}
+
+static void test_spawn(void)
+{
+  struct task_slab slab;
+  task_slab_init(&slab, stacks, STACK_SIZE, 2);
+
+  // The slab only has room for 2 tasks.
+  struct task * t1 = task_spawn(task_test_spawn, (void*)1, &slab, 5);
+  struct task * t2 = task_spawn(task_test_spawn, (void*)2, &slab, 5);
+  ut_assert(t1 != NULL);
+  ut_assert(t2 != NULL);
+  ut_assert(t1 != t2);
+  ut_assert(task_spawn(task_test_spawn, NULL, &slab, 5) == NULL);
+
+  ut_assert(task_wait(&t1) == (void*)1);
+  ut_assert(task_wait(&t2) == (void*)2);
+
+  // The destroyed tasks are reused.
+  struct task * t3 = task_spawn(task_test_spawn, (void*)3, &slab, 5);
+  ut_assert(t3 == t1);
+  ut_assert(t3->state == STATE_READY);
+  ut_assert(task_wait(&t3) == (void*)3);
+}
+
+static __task void * task_test_init_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  uint32_t count = 0;
+  while (!*stop) {
+    task_init(&tasks[1], task_test_spawn, NULL, stacks[1], STACK_SIZE, 5);
+    task_wait(NULL);
+    ++count;
+  }
+  return (void*)count;
+}
+
+static __task void * task_test_spawn_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  struct task_slab slab;
+  task_slab_init(&slab, stacks[2], STACK_SIZE, 1);
+  uint32_t count = 0;
+  while (!*stop) {
+    task_spawn(task_test_spawn, NULL, &slab, 5);
+    task_wait(NULL);
+    ++count;
+  }
+  return (void*)count;
+}
+
+static void test_spawn_performance(void)
+{
+  // A performance test to compare how many tasks per second can be
+  // created and waited for with task_init() and with task_spawn().
+  bool stop = false;
+  task_init(&tasks[0], task_test_init_performance, &stop, stacks[0], STACK_SIZE, 5);
+  task_sleep(1);
+  stop = true;
+  uint32_t init_count = (uint32_t)task_wait(NULL);
+
+  stop = false;
+  task_init(&tasks[0], task_test_spawn_performance, &stop, stacks[0], STACK_SIZE, 5);
+  task_sleep(1);
+  stop = true;
+  uint32_t spawn_count = (uint32_t)task_wait(NULL);
+
+  // Restarting a recycled task shouldn't cost more than initializing one.
+  ut_assert(spawn_count + spawn_count / 10 >= init_count);
+}
+
+static __task void * task_test_detach(void * arg)
+{
+  if (arg != NULL)
+  {
+    task_detach(NULL);
+  }
+  return NULL;
+}
+
+static void test_detach(void)
+{
+  // A detached task is destroyed when it returns.
+  task_init_attr(&tasks[0], task_test_detach, NULL, stacks[0], STACK_SIZE, 5, TASK_ATTR_DETACHED);
+  task_delay(5);
+  ut_assert(tasks[0].state == STATE_DEAD);
+
+  // A task can detach itself.
+  task_init(&tasks[0], task_test_detach, (void*)1, stacks[0], STACK_SIZE, 5);
+  task_delay(5);
+  ut_assert(tasks[0].state == STATE_DEAD);
+
+  // Detaching a task that already returned destroys it.
+  task_init(&tasks[0], task_test_detach, NULL, stacks[0], STACK_SIZE, 5);
+  task_delay(5);
+  ut_assert(tasks[0].state == STATE_ZOMBIE);
+  task_detach(&tasks[0]);
+  ut_assert(tasks[0].state == STATE_DEAD);
+}
+
+static __task void * task_test_wait_any_order(void * arg)
+{
+  task_delay((uint32_t)arg);
+  return arg;
+}
+
+static void test_wait_any_order(void)
+{
+  // The children are reaped in the order they returned.
+  task_init(&tasks[0], task_test_wait_any_order, (void*)3, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_wait_any_order, (void*)1, stacks[1], STACK_SIZE, 5);
+  task_init(&tasks[2], task_test_wait_any_order, (void*)2, stacks[2], STACK_SIZE, 5);
+  task_delay(10);
+  ut_assert(tasks[0].state == STATE_ZOMBIE);
+  ut_assert(tasks[1].state == STATE_ZOMBIE);
+  ut_assert(tasks[2].state == STATE_ZOMBIE);
+
+  struct task * child = NULL;
+  ut_assert(task_wait(&child) == (void*)1);
+  ut_assert(child == &tasks[1]);
+  child = NULL;
+  ut_assert(task_wait(&child) == (void*)2);
+  ut_assert(child == &tasks[2]);
+  child = NULL;
+  ut_assert(task_wait(&child) == (void*)3);
+  ut_assert(child == &tasks[0]);
+}
+
+static __task void * task_test_orphan_parent(void * arg)
+{
+  // Create a child and return without waiting for it.
+  task_init(&tasks[1], task_test_orphan_child, NULL, stacks[1], STACK_SIZE, 4);
+  task_init(&tasks[2], task_test_orphan_child, (void*)5, stacks[2], STACK_SIZE, 4);
+  task_delay(2);
+  ut_assert(tasks[1].state == STATE_ZOMBIE);
+  ut_assert(tasks[2].state == STATE_SLEEP);
+  return NULL;
+}
+
+static __task void * task_test_orphan_child(void * arg)
+{
+  task_delay((uint32_t)arg);
+  return NULL;
+}
+
+static void test_orphan(void)
+{
+  // The init task adopts and reaps the children of a task once it's destroyed.
+  // That includes the ones that already returned.
+  task_init(&tasks[0], task_test_orphan_parent, NULL, stacks[0], STACK_SIZE, 5);
+  task_wait(NULL);
+  ut_assert(tasks[0].state == STATE_DEAD);
+  task_delay(10);
+  ut_assert(tasks[1].state == STATE_DEAD);
+  ut_assert(tasks[2].state == STATE_DEAD);
+}
+
+static __task void * task_test_group(void * arg)
+{
+  task_delay((uint32_t)arg);
+  return arg;
+}
+
+static void test_group(void)
+{
+  struct task_group group;
+  group_init(&group);
+  void * args[3] = {(void*)3, (void*)1, (void*)2};
+  void * results[3] = {NULL, NULL, NULL};
+
+  // We're woken up once the last member returns.
+  // The results are in the order of the members, not the order they returned.
+  group_spawn(&group, tasks, stacks, STACK_SIZE, 3, task_test_group, args, 5);
+  group_join_all(&group, results);
+  ut_assert(results[0] == (void*)3);
+  ut_assert(results[1] == (void*)1);
+  ut_assert(results[2] == (void*)2);
+  ut_assert(tasks[0].state == STATE_DEAD);
+  ut_assert(tasks[1].state == STATE_DEAD);
+  ut_assert(tasks[2].state == STATE_DEAD);
+
+  // Joining a group whose members already returned doesn't block.
+  group_spawn(&group, tasks, stacks, STACK_SIZE, 3, task_test_group, NULL, 5);
+  task_delay(5);
+  ut_assert(tasks[0].state == STATE_ZOMBIE);
+  group_join_all(&group, results);
+  ut_assert(results[0] == NULL);
+  ut_assert(tasks[0].state == STATE_DEAD);
+  ut_assert(tasks[1].state == STATE_DEAD);
+  ut_assert(tasks[2].state == STATE_DEAD);
+
+  // The batch was already joined. There's nothing left to collect.
+  results[0] = (void*)1;
+  group_join_all(&group, results);
+  ut_assert(results[0] == (void*)1);
+  ut_assert(group.count == 0);
+}
+
+static __task void * task_test_group_individual_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  uint32_t count = 0;
+  while (!*stop) {
+    for (uint32_t i = 2; i < 6; ++i)
+    {
+      task_init(&tasks[i], task_test_spawn, NULL, stacks[i], STACK_SIZE, 5);
+    }
+    for (uint32_t i = 2; i < 6; ++i)
+    {
+      struct task * member = &tasks[i];
+      task_wait(&member);
+    }
+    ++count;
+  }
+  return (void*)count;
+}
+
+static __task void * task_test_group_join_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  struct task_group group;
+  group_init(&group);
+  uint32_t count = 0;
+  while (!*stop) {
+    group_spawn(&group, &tasks[2], stacks[2], STACK_SIZE, 4, task_test_spawn, NULL, 5);
+    group_join_all(&group, NULL);
+    ++count;
+  }
+  return (void*)count;
+}
+
+static void test_group_performance(void)
+{
+  // A performance test to compare how many batches of 4 tasks per second
+  // can be created and waited for one by one and as a group.
+  bool stop = false;
+  task_init(&tasks[0], task_test_group_individual_performance, &stop, stacks[0], STACK_SIZE, 6);
+  task_sleep(1);
+  stop = true;
+  uint32_t individual_count = (uint32_t)task_wait(NULL);
+
+  stop = false;
+  task_init(&tasks[0], task_test_group_join_performance, &stop, stacks[0], STACK_SIZE, 6);
+  task_sleep(1);
+  stop = true;
+  uint32_t group_count = (uint32_t)task_wait(NULL);
+
+  // A group saves a system call per member.
+  ut_assert(group_count > individual_count);
+}
+
+static void work_test_count(void * arg)
+{
+  ++*(uint32_t*)arg;
+}
+
+static void test_workqueue(void)
+{
+  // The workers keep waiting on the queue after the test is done.
+  // They're only created the first time that the tests run.
+  static struct workqueue queue;
+  static struct task workers[2];
+  #pragma data_alignment = 8
+  static uint8_t worker_stacks[2][STACK_SIZE];
+  static bool initialized = false;
+  if (!initialized)
+  {
+    workqueue_init(&queue, workers, worker_stacks, STACK_SIZE, 2, 5);
+    initialized = true;
+  }
+
+  // The workers have a lower priority than us. Let them start waiting for jobs.
+  task_delay(1);
+  ut_assert(workers[0].state == STATE_WORKQUEUE);
+  ut_assert(workers[1].state == STATE_WORKQUEUE);
+
+  uint32_t a = 0;
+  uint32_t b = 0;
+  struct work work_a;
+  struct work work_b;
+  work_init(&work_a, work_test_count, &a);
+  work_init(&work_b, work_test_count, &b);
+
+  // The jobs run once we give the workers a chance to run.
+  // Submitting a pending job again does nothing.
+  workqueue_submit(&queue, &work_a);
+  workqueue_submit(&queue, &work_a);
+  workqueue_submit(&queue, &work_b);
+  ut_assert(a == 0);
+  ut_assert(b == 0);
+  task_delay(5);
+  ut_assert(a == 1);
+  ut_assert(b == 1);
+  ut_assert(workers[0].state == STATE_WORKQUEUE);
+  ut_assert(workers[1].state == STATE_WORKQUEUE);
+
+  // A job can be submitted again once it ran.
+  workqueue_submit(&queue, &work_a);
+  task_delay(5);
+  ut_assert(a == 2);
+}
+
+static __task void * task_test_job(void * arg)
+{
+  work_test_count(arg);
+  return NULL;
+}
+
+static __task void * task_test_job_task_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  uint32_t count = 0;
+  while (!*stop) {
+    task_init(&tasks[1], task_test_job, &count, stacks[1], STACK_SIZE, 6);
+    task_wait(NULL);
+  }
+  return (void*)count;
+}
+
+static __task void * task_test_job_workqueue_performance(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  static struct workqueue queue;
+  static struct task worker;
+  #pragma data_alignment = 8
+  static uint8_t worker_stack[STACK_SIZE];
+  static bool initialized = false;
+  if (!initialized)
+  {
+    workqueue_init(&queue, &worker, worker_stack, STACK_SIZE, 1, 6);
+    initialized = true;
+  }
+
+  uint32_t count = 0;
+  struct work work;
+  work_init(&work, work_test_count, &count);
+  while (!*stop) {
+    workqueue_submit(&queue, &work);
+  }
+  return (void*)count;
+}
+
+static void test_workqueue_performance(void)
+{
+  // A performance test to compare how many jobs per second can be run
+  // by creating a task per job and by submitting them to a work queue.
+  // The jobs have a higher priority than the task creating them.
+  bool stop = false;
+  task_init(&tasks[0], task_test_job_task_performance, &stop, stacks[0], STACK_SIZE, 5);
+  task_sleep(1);
+  stop = true;
+  uint32_t task_count = (uint32_t)task_wait(NULL);
+
+  stop = false;
+  task_init(&tasks[0], task_test_job_workqueue_performance, &stop, stacks[0], STACK_SIZE, 5);
+  task_sleep(1);
+  stop = true;
+  uint32_t workqueue_count = (uint32_t)task_wait(NULL);
+
+  // Waking a worker is cheaper than creating a task and waiting for it.
+  ut_assert(workqueue_count > task_count);
+}
+
+static uint8_t fiber_test_delay(struct fiber * fiber)
+{
+  FIBER_BEGIN(fiber);
+  FIBER_DELAY(fiber, 5);
+  *(bool*)fiber_arg(fiber) = true;
+  FIBER_END(fiber);
+}
+
+static uint8_t fiber_test_wait(struct fiber * fiber)
+{
+  FIBER_BEGIN(fiber);
+  FIBER_WAIT_UNTIL(fiber, *(bool*)fiber_arg(fiber));
+  FIBER_END(fiber);
+}
+
+static uint8_t fiber_test_channel(struct fiber * fiber)
+{
+  struct channel * channel = (struct channel *)fiber_arg(fiber);
+  uint32_t value;
+  FIBER_BEGIN(fiber);
+  FIBER_WAIT_CHANNEL(fiber, channel);
+  channel_recv(channel, &value, sizeof(value));
+  value *= 2;
+  channel_reply(channel, &value, sizeof(value));
+  FIBER_END(fiber);
+}
+
+static __task void * task_test_fiber_host(void * arg)
+{
+  fiber_host_run((struct fiber_host *)arg);
+  return NULL;
+}
+
+static void test_fiber(void)
+{
+  // A fiber is a lot smaller than a task and its stack.
+  ut_assert(sizeof(struct fiber) <= 32);
+
+  static struct fiber_host host;
+  static struct fiber fibers[3];
+  struct wait_object object;
+  struct channel channel;
+  bool expired = false;
+  channel_init(&channel);
+  fiber_host_init(&host, &object, 1);
+  fiber_start(&host, &fibers[0], fiber_test_delay, &expired);
+  fiber_start(&host, &fibers[1], fiber_test_wait, &expired);
+  fiber_start(&host, &fibers[2], fiber_test_channel, &channel);
+  task_init(&tasks[0], task_test_fiber_host, &host, stacks[0], STACK_SIZE, 5);
+
+  // The host blocks on the channel for the fiber and the fiber replies.
+  uint32_t value = 21;
+  uint32_t reply = 0;
+  size_t reply_len = sizeof(reply);
+  channel_send(&channel, &value, sizeof(value), &reply, &reply_len);
+  ut_assert(reply == 42);
+  ut_assert(!expired);
+
+  // The host returns once the timer expired and the fiber waiting for it is done.
+  struct task * host_task = &tasks[0];
+  task_wait(&host_task);
+  ut_assert(expired);
+  ut_assert(list_empty(&host.fibers));
+}
+
+static uint8_t fiber_test_ping(struct fiber * fiber)
+{
+  uint32_t * turns = (uint32_t*)fiber_arg(fiber);
+  FIBER_BEGIN(fiber);
+  while (true) {
+    FIBER_WAIT_UNTIL(fiber, *turns % 2 == 0);
+    if (*turns == 20)
+      break;
+    ++*turns;
+  }
+  FIBER_END(fiber);
+}
+
+static uint8_t fiber_test_pong(struct fiber * fiber)
+{
+  uint32_t * turns = (uint32_t*)fiber_arg(fiber);
+  FIBER_BEGIN(fiber);
+  while (*turns < 20) {
+    FIBER_WAIT_UNTIL(fiber, *turns % 2 == 1);
+    ++*turns;
+  }
+  FIBER_END(fiber);
+}
+
+static void test_fiber_polling(void)
+{
+  static struct fiber_host host;
+  static struct fiber fibers[4];
+  struct wait_object object;
+  struct channel channel;
+  uint32_t turns = 0;
+  bool ready = false;
+  channel_init(&channel);
+  fiber_host_init(&host, &object, 1);
+  fiber_start(&host, &fibers[0], fiber_test_channel, &channel);
+  fiber_start(&host, &fibers[1], fiber_test_wait, &ready);
+  fiber_start(&host, &fibers[2], fiber_test_ping, &turns);
+  fiber_start(&host, &fibers[3], fiber_test_pong, &turns);
+  task_init(&tasks[0], task_test_fiber_host, &host, stacks[0], STACK_SIZE, 5);
+
+  // The fibers taking turns wait on the same line every time. Each turn still
+  // counts as progress so the host runs them all before blocking.
+  task_delay(1);
+  ut_assert(turns == 20);
+
+  // The fiber waiting on a condition is polled even though the other fiber
+  // waits on a channel without a timer.
+  ready = true;
+  task_delay(2);
+  ut_assert(fibers[1].resume == 0);
+
+  uint32_t value = 21;
+  uint32_t reply = 0;
+  size_t reply_len = sizeof(reply);
+  channel_send(&channel, &value, sizeof(value), &reply, &reply_len);
+  ut_assert(reply == 42);
+  struct task * host_task = &tasks[0];
+  task_wait(&host_task);
+  ut_assert(list_empty(&host.fibers));
+}
+
+struct test_switch_performance_data
+{
+  volatile bool stop;
+  uint32_t count;
+};
+
+static uint8_t fiber_test_switch_performance(struct fiber * fiber)
+{
+  struct test_switch_performance_data * data = (struct test_switch_performance_data *)fiber_arg(fiber);
+  FIBER_BEGIN(fiber);
+  while (!data->stop) {
+    ++data->count;
+    FIBER_YIELD(fiber);
+  }
+  FIBER_END(fiber);
+}
+
+static __task void * task_test_switch_performance(void * arg)
+{
+  struct test_switch_performance_data * data = (struct test_switch_performance_data *)arg;
+  while (!data->stop) {
+    ++data->count;
+    task_yield();
+  }
+  return NULL;
+}
+
+static void test_fiber_performance(void)
+{
+  // A performance test to compare how many times per second 2 tasks
+  // can switch between each other and 2 fibers can switch between each other.
+  struct test_switch_performance_data data;
+  data.stop = false;
+  data.count = 0;
+  task_init(&tasks[0], task_test_switch_performance, &data, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_switch_performance, &data, stacks[1], STACK_SIZE, 5);
+  task_sleep(1);
+  data.stop = true;
+  struct task * task = &tasks[0];
+  task_wait(&task);
+  task = &tasks[1];
+  task_wait(&task);
+  uint32_t task_count = data.count;
+
+  static struct fiber_host host;
+  static struct fiber fibers[2];
+  data.stop = false;
+  data.count = 0;
+  fiber_host_init(&host, NULL, 0);
+  fiber_start(&host, &fibers[0], fiber_test_switch_performance, &data);
+  fiber_start(&host, &fibers[1], fiber_test_switch_performance, &data);
+  task_init(&tasks[0], task_test_fiber_host, &host, stacks[0], STACK_SIZE, 5);
+  task_sleep(1);
+  data.stop = true;
+  task = &tasks[0];
+  task_wait(&task);
+  uint32_t fiber_count = data.count;
+
+  // Switching fibers is a function call. Switching tasks is a system call
+  // that saves and restores their context.
+  ut_assert(fiber_count > task_count);
+}
+
+struct test_active_data
+{
+  struct active_scheduler scheduler;
+  struct active_object low;
+  struct active_object high;
+  uint32_t low_events[4];
+  uint32_t high_events[2];
+  uint32_t log[8];
+  uint32_t logged;
+};
+
+static void active_test_low(struct active_object * object, uint32_t event)
+{
+  struct test_active_data * data = container_of(object, struct test_active_data, low);
+  data->log[data->logged++] = event;
+  if (event == 3)
+  {
+    // The high priority object preempts us.
+    active_post(&data->high, 4);
+    data->log[data->logged++] = 5;
+  }
+}
+
+static void active_test_high(struct active_object * object, uint32_t event)
+{
+  struct test_active_data * data = container_of(object, struct test_active_data, high);
+  data->log[data->logged++] = event;
+}
+
+static __task void * task_test_active_host(void * arg)
+{
+  active_scheduler_run((struct active_scheduler *)arg);
+  return NULL;
+}
+
+static void test_active(void)
+{
+  // An object without its events costs less than a task without its stack.
+  ut_assert(sizeof(struct active_object) < sizeof(struct task));
+
+  // The host keeps dispatching the events of its objects once the test is done.
+  // It's only started the first time that the tests run.
+  static struct test_active_data data;
+  static struct task host;
+  #pragma data_alignment = 8
+  static uint8_t host_stack[STACK_SIZE];
+  static bool initialized = false;
+  if (!initialized)
+  {
+    active_scheduler_init(&data.scheduler);
+    active_init(&data.low, &data.scheduler, active_test_low, 1, data.low_events, 4);
+    active_init(&data.high, &data.scheduler, active_test_high, 2, data.high_events, 2);
+    task_init(&host, task_test_active_host, &data.scheduler, host_stack, STACK_SIZE, 5);
+    initialized = true;
+  }
+  data.logged = 0;
+
+  // The events are dispatched by priority once the host runs.
+  ut_assert(active_post(&data.low, 1));
+  ut_assert(active_post(&data.high, 2));
+  ut_assert(data.logged == 0);
+  task_delay(5);
+  ut_assert(data.logged == 2);
+  ut_assert(data.log[0] == 2);
+  ut_assert(data.log[1] == 1);
+  ut_assert(host.state == STATE_FUTEX);
+
+  // Posting to a higher priority object dispatches the event right away.
+  ut_assert(active_post(&data.low, 3));
+  task_delay(5);
+  ut_assert(data.logged == 5);
+  ut_assert(data.log[2] == 3);
+  ut_assert(data.log[3] == 4);
+  ut_assert(data.log[4] == 5);
+
+  // The queue of events can fill up.
+  ut_assert(active_post(&data.high, 6));
+  ut_assert(active_post(&data.high, 7));
+  ut_assert(!active_post(&data.high, 8));
+  task_delay(5);
+  ut_assert(data.logged == 7);
+  ut_assert(data.log[5] == 6);
+  ut_assert(data.log[6] == 7);
+}
+
+struct test_active_performance_data
+{
+  struct active_scheduler scheduler;
+  struct active_object ping;
+  struct active_object pong;
+  uint32_t ping_events[1];
+  uint32_t pong_events[1];
+  struct channel channel;
+  volatile bool stop;
+  uint32_t count;
+};
+
+static void active_test_ping(struct active_object * object, uint32_t event)
+{
+  struct test_active_performance_data * data =
+    container_of(object, struct test_active_performance_data, ping);
+  if (!data->stop)
+  {
+    ++data->count;
+    active_post(&data->pong, event);
+  }
+}
+
+static void active_test_pong(struct active_object * object, uint32_t event)
+{
+  struct test_active_performance_data * data =
+    container_of(object, struct test_active_performance_data, pong);
+  active_post(&data->ping, event);
+}
+
+static __task void * task_test_channel_ping(void * arg)
+{
+  struct test_active_performance_data * data = (struct test_active_performance_data *)arg;
+  uint32_t msg = 0;
+  uint32_t reply;
+  size_t reply_len = sizeof(reply);
+  while (!data->stop) {
+    ++data->count;
+    channel_send(&data->channel, &msg, sizeof(msg), &reply, &reply_len);
+  }
+
+  // Tell the other task to return.
+  msg = 1;
+  channel_send(&data->channel, &msg, sizeof(msg), &reply, &reply_len);
+  return NULL;
+}
+
+static __task void * task_test_channel_pong(void * arg)
+{
+  struct test_active_performance_data * data = (struct test_active_performance_data *)arg;
+  uint32_t msg = 0;
+  while (msg == 0) {
+    channel_recv(&data->channel, &msg, sizeof(msg));
+    channel_reply(&data->channel, &msg, sizeof(msg));
+  }
+  return NULL;
+}
+
+static void test_active_performance(void)
+{
+  // A performance test to compare how many events per second 2 active objects
+  // can send back and forth and how many messages 2 tasks can send back and forth
+  // through a channel.
+  static struct test_active_performance_data data;
+  channel_init(&data.channel);
+  data.stop = false;
+  data.count = 0;
+  task_init(&tasks[0], task_test_channel_ping, &data, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_channel_pong, &data, stacks[1], STACK_SIZE, 6);
+  task_sleep(1);
+  data.stop = true;
+  struct task * task = &tasks[0];
+  task_wait(&task);
+  task = &tasks[1];
+  task_wait(&task);
+  uint32_t channel_count = data.count;
+
+  // This host is separate from the one of test_active() and outlives the test too.
+  // The ping and pong objects stay registered with it between runs.
+  static struct task host;
+  #pragma data_alignment = 8
+  static uint8_t host_stack[STACK_SIZE];
+  static bool initialized = false;
+  data.stop = false;
+  data.count = 0;
+  if (!initialized)
+  {
+    active_scheduler_init(&data.scheduler);
+    active_init(&data.ping, &data.scheduler, active_test_ping, 1, data.ping_events, 1);
+    active_init(&data.pong, &data.scheduler, active_test_pong, 2, data.pong_events, 1);
+    task_init(&host, task_test_active_host, &data.scheduler, host_stack, STACK_SIZE, 5);
+    initialized = true;
+  }
+  active_post(&data.ping, 0);
+  task_sleep(1);
+  data.stop = true;
+  task_delay(5);
+  ut_assert(host.state == STATE_FUTEX);
+  uint32_t active_count = data.count;
+
+  // Dispatching an event is a function call. Sending a message is
+  // a system call and a context switch each way.
+  ut_assert(active_count > channel_count);
+}
+
+static void test_delay_until(void)
+{
+  // The clock keeps counting while we sleep.
+  uint64_t start = kernel_time_now();
+  task_delay(5);
+  uint64_t end = kernel_time_now();
+  ut_assert(end - start >= 5000);
+  ut_assert(end - start < 5100);
+
+  // We wake up at the time we asked for.
+  task_delay_until(end + 2500);
+  ut_assert(kernel_time_now() >= end + 2500);
+  ut_assert(kernel_time_now() < end + 2600);
+
+  // A time that already passed doesn't sleep.
+  start = kernel_time_now();
+  task_delay_until(start - 1000);
+  ut_assert(kernel_time_now() - start < 100);
+}
+
+static void test_delay_until_jitter(void)
+{
+  // Measure how late a 1ms periodic loop wakes up.
+  uint32_t max_jitter = 0;
+  uint64_t start = kernel_time_now();
+  uint64_t release = start;
+  for (uint32_t i = 0; i < JITTER_PERIODS; ++i)
+  {
+    release += 1000;
+    task_delay_until(release);
+    uint32_t jitter = (uint32_t)(kernel_time_now() - release);
+    max_jitter = MAX(max_jitter, jitter);
+  }
+
+  // The period doesn't drift and each release is at most a few microseconds late.
+  ut_assert(kernel_time_now() - start < JITTER_PERIODS * 1000 + 50);
+  ut_assert(max_jitter < 50);
+}
+
+static __task void * task_test_periodic(void * arg)
+{
+  volatile bool * stop = (volatile bool*)arg;
+  struct task_period period;
+
+  // Release a job every 2ms starting in 1ms. Each job has 1ms to complete.
+  task_set_period(&period, 2000, 1000, 1000);
+  for (uint32_t job = 0; !*stop; ++job)
+  {
+    if (job == 3)
+    {
+      // Miss the deadline.
+      uint64_t start = kernel_time_now();
+      while (kernel_time_now() - start < 1500);
+    }
+    task_wait_period();
+  }
+  return NULL;
+}
+
+static void test_periodic(void)
+{
+  // The jobs are released at 1, 3, 5, 7 and 9ms.
+  bool stop = false;
+  task_init(&tasks[0], task_test_periodic, &stop, stacks[0], STACK_SIZE, 5);
+  task_delay(10);
+  struct task_period_stats stats;
+  ut_assert(task_get_period_stats(&tasks[0], &stats));
+  ut_assert(stats.jobs == 5);
+  ut_assert(stats.overruns == 1);
+  ut_assert(stats.max_response >= 1500);
+  ut_assert(stats.max_response < 1600);
+  ut_assert(stats.last_response < 100);
+  ut_assert(stats.max_jitter < 50);
+
+  stop = true;
+  struct task * task = &tasks[0];
+  task_wait(&task);
+}
+
+struct test_timer
+{
+  struct timer timer;
+  uint32_t count;
+  uint64_t expired; // When the function was last called.
+};
+
+static void timer_test_count(struct timer * timer)
+{
+  struct test_timer * test = container_of(timer, struct test_timer, timer);
+  test->count++;
+  test->expired = kernel_time_now();
+}
+
+static void test_timer(void)
+{
+  // There's a single timer service for good. Start it the first time that the tests run.
+  static struct task service;
+  #pragma data_alignment = 8
+  static uint8_t service_stack[STACK_SIZE];
+  static bool initialized = false;
+  if (!initialized)
+  {
+    timer_service_init(&service, service_stack, STACK_SIZE, 9);
+    initialized = true;
+  }
+
+  struct test_timer a;
+  struct test_timer b;
+  timer_init(&a.timer, timer_test_count);
+  timer_init(&b.timer, timer_test_count);
+  a.count = 0;
+  b.count = 0;
+
+  // A one-shot timer.
+  timer_start(&a.timer, 5, 0);
+  ut_assert(timer_active(&a.timer));
+  task_delay(3);
+  ut_assert(a.count == 0);
+  task_delay(3);
+  ut_assert(a.count == 1);
+  ut_assert(!timer_active(&a.timer));
+
+  // A periodic timer.
+  timer_start(&a.timer, 2, 2);
+  task_delay(9);
+  ut_assert(a.count == 4);
+  ut_assert(timer_stop(&a.timer));
+  task_delay(5);
+  ut_assert(a.count == 4);
+
+  // A stopped timer doesn't expire.
+  timer_start(&a.timer, 5, 0);
+  ut_assert(timer_stop(&a.timer));
+  ut_assert(!timer_stop(&a.timer));
+  task_delay(10);
+  ut_assert(a.count == 4);
+
+  // A timer in a higher level of the wheel is moved down in time.
+  // Starting an earlier timer wakes up the service.
+  timer_start(&b.timer, 300, 0);
+  timer_start(&a.timer, 5, 0);
+  task_delay(10);
+  ut_assert(a.count == 5);
+  ut_assert(b.count == 0);
+  task_delay(280);
+  ut_assert(b.count == 0);
+  task_delay(20);
+  ut_assert(b.count == 1);
+
+  // Timers that expire at the start of a slot of a higher level expire on time.
+  // They're moved down to the slot that the wheel is at.
+  uint32_t now = manticore_time();
+  task_delay_until((uint64_t)(now + TIMER_WHEEL_SLOTS - (now & TIMER_WHEEL_MASK)) * 1000);
+  now = manticore_time();
+  timer_start(&a.timer, 16, 0);
+  timer_start(&b.timer, 32, 0);
+  task_delay(40);
+  ut_assert(a.count == 6);
+  ut_assert(b.count == 2);
+  ut_assert(a.expired / 1000 == now + 16);
+  ut_assert(b.expired / 1000 == now + 32);
+}
+
+static void test_timer_performance(void)
+{
+  // A performance test to measure how long starting, stopping and expiring
+  // 10 and 100 timers takes. The cost per timer shouldn't grow with the number of timers.
+  // 1000 timers don't fit in the RAM that's left for the tests.
+  static struct test_timer timers[100];
+  uint32_t start_time[2];
+  uint32_t stop_time[2];
+  uint32_t counts[2] = {10, 100};
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    uint32_t count = counts[i];
+    for (uint32_t j = 0; j < count; ++j)
+    {
+      timer_init(&timers[j].timer, timer_test_count);
+      timers[j].count = 0;
+    }
+
+    // Spread the timers over the levels of the wheel.
+    uint64_t start = kernel_time_now();
+    for (uint32_t j = 0; j < count; ++j)
+    {
+      timer_start(&timers[j].timer, 1 + j * 37, 0);
+    }
+    start_time[i] = (uint32_t)(kernel_time_now() - start);
+
+    start = kernel_time_now();
+    for (uint32_t j = 0; j < count; ++j)
+    {
+      timer_stop(&timers[j].timer);
+    }
+    stop_time[i] = (uint32_t)(kernel_time_now() - start);
+
+    // Every timer expires at the same time.
+    for (uint32_t j = 0; j < count; ++j)
+    {
+      timer_start(&timers[j].timer, 5, 0);
+    }
+    uint64_t expires = kernel_time_now() + 5000;
+    task_delay(10);
+    for (uint32_t j = 0; j < count; ++j)
+    {
+      ut_assert(timers[j].count == 1);
+    }
+
+    // The last function is called within a millisecond even with 100 timers.
+    ut_assert(timers[count - 1].expired - expires < 1000);
+  }
+
+  // The cost per timer is about the same with 10 and 100 timers.
+  ut_assert(start_time[1] < start_time[0] * 10 * 2);
+  ut_assert(stop_time[1] < stop_time[0] * 10 * 2);
+}
+
+struct test_slack
+{
+  uint32_t period; // The delay in milliseconds between wakeups.
+  uint32_t slack;  // The slack in microseconds.
+  uint32_t late;   // The most that a wakeup was late by in microseconds.
+  volatile bool * stop;
+};
+
+static __task void * task_test_slack(void * arg)
+{
+  struct test_slack * test = (struct test_slack*)arg;
+  task_set_slack(test->slack);
+  test->late = 0;
+  while (!*test->stop)
+  {
+    uint64_t start = kernel_time_now();
+    task_delay(test->period);
+    uint32_t late = (uint32_t)(kernel_time_now() - start) - test->period * 1000;
+    test->late = MAX(test->late, late);
+  }
+  return NULL;
+}
+
+static void test_slack(void)
+{
+  // A task with slack wakes up with a task that has a later wakeup.
+  // Both wake up at 13ms and then at 26ms.
+  bool stop = false;
+  struct test_slack early = {.period = 10, .slack = 5000, .stop = &stop};
+  struct test_slack late = {.period = 13, .slack = 0, .stop = &stop};
+  task_init(&tasks[0], task_test_slack, &early, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_slack, &late, stacks[1], STACK_SIZE, 5);
+  task_delay(20);
+  stop = true;
+  struct task * task = &tasks[0];
+  task_wait(&task);
+  task = &tasks[1];
+  task_wait(&task);
+  ut_assert(early.late >= 2900);
+  ut_assert(early.late < 3100);
+  ut_assert(late.late < 100);
+
+  // The slack isn't used when there's no other wakeup to share.
+  // Nothing else wakes up the CPU so the task wakes up late by all of its slack at 15ms and 30ms.
+  stop = false;
+  task_init(&tasks[0], task_test_slack, &early, stacks[0], STACK_SIZE, 5);
+  task_delay(20);
+  stop = true;
+  task = &tasks[0];
+  task_wait(&task);
+  ut_assert(early.late >= 4900);
+  ut_assert(early.late < 5100);
+}
+
+static void test_slack_coalescing(void)
+{
+  // Tasks with slightly different periods wake up the CPU with
+  // a storm of interrupts unless their wakeups are coalesced.
+  struct kernel_stats stats[2];
+  uint32_t slacks[2] = {0, 5000};
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    bool stop = false;
+    struct test_slack tests[4];
+    for (uint32_t j = 0; j < 4; ++j)
+    {
+      tests[j].period = 10 + j;
+      tests[j].slack = slacks[i];
+      tests[j].stop = &stop;
+      task_init(&tasks[j], task_test_slack, &tests[j], stacks[j], STACK_SIZE, 5);
+    }
+
+    struct kernel_stats start;
+    kernel_get_stats(&start);
+    task_delay(500);
+    kernel_get_stats(&stats[i]);
+    stats[i].interrupts -= start.interrupts;
+    stats[i].idle -= start.idle;
+
+    stop = true;
+    for (uint32_t j = 0; j < 4; ++j)
+    {
+      struct task * task = &tasks[j];
+      task_wait(&task);
+      ut_assert(tests[j].late < slacks[i] + 100);
+    }
+  }
+
+  // Each wakeup has its own interrupt without slack. That's about 170 interrupts per second.
+  // With slack all 4 tasks share an interrupt about every 15ms.
+  ut_assert(stats[0].interrupts > 150);
+  ut_assert(stats[1].interrupts < 40);
+
+  // Less time is spent switching to and from the idle task.
+  ut_assert(stats[0].idle > 450000);
+  ut_assert(stats[1].idle >= stats[0].idle);
+}
+
+static __task void * task_test_timeout_server(void * arg)
+{
+  // Take 10ms to reply.
+  struct channel * channel = (struct channel*)arg;
+  uint32_t msg;
+  channel_recv(channel, &msg, sizeof(msg));
+  task_delay(10);
+  msg++;
+  channel_reply(channel, &msg, sizeof(msg));
+  return NULL;
+}
+
+static __task void * task_test_timeout_child(void * arg)
+{
+  task_delay((uint32_t)arg);
+  return arg;
+}
+
+static void test_timeout_channel(void)
+{
+  struct channel channel;
+  channel_init(&channel);
+  uint32_t msg = 1;
+  uint32_t reply = 0;
+  size_t reply_len = 0;
+
+  // Nobody sends a message.
+  uint64_t start = kernel_time_now();
+  size_t len = sizeof(msg);
+  ut_assert(!channel_timed_recv(&channel, &msg, &len, 5));
+  ut_assert(kernel_time_now() - start >= 5000);
+  ut_assert(len == sizeof(msg));
+
+  // Nobody receives the message. It's no longer queued on the channel after the timeout.
+  ut_assert(!channel_timed_send(&channel, &msg, sizeof(msg), &reply, &reply_len, 5));
+  ut_assert(!channel_timed_recv(&channel, &msg, &len, 1));
+
+  // The server receives the message but doesn't reply in time.
+  // It inherits our priority until we give up.
+  task_init(&tasks[0], task_test_timeout_server, &channel, stacks[0], STACK_SIZE, 3);
+  ut_assert(!channel_timed_send(&channel, &msg, sizeof(msg), &reply, &reply_len, 5));
+  ut_assert(task_get_priority(&tasks[0]) == 3);
+
+  // The reply is dropped.
+  struct task * task = &tasks[0];
+  task_wait(&task);
+  ut_assert(reply == 0);
+  ut_assert(reply_len == 0);
+
+  // The server replies in time.
+  task_init(&tasks[0], task_test_timeout_server, &channel, stacks[0], STACK_SIZE, 3);
+  ut_assert(channel_timed_send(&channel, &msg, sizeof(msg), &reply, &reply_len, 20));
+  ut_assert(reply == 2);
+  ut_assert(reply_len == sizeof(reply));
+  task_wait(&task);
+}
+
+static void test_timeout_task_wait(void)
+{
+  // The child doesn't return in time. It no longer inherits our priority.
+  task_init(&tasks[0], task_test_timeout_child, (void*)10, stacks[0], STACK_SIZE, 3);
+  struct task * task = &tasks[0];
+  void * result = NULL;
+  ut_assert(!task_timed_wait(&task, &result, 5));
+  ut_assert(task_get_priority(&tasks[0]) == 3);
+  ut_assert(result == NULL);
+
+  // It's still our child and we can wait for it again.
+  ut_assert(task_timed_wait(&task, &result, 10));
+  ut_assert(result == (void*)10);
+
+  // Wait for any child.
+  task_init(&tasks[0], task_test_timeout_child, (void*)10, stacks[0], STACK_SIZE, 3);
+  ut_assert(!task_timed_wait(NULL, &result, 5));
+  ut_assert(task_timed_wait(NULL, &result, 10));
+  ut_assert(result == (void*)10);
+}
+
+struct test_edf
+{
+  uint32_t deadline;      // The relative deadline in microseconds or 0 for a fixed priority task.
+  uint32_t period;        // The period in microseconds of a periodic task.
+  uint32_t work;          // The number of loops that each job burns.
+  uint64_t start;         // When a task starts its work.
+  struct task_period state;
+  struct mutex * mutex;
+  char name;
+  char ** order;          // Where each task writes its name when it's done.
+  volatile bool * stop;
+};
+
+// The number of loops of test_edf_burn() per millisecond.
+static uint32_t edf_loops_per_ms;
+
+static void test_edf_burn(uint32_t loops)
+{
+  // Count the work done rather than the time elapsed since the loop can be preempted.
+  for (volatile uint32_t i = 0; i < loops; ++i);
+}
+
+static __task void * task_test_edf_order(void * arg)
+{
+  // Every task wakes up at the same time. The earliest deadline runs first.
+  struct test_edf * test = (struct test_edf*)arg;
+  task_set_deadline(test->deadline);
+  task_delay_until(test->start);
+  *(*test->order)++ = test->name;
+  return NULL;
+}
+
+static __task void * task_test_edf_lock(void * arg)
+{
+  // Lock the mutex at the start time and hold it while sleeping 2ms.
+  struct test_edf * test = (struct test_edf*)arg;
+  task_set_deadline(test->deadline);
+  task_delay_until(test->start);
+  mutex_lock(test->mutex);
+  task_delay(2);
+  *(*test->order)++ = test->name;
+  mutex_unlock(test->mutex);
+  return NULL;
+}
+
+static __task void * task_test_edf_spin(void * arg)
+{
+  // Spin for 5ms from the start time.
+  struct test_edf * test = (struct test_edf*)arg;
+  task_set_deadline(test->deadline);
+  task_delay_until(test->start);
+  uint64_t start = kernel_time_now();
+  while (kernel_time_now() - start < 5000);
+  *(*test->order)++ = test->name;
+  return NULL;
+}
+
+static __task void * task_test_edf_periodic(void * arg)
+{
+  // The jobs are due at the end of their period and are all released together.
+  struct test_edf * test = (struct test_edf*)arg;
+  task_set_deadline(test->deadline);
+  task_set_period(&test->state, test->period, test->period, 1000);
+  while (!*test->stop)
+  {
+    test_edf_burn(test->work);
+    task_wait_period();
+  }
+  return NULL;
+}
+
+static void test_edf(void)
+{
+  // Every task wakes up at the same time. The tasks with deadlines
+  // run first in deadline order. The task without one runs last.
+  char order[3];
+  char * next = order;
+  uint64_t start = kernel_time_now() + 2000;
+  struct test_edf tests[3] = {
+    {.deadline = 20000, .start = start, .name = 'a', .order = &next},
+    {.deadline = 0, .start = start, .name = 'b', .order = &next},
+    {.deadline = 10000, .start = start, .name = 'c', .order = &next},
+  };
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    task_init(&tasks[i], task_test_edf_order, &tests[i], stacks[i], STACK_SIZE, 5);
+  }
+
+  // Waiting for a task would lend it our priority. Let them finish first.
+  task_delay(5);
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+  ut_assert(memcmp(order, "cab", 3) == 0);
+}
+
+static void test_edf_inheritance(void)
+{
+  // The low task locks the mutex right away and the high task blocks on it at 1ms.
+  // The low task has the latest deadline but the high task lends it an earlier
+  // deadline than the spinning task's. It preempts the spinning task when it wakes up.
+  struct mutex mutex;
+  mutex_init(&mutex, MUTEX_ATTR_DEFAULT);
+  char order[3];
+  char * next = order;
+  uint64_t start = kernel_time_now();
+  struct test_edf low = {.deadline = 50000, .start = start, .mutex = &mutex, .name = 'l', .order = &next};
+  struct test_edf high = {.deadline = 5000, .start = start + 1000, .mutex = &mutex, .name = 'h', .order = &next};
+  struct test_edf spin = {.deadline = 20000, .start = start + 1000, .name = 's', .order = &next};
+  task_init(&tasks[0], task_test_edf_lock, &low, stacks[0], STACK_SIZE, 5);
+  task_init(&tasks[1], task_test_edf_lock, &high, stacks[1], STACK_SIZE, 5);
+  task_init(&tasks[2], task_test_edf_spin, &spin, stacks[2], STACK_SIZE, 5);
+  task_delay(10);
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+  ut_assert(memcmp(order, "lhs", 3) == 0);
+}
+
+static uint32_t test_edf_overruns(uint32_t * periods, uint32_t * work, bool edf)
+{
+  // Rate monotonic priorities are used when the tasks don't have deadlines.
+  // The shortest period gets the highest priority.
+  bool stop = false;
+  static struct test_edf tests[3];
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    uint8_t priority = 5;
+    for (uint32_t j = 0; j < 3 && !edf; ++j)
+    {
+      if (periods[j] > periods[i] || (periods[j] == periods[i] && j > i))
+        priority++;
+    }
+    tests[i].deadline = edf ? periods[i] * 1000 : 0;
+    tests[i].period = periods[i] * 1000;
+    tests[i].work = work[i];
+    tests[i].stop = &stop;
+    task_init(&tasks[i], task_test_edf_periodic, &tests[i], stacks[i], STACK_SIZE, priority);
+  }
+
+  task_delay(EDF_RUN_MS);
+  uint32_t overruns = 0;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    struct task_period_stats stats;
+    ut_assert(task_get_period_stats(&tasks[i], &stats));
+    overruns += stats.overruns;
+  }
+
+  stop = true;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+  return overruns;
+}
+
+static uint32_t test_edf_max_utilization(uint32_t * periods, uint32_t * weights, bool edf)
+{
+  // Increase the utilization in steps of 5% until a deadline is missed.
+  uint32_t total = weights[0] + weights[1] + weights[2];
+  uint32_t utilization;
+  for (utilization = 50; utilization <= 100; utilization += 5)
+  {
+    uint32_t work[3];
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+      uint32_t percent = utilization * weights[i];
+      work[i] = periods[i] * edf_loops_per_ms * percent / total / 100;
+    }
+    if (test_edf_overruns(periods, work, edf) > 0)
+      break;
+  }
+  return utilization - 5;
+}
+
+static void test_edf_utilization(void)
+{
+  // Measure how much work the loop does in a millisecond.
+  uint64_t start = kernel_time_now();
+  test_edf_burn(10000);
+  edf_loops_per_ms = (uint32_t)(10000ull * 1000 / (kernel_time_now() - start));
+
+  // A task set that can't be scheduled with fixed priorities but can with EDF.
+  // The utilization is 2/5 + 4/7 = 97%.
+  uint32_t periods[3] = {5, 7, 100};
+  uint32_t work[3] = {2 * edf_loops_per_ms, 4 * edf_loops_per_ms, 0};
+  ut_assert(test_edf_overruns(periods, work, false) > 0);
+  ut_assert(test_edf_overruns(periods, work, true) == 0);
+
+  // Find the highest utilization that random task sets can be scheduled at.
+  static uint32_t utilization[EDF_TASK_SETS][2];
+  uint32_t seed = 1;
+  for (uint32_t set = 0; set < EDF_TASK_SETS; ++set)
+  {
+    uint32_t weights[3];
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+      seed = seed * 1103515245 + 12345;
+      periods[i] = 4 + (seed >> 16) % 17;
+      weights[i] = 1 + (seed >> 8) % 10;
+    }
+    utilization[set][0] = test_edf_max_utilization(periods, weights, false);
+    utilization[set][1] = test_edf_max_utilization(periods, weights, true);
+    ut_assert(utilization[set][1] >= utilization[set][0]);
+    ut_assert(utilization[set][1] >= 85);
+  }
+}
+
+struct test_budget
+{
+  uint64_t start;          // When the bursty task wakes up.
+  uint32_t latency;        // How late the bursty task started running.
+  volatile uint32_t count; // How many loops each task ran.
+  volatile bool * stop;
+};
+
+static __task void * task_test_budget(void * arg)
+{
+  // Run for 2ms in every 10ms at our priority and at priority 1 otherwise.
+  struct test_budget * test = (struct test_budget*)arg;
+  struct task_budget budget;
+  task_set_budget(&budget, 2000, 10000, 1);
+
+  // Wake up while the control task is running and then never block.
+  task_delay_until(test->start);
+  test->latency = (uint32_t)(kernel_time_now() - test->start);
+  while (!*test->stop)
+  {
+    test->count++;
+  }
+  return NULL;
+}
+
+static __task void * task_test_budget_control(void * arg)
+{
+  struct test_budget * test = (struct test_budget*)arg;
+  while (!*test->stop)
+  {
+    test->count++;
+  }
+  return NULL;
+}
+
+static void test_budget(void)
+{
+  // A bursty high priority task preempts a lower priority control task right away
+  // but can't take more than its budget from it.
+  bool stop = false;
+  uint64_t start = kernel_time_now() + 1000;
+  struct test_budget bursty = {.start = start, .count = 0, .stop = &stop};
+  struct test_budget control = {.count = 0, .stop = &stop};
+  task_init(&tasks[0], task_test_budget, &bursty, stacks[0], STACK_SIZE, 7);
+  task_init(&tasks[1], task_test_budget_control, &control, stacks[1], STACK_SIZE, 5);
+
+  // The bursty task runs for 100ms. It gets about 20% of the CPU since the
+  // control task never lets it run in the background.
+  task_delay_until(start + 100000);
+  stop = true;
+  uint32_t share = (uint32_t)((uint64_t)bursty.count * 100 / (bursty.count + control.count));
+  ut_assert(bursty.latency < 100);
+  ut_assert(share >= 17);
+  ut_assert(share <= 23);
+
+  // The control task returns and then the bursty task in the background.
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+}
+
+struct test_partition
+{
+  volatile uint32_t count; // How many loops the task ran.
+  struct test_partition * child; // The test of a child task to create or NULL.
+  volatile bool * stop;
+};
+
+static __task void * task_test_partition(void * arg)
+{
+  // The child is in our partition without asking for it.
+  struct test_partition * test = (struct test_partition*)arg;
+  if (test->child != NULL)
+  {
+    task_init(&tasks[2], task_test_partition, test->child, stacks[2], STACK_SIZE, 4);
+  }
+  while (!*test->stop)
+  {
+    test->count++;
+  }
+  if (test->child != NULL)
+  {
+    struct task * task = &tasks[2];
+    task_wait(&task);
+  }
+  return NULL;
+}
+
+static void test_partition(void)
+{
+  // Partition 1 gets 6ms, partition 2 gets 3ms and the background partition
+  // gets 1ms of every 10ms. The tasks of partitions 1 and 2 never block so the
+  // partition of the window is the only one that runs, whatever the priorities.
+  static const struct partition_window windows[] = {
+    {.partition = 1, .duration = 6},
+    {.partition = 2, .duration = 3},
+    {.partition = PARTITION_BACKGROUND, .duration = 1},
+  };
+  bool stop = false;
+  struct test_partition child = {.count = 0, .child = NULL, .stop = &stop};
+  struct test_partition tests[2] = {
+    {.count = 0, .child = NULL, .stop = &stop},
+    {.count = 0, .child = &child, .stop = &stop},
+  };
+  partition_set_frame(windows, 3);
+  task_init_attr(&tasks[0], task_test_partition, &tests[0], stacks[0], STACK_SIZE, 3, TASK_ATTR_PARTITION(1));
+  task_init_attr(&tasks[1], task_test_partition, &tests[1], stacks[1], STACK_SIZE, 4, TASK_ATTR_PARTITION(2));
+
+  // We're a background task. We only run again in the background window.
+  uint64_t start = kernel_time_now();
+  task_delay(100);
+  uint32_t partition1 = tests[0].count;
+  uint32_t partition2 = tests[1].count + child.count;
+  ut_assert(kernel_time_now() - start >= 100000);
+  ut_assert(kernel_time_now() - start < 110000);
+  uint32_t share = (uint32_t)((uint64_t)partition1 * 100 / (partition1 + partition2));
+  ut_assert(share >= 62);
+  ut_assert(share <= 71);
+
+  // Both tasks of partition 2 shared its windows.
+  ut_assert(child.count > tests[1].count / 2);
+  ut_assert(tests[1].count > child.count / 2);
+
+  stop = true;
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+
+  // The background partition gets the windows of partitions that have nothing to run.
+  start = kernel_time_now();
+  task_delay(5);
+  ut_assert(kernel_time_now() - start < 5100);
+  partition_set_frame(NULL, 0);
+}
+
+static void test_partition_threshold(void)
+{
+  // A job of partition 2 with a preemption threshold is switched out part way through
+  // when its window ends. Partition 1 has nothing ready but its window isn't given to the job.
+  static const struct partition_window windows[] = {
+    {.partition = 1, .duration = 5},
+    {.partition = 2, .duration = 5},
+  };
+  bool stop = false;
+  struct test_partition test = {.count = 0, .child = NULL, .stop = &stop};
+  task_init_attr(&tasks[0], task_test_partition, &test, stacks[0], STACK_SIZE, 3, TASK_ATTR_PARTITION(2));
+  task_set_threshold(&tasks[0], 6);
+
+  // Without a major frame the job runs the whole time that we sleep.
+  task_delay(10);
+  uint32_t full = test.count;
+
+  // With the frame it only runs in the windows of partition 2, half of the time.
+  partition_set_frame(windows, 2);
+  task_delay(100);
+  uint32_t windowed = test.count - full;
+  partition_set_frame(NULL, 0);
+  ut_assert(windowed > full * 3);
+  ut_assert(windowed < full * 7);
+
+  stop = true;
+  struct task * task = &tasks[0];
+  task_wait(&task);
+}
+
+struct test_threshold
+{
+  uint64_t start;            // When the task wakes up.
+  uint32_t spin;             // How long the task spins for in microseconds.
+  uint32_t period;           // The period of the task in microseconds.
+  uint32_t work;             // The loops of test_edf_burn() per job.
+  uint8_t threshold;
+  bool lower;                // Whether the task drops its threshold once it's done spinning.
+  char name;
+  char ** order;             // Where each task writes its name when it's done.
+  struct task_period state;
+  volatile uint32_t * active;     // The number of jobs that have started but not completed.
+  volatile uint32_t * max_active; // The most jobs that were ever active together.
+  volatile bool * stop;
+};
+
+static __task void * task_test_threshold(void * arg)
+{
+  // Spin from the start time and then maybe drop our threshold.
+  struct test_threshold * test = (struct test_threshold*)arg;
+  task_set_threshold(NULL, test->threshold);
+  task_delay_until(test->start);
+  uint64_t start = kernel_time_now();
+  while (kernel_time_now() - start < test->spin);
+  if (test->lower)
+  {
+    task_set_threshold(NULL, 0);
+  }
+  *(*test->order)++ = test->name;
+  return NULL;
+}
+
+static __task void * task_test_threshold_periodic(void * arg)
+{
+  // Every job that is preempted part way through needs its own stack frame.
+  // Count the jobs that are active together to find the stack that they need.
+  struct test_threshold * test = (struct test_threshold*)arg;
+  task_set_threshold(NULL, test->threshold);
+  task_set_period(&test->state, test->period, test->period, 1000);
+  while (!*test->stop)
+  {
+    kernel_scheduler_disable();
+    uint32_t active = ++*test->active;
+    *test->max_active = MAX(*test->max_active, active);
+    kernel_scheduler_enable();
+
+    test_edf_burn(test->work);
+
+    kernel_scheduler_disable();
+    --*test->active;
+    kernel_scheduler_enable();
+    task_wait_period();
+  }
+  return NULL;
+}
+
+static uint32_t test_threshold_switches(bool threshold, uint32_t * max_active)
+{
+  // Run 4 periodic tasks with rate monotonic priorities for 200ms. Each job takes 1ms.
+  // The thresholds put all the tasks at the priority of the highest one while they run.
+  static const uint32_t periods[4] = {4, 5, 6, 7};
+  static struct test_threshold tests[4];
+  volatile uint32_t active = 0;
+  volatile uint32_t max = 0;
+  volatile bool stop = false;
+  for (uint32_t i = 0; i < 4; ++i)
+  {
+    tests[i] = (struct test_threshold){
+      .period = periods[i] * 1000,
+      .work = edf_loops_per_ms,
+      .threshold = threshold ? 7 : 0,
+      .active = &active,
+      .max_active = &max,
+      .stop = &stop
+    };
+    task_init(&tasks[i], task_test_threshold_periodic, &tests[i], stacks[i], STACK_SIZE, 7 - i);
+  }
+
+  struct kernel_stats before;
+  struct kernel_stats after;
+  kernel_get_stats(&before);
+  task_delay(200);
+  kernel_get_stats(&after);
+
+  stop = true;
+  for (uint32_t i = 0; i < 4; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+  *max_active = max;
+  return after.switches - before.switches;
+}
+
+static void test_threshold(void)
+{
+  // L spins from the start time for 3ms with a threshold of 6. M wakes up after
+  // 1ms but can't preempt it. The SysTick doesn't even fire for it. M runs as
+  // soon as L drops its threshold.
+  char order[3];
+  char * next = order;
+  uint64_t start = kernel_time_now() + 2000;
+  struct test_threshold tests[3] = {
+    {.start = start, .spin = 3000, .threshold = 6, .lower = true, .name = 'l', .order = &next},
+    {.start = start + 1000, .name = 'm', .order = &next},
+  };
+  task_init(&tasks[0], task_test_threshold, &tests[0], stacks[0], STACK_SIZE, 4);
+  task_init(&tasks[1], task_test_threshold, &tests[1], stacks[1], STACK_SIZE, 5);
+  task_delay(10);
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+  ut_assert(next == order + 2);
+  ut_assert(order[0] == 'm');
+  ut_assert(order[1] == 'l');
+
+  // This time H wakes up after 1ms and preempts L. M wakes up while H spins for 2ms.
+  // L is part way through its job so it keeps its threshold and finishes before M.
+  next = order;
+  start = kernel_time_now() + 2000;
+  tests[0] = (struct test_threshold){.start = start, .spin = 3000, .threshold = 6, .name = 'l', .order = &next};
+  tests[1] = (struct test_threshold){.start = start + 2000, .name = 'm', .order = &next};
+  tests[2] = (struct test_threshold){.start = start + 1000, .spin = 2000, .name = 'h', .order = &next};
+  task_init(&tasks[0], task_test_threshold, &tests[0], stacks[0], STACK_SIZE, 4);
+  task_init(&tasks[1], task_test_threshold, &tests[1], stacks[1], STACK_SIZE, 5);
+  task_init(&tasks[2], task_test_threshold, &tests[2], stacks[2], STACK_SIZE, 7);
+  task_delay(10);
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    struct task * task = &tasks[i];
+    task_wait(&task);
+  }
+  ut_assert(next == order + 3);
+  ut_assert(order[0] == 'h');
+  ut_assert(order[1] == 'l');
+  ut_assert(order[2] == 'm');
+}
+
+static void test_threshold_switches_and_stack(void)
+{
+  // Without thresholds the jobs preempt each other and nest. That costs context
+  // switches and every nested job needs stack. With them a job always completes
+  // before the next one starts so the tasks could share a single stack.
+  uint32_t nested;
+  uint32_t single;
+  uint32_t preempting = test_threshold_switches(false, &nested);
+  uint32_t threshold = test_threshold_switches(true, &single);
+  ut_assert(nested > 1);
+  ut_assert(single == 1);
+  ut_assert(threshold < preempting);
+}
+
 static void assert_full_time_slice(void)
 {
   // Make sure that we were given a 10ms time slice
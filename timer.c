@@ -0,0 +1,266 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "timer.h"
+
+#include "manticore.h"
+
+#include "kernel.h"
+#include "utils.h"
+
+#include <assert.h>
+
+static struct
+{
+  struct list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  uint16_t bitmaps[TIMER_WHEEL_LEVELS]; // The slots of each level that aren't empty.
+  uint32_t now;                         // The time that the wheel is at.
+
+  // The time that the service task will wake up at and whether it's waiting for that time.
+  // Starting a timer that expires earlier changes the generation to wake it up.
+  struct task * service;
+  uint32_t wakeup;
+  bool sleeping;
+  volatile uint32_t generation;
+} wheel;
+
+static __task void * timer_service(void * arg);
+static void timer_insert(struct timer * timer);
+static void timer_remove(struct timer * timer);
+static void timer_cascade(uint32_t level);
+static void timer_advance(uint32_t time);
+static bool timer_next(uint32_t * time);
+
+void timer_service_init(struct task * task, void * stack, uint32_t stack_size, uint8_t priority)
+{
+  assert(wheel.service == NULL);
+  for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+  {
+    for (uint32_t slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+    {
+      list_init(&wheel.slots[level][slot]);
+    }
+    wheel.bitmaps[level] = 0;
+  }
+  wheel.now = manticore_time();
+  wheel.service = task;
+  wheel.sleeping = false;
+  wheel.generation = 0;
+
+  // Detached because the service serves the wheel for good and isn't joined.
+  task_init_attr(task, timer_service, NULL, stack, stack_size, priority, TASK_ATTR_DETACHED);
+}
+
+void timer_init(struct timer * timer, void (*func)(struct timer *))
+{
+  assert(func != NULL);
+  timer->func = func;
+  timer->expires = 0;
+  timer->period = 0;
+  list_init(&timer->node);
+}
+
+void timer_start(struct timer * timer, uint32_t milliseconds, uint32_t period)
+{
+  assert(wheel.service != NULL);
+  kernel_scheduler_disable();
+  if (!list_empty(&timer->node))
+  {
+    timer_remove(timer);
+  }
+  // The wheel may have run the current slot already. A timer can't expire before the next one.
+  timer->expires = manticore_time() + MAX(milliseconds, 1);
+  timer->period = period;
+  timer_insert(timer);
+
+  if (!wheel.sleeping || (int32_t)(timer->expires - wheel.wakeup) >= 0)
+  {
+    // The service will get to the timer in time.
+    kernel_scheduler_enable();
+    return;
+  }
+
+  // The service needs to wake up earlier.
+  wheel.sleeping = false;
+  wheel.generation++;
+  kernel_scheduler_enable();
+  wake_address(&wheel.generation, 1);
+}
+
+bool timer_stop(struct timer * timer)
+{
+  kernel_scheduler_disable();
+  bool active = !list_empty(&timer->node);
+  if (active)
+  {
+    // The service may wake up for nothing. That's cheaper than finding its next wakeup.
+    timer_remove(timer);
+  }
+  kernel_scheduler_enable();
+  return active;
+}
+
+bool timer_active(struct timer * timer)
+{
+  return !list_empty(&timer->node);
+}
+
+void timer_insert(struct timer * timer)
+{
+  // A timer that expires at the time the wheel reached was moved down from a higher level.
+  // It goes in the current slot which runs once the cascade is done.
+  // Timers that already expired go in the next slot.
+  int32_t delta = (int32_t)(timer->expires - wheel.now);
+  uint32_t expires = delta >= 0 ? timer->expires : wheel.now + 1;
+  uint32_t ticks = expires - wheel.now;
+
+  // Find the lowest level whose range holds the timer.
+  uint32_t level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && ticks >= (1u << ((level + 1) * TIMER_WHEEL_BITS)))
+  {
+    level++;
+  }
+  if (ticks >= TIMER_WHEEL_RANGE)
+  {
+    // Too far away. Park it in the furthest slot of the top level until it comes within range.
+    expires = wheel.now + TIMER_WHEEL_RANGE - 1;
+  }
+
+  uint32_t slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+  list_push_back(&wheel.slots[level][slot], &timer->node);
+  wheel.bitmaps[level] |= 1 << slot;
+  timer->slot = level * TIMER_WHEEL_SLOTS + slot;
+}
+
+void timer_remove(struct timer * timer)
+{
+  uint32_t level = timer->slot / TIMER_WHEEL_SLOTS;
+  uint32_t slot = timer->slot % TIMER_WHEEL_SLOTS;
+  list_remove(&timer->node);
+  if (list_empty(&wheel.slots[level][slot]))
+  {
+    wheel.bitmaps[level] &= ~(1 << slot);
+  }
+}
+
+void timer_cascade(uint32_t level)
+{
+  // Move the timers in the slot that the wheel reached down a level.
+  uint32_t slot = (wheel.now >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+  if (slot == 0 && level < TIMER_WHEEL_LEVELS - 1)
+  {
+    timer_cascade(level + 1);
+  }
+
+  struct list_head timers;
+  list_init(&timers);
+  list_append(&timers, &wheel.slots[level][slot]);
+  wheel.bitmaps[level] &= ~(1 << slot);
+  while (!list_empty(&timers))
+  {
+    timer_insert(container_of(list_pop_front(&timers), struct timer, node));
+  }
+}
+
+void timer_advance(uint32_t time)
+{
+  // Run the timers in each slot from where the wheel is to <time>.
+  while ((int32_t)(time - wheel.now) > 0)
+  {
+    if (wheel.bitmaps[0] == 0)
+    {
+      // The lowest level is empty. Skip to where it wraps around or to <time>.
+      uint32_t wrap = (wheel.now | TIMER_WHEEL_MASK) + 1;
+      wheel.now = (int32_t)(time - wrap) < 0 ? time : wrap;
+    }
+    else
+    {
+      wheel.now++;
+    }
+
+    uint32_t slot = wheel.now & TIMER_WHEEL_MASK;
+    if (slot == 0)
+    {
+      timer_cascade(1);
+    }
+
+    // The callbacks run with the scheduler enabled. They can start and stop timers.
+    struct list_head * node;
+    while ((node = list_pop_front(&wheel.slots[0][slot])) != NULL)
+    {
+      struct timer * timer = container_of(node, struct timer, node);
+      if (list_empty(&wheel.slots[0][slot]))
+      {
+        wheel.bitmaps[0] &= ~(1 << slot);
+      }
+      if (timer->period > 0)
+      {
+        // Periodic timers are restarted from when they should have expired so they don't drift.
+        timer->expires += timer->period;
+        timer_insert(timer);
+      }
+      kernel_scheduler_enable();
+      timer->func(timer);
+      kernel_scheduler_disable();
+    }
+  }
+}
+
+bool timer_next(uint32_t * time)
+{
+  // The earliest start of a slot with timers. The timers in
+  // a slot above the lowest level are moved down at that time.
+  bool found = false;
+  for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+  {
+    if (wheel.bitmaps[level] == 0)
+      continue;
+
+    uint32_t shift = level * TIMER_WHEEL_BITS;
+    uint32_t current = (wheel.now >> shift) & TIMER_WHEEL_MASK;
+    uint32_t i = 1;
+    while (!(wheel.bitmaps[level] & (1 << ((current + i) & TIMER_WHEEL_MASK))))
+    {
+      i++;
+    }
+    uint32_t start = ((wheel.now >> shift) + i) << shift;
+    if (!found || (int32_t)(start - *time) < 0)
+    {
+      *time = start;
+      found = true;
+    }
+  }
+  return found;
+}
+
+__task void * timer_service(void * arg)
+{
+  while (true)
+  {
+    kernel_scheduler_disable();
+    timer_advance(manticore_time());
+    uint32_t generation = wheel.generation;
+    uint32_t timeout = 0;
+    wheel.sleeping = timer_next(&wheel.wakeup);
+    if (wheel.sleeping)
+    {
+      int32_t left = (int32_t)(wheel.wakeup - manticore_time());
+      timeout = MAX(left, 1);
+    }
+    else
+    {
+      // There are no timers. Sleep until one is started.
+      wheel.sleeping = true;
+      wheel.wakeup = wheel.now + 0x7FFFFFFF;
+    }
+    kernel_scheduler_enable();
+    wait_on_address(&wheel.generation, generation, timeout);
+  }
+}
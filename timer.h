@@ -0,0 +1,47 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Software timers call a function from the timer service task once they
+ * expire. The timers are kept in a hierarchical timing wheel. Each level has
+ * TIMER_WHEEL_SLOTS slots and each slot of a level covers as much time as
+ * the whole level below it. A timer goes in the lowest level that can hold
+ * it so starting and stopping a timer is constant time. The timers in a slot
+ * of a higher level are moved down a level once the wheel reaches that slot.
+ * The service task sleeps until the next slot that holds timers so its
+ * wakeup is what the scheduler programs the SysTick for.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "list.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Each level has 16 slots. 6 levels cover 2^24ms which is about 4.6 hours.
+// Timers that expire later than that are moved down once they're within range.
+#define TIMER_WHEEL_BITS (4)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS (6)
+#define TIMER_WHEEL_RANGE (1u << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))
+
+struct timer
+{
+  void (*func)(struct timer * timer);
+  uint32_t expires; // The time that the timer expires at. See manticore_time().
+  uint32_t period;  // The time between expiries of a periodic timer or 0.
+  uint8_t slot;     // The index of the slot that the timer is in, counting from the lowest level.
+  struct list_head node; // Queued on a slot of the wheel while the timer is running.
+};
+
+#endif
@@ -61,6 +61,16 @@ void tree_remove(struct tree_head * node)
   list_remove(&node->siblings);
 }
 
+void tree_remove_adopt(struct tree_head * node, struct tree_head * adopter)
+{
+  assert(node != NULL);
+  assert(adopter != NULL);
+  assert(adopter != node);
+
+  list_append(&adopter->children, &node->children);
+  list_remove(&node->siblings);
+}
+
 void tree_remove_child(struct tree_head * node)
 {
   assert(node != NULL);
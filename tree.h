@@ -30,6 +30,12 @@ void tree_add_child(struct tree_head * node, struct tree_head * child);
 // WARNING: not tested
 void tree_remove(struct tree_head * node);
 
+// The node is removed from the tree.
+// All the node's children become <adopter>'s children in constant time.
+// The children's parent pointers are left pointing to the removed node
+// so the caller has to detect that when it uses them.
+void tree_remove_adopt(struct tree_head * node, struct tree_head * adopter);
+
 // The node loses its parent and becomes the root node in a new tree.
 // The node keeps all its children.
 void tree_remove_child(struct tree_head * node);
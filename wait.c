@@ -0,0 +1,116 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "wait.h"
+
+#include "manticore.h"
+
+#include "syscall.h"
+#include "kernel.h"
+#include "utils.h"
+
+#include <assert.h>
+
+void wait_object_init(struct wait_object * object, uint8_t type, void * handle)
+{
+  assert(object != NULL);
+  assert(handle != NULL);
+  object->type = type;
+  object->object = handle;
+  object->task = NULL;
+  list_init(&object->node);
+}
+
+int32_t wait_multiple(struct wait_object * objects, uint32_t count, uint32_t milliseconds)
+{
+  assert(objects != NULL);
+  assert(count > 0);
+
+  // Check if one of the objects is already ready.
+  // There's no need to enter the kernel if that's the case.
+  kernel_scheduler_disable();
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (wait_object_poll(&objects[i]))
+    {
+      kernel_scheduler_enable();
+      return i;
+    }
+  }
+
+  running_task->wait_objects = objects;
+  running_task->wait_count = count;
+  running_task->sleep = milliseconds;
+  SVC_WAIT_MULTIPLE();
+  return running_task->wait_index;
+}
+
+bool wait_object_poll(struct wait_object * object)
+{
+  switch (object->type)
+  {
+  case WAIT_OBJECT_CHANNEL:
+    {
+      // A channel is ready when a task has sent a message to it.
+      struct channel * channel = (struct channel *)object->object;
+      return !pqueue_empty(&channel->waiting_tasks);
+    }
+  case WAIT_OBJECT_MUTEX:
+    {
+      // A mutex is ready when we've locked it.
+      struct mutex * mutex = (struct mutex *)object->object;
+      if (!mutex->locked || (mutex->recursive && mutex->owner == running_task))
+      {
+        mutex_acquire(mutex, running_task);
+        return true;
+      }
+      return false;
+    }
+  default:
+    assert(false);
+    return false;
+  }
+}
+
+struct pqueue * wait_object_queue(struct wait_object * object)
+{
+  switch (object->type)
+  {
+  case WAIT_OBJECT_CHANNEL:
+    return &((struct channel *)object->object)->multi_waiters;
+  case WAIT_OBJECT_MUTEX:
+    return &((struct mutex *)object->object)->multi_waiters;
+  default:
+    assert(false);
+    return NULL;
+  }
+}
+
+void wait_multiple_requeue(struct task * task, bool increase)
+{
+  if (task->state != STATE_WAIT_MULTIPLE)
+    return;
+
+  for (uint32_t i = 0; i < task->wait_count; ++i)
+  {
+    struct wait_object * object = &task->wait_objects[i];
+    if (increase)
+      pqueue_increase(wait_object_queue(object), &object->node);
+    else
+      pqueue_decrease(wait_object_queue(object), &object->node);
+  }
+}
+
+bool pqueue_wait_object_compare(struct list_head * a, struct list_head * b)
+{
+  struct wait_object * wa = wait_object_from_node(a);
+  struct wait_object * wb = wait_object_from_node(b);
+  return task_precedes(wa->task, wb->task);
+}
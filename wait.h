@@ -0,0 +1,55 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Waiting on multiple objects lets a single task block until one of
+ * several kernel objects becomes ready. Each object that is waited on
+ * gets its own wait_object which is queued on that kernel object.
+ * When one of the objects becomes ready the other wait_objects are
+ * simply unlinked from their queues.
+ */
+
+#ifndef WAIT_H
+#define WAIT_H
+
+#include "pqueue.h"
+#include "task.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct wait_object
+{
+  uint8_t type;   // The type of object. See WAIT_OBJECT_*.
+  void * object;  // The channel, mutex, ... that we're waiting on.
+
+  // The task waiting on the object and the node used to queue
+  // the task on the object's priority queue of multiple waiters.
+  struct task * task;
+  struct list_head node;
+};
+
+// Returns true and takes the object if it's ready.
+// Must be called with the scheduler disabled or from the kernel.
+bool wait_object_poll(struct wait_object * object);
+
+// Returns the queue of multiple waiters of an object.
+struct pqueue * wait_object_queue(struct wait_object * object);
+
+// Moves a task that's waiting on multiple objects in their queues after its
+// priority or deadline increased or decreased. Does nothing for other tasks.
+void wait_multiple_requeue(struct task * task, bool increase);
+
+// Compares the priority and deadline of 2 waiting tasks given their wait_objects.
+bool pqueue_wait_object_compare(struct list_head * a, struct list_head * b);
+
+#define wait_object_from_node(ptr) container_of((ptr), struct wait_object, node)
+
+#endif
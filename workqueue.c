@@ -0,0 +1,130 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+#include "workqueue.h"
+
+#include "manticore.h"
+
+#include "system.h"
+#include "syscall.h"
+#include "kernel.h"
+
+#include <assert.h>
+
+static __task void * workqueue_worker(void * arg);
+static struct work * workqueue_pop(struct workqueue * queue);
+static void workqueue_deferred(struct deferred_work * work);
+
+void work_init(struct work * work, void (*func)(void *), void * arg)
+{
+  assert(func != NULL);
+  work->func = func;
+  work->arg = arg;
+  list_init(&work->node);
+}
+
+void workqueue_init(struct workqueue * queue,
+                    struct task * workers,
+                    void * stacks,
+                    uint32_t stack_size,
+                    uint32_t count,
+                    uint8_t priority)
+{
+  assert(count > 0);
+  list_init(&queue->pending);
+  pqueue_init(&queue->idle_workers, pqueue_wait_compare);
+  deferred_work_init(&queue->deferred, workqueue_deferred);
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    // Workers loop on the queue forever. They're detached since nothing joins them.
+    task_init_attr(&workers[i], workqueue_worker, queue,
+                   (uint8_t*)stacks + i * stack_size, stack_size, priority,
+                   TASK_ATTR_DETACHED);
+  }
+}
+
+void workqueue_submit(struct workqueue * queue, struct work * work)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (list_empty(&work->node))
+  {
+    list_push_back(&queue->pending, &work->node);
+  }
+  __set_PRIMASK(primask);
+
+  if (pqueue_empty(&queue->idle_workers))
+  {
+    // Every worker is busy. One of them will pick up the job once it's done.
+    return;
+  }
+
+  if (SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk)
+  {
+    // We're in an ISR. The kernel will wake up a worker.
+    kernel_defer(&queue->deferred);
+  }
+  else
+  {
+    running_task->workqueue = queue;
+    SVC_WORKQUEUE_WAKE();
+  }
+}
+
+bool workqueue_pending(struct workqueue * queue)
+{
+  return !list_empty(&queue->pending);
+}
+
+void workqueue_wake(struct workqueue * queue)
+{
+  if (workqueue_pending(queue) && !pqueue_empty(&queue->idle_workers))
+  {
+    struct task * worker = task_from_wait_node(pqueue_peek(&queue->idle_workers));
+    task_stop_waiting(worker);
+    worker->state = STATE_READY;
+    task_wait_on(worker, &ready_tasks);
+  }
+}
+
+struct work * workqueue_pop(struct workqueue * queue)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  struct list_head * node = list_pop_front(&queue->pending);
+  __set_PRIMASK(primask);
+  return node != NULL ? container_of(node, struct work, node) : NULL;
+}
+
+void workqueue_deferred(struct deferred_work * work)
+{
+  workqueue_wake(container_of(work, struct workqueue, deferred));
+}
+
+__task void * workqueue_worker(void * arg)
+{
+  struct workqueue * queue = (struct workqueue *)arg;
+  while (true)
+  {
+    // Run every pending job before going back to sleep.
+    struct work * work = workqueue_pop(queue);
+    if (work != NULL)
+    {
+      work->func(work->arg);
+    }
+    else
+    {
+      // The kernel checks again before blocking in case a job is submitted before we get there.
+      running_task->workqueue = queue;
+      SVC_WORKQUEUE_WAIT();
+    }
+  }
+}
@@ -0,0 +1,53 @@
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <kevinmottashed@gmail.com> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return.
+ * -Kevin Mottashed
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * A work queue runs short jobs on a pool of worker tasks that are created
+ * once. Submitting a job only queues it and wakes an idle worker, if there
+ * is one. A worker runs every queued job before it goes back to sleep so
+ * jobs submitted while the workers are busy don't cost a system call.
+ * Interrupts are masked while the queue is updated so jobs can be
+ * submitted from ISRs. An ISR can't enter the kernel so it defers waking
+ * a worker to the next time the scheduler runs.
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "kernel.h"
+#include "list.h"
+#include "pqueue.h"
+
+struct work
+{
+  void (*func)(void * arg);
+  void * arg;
+  struct list_head node; // Queued on the work queue while it's pending.
+};
+
+struct workqueue
+{
+  // The jobs that haven't been picked up by a worker yet.
+  struct list_head pending;
+
+  // The workers waiting for a job.
+  struct pqueue idle_workers;
+
+  // Wakes a worker for the jobs submitted from ISRs.
+  struct deferred_work deferred;
+};
+
+// Wakes an idle worker if there are pending jobs. Must be called from the kernel.
+void workqueue_wake(struct workqueue * queue);
+
+// Returns true if there are pending jobs. Safe to call from ISRs and the kernel.
+bool workqueue_pending(struct workqueue * queue);
+
+#endif